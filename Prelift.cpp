@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <llvm/Support/ManagedStatic.h>
+
+#include "remill/Arch/Arch.h"
+#include "remill/Arch/Name.h"
+#include "remill/OS/OS.h"
+
+#include "vmill/BC/Trace.h"
+#include "vmill/Executor/Executor.h"
+#include "vmill/Program/Snapshot.h"
+#include "vmill/Workspace/Workspace.h"
+
+DECLARE_string(arch);
+DECLARE_string(os);
+DECLARE_uint64(num_lift_threads);
+DECLARE_uint64(num_compile_threads);
+
+DEFINE_string(entry_pcs, "",
+              "Comma-separated list of hexadecimal program counters of "
+              "additional code to lift, e.g. of functions that are only "
+              "reached indirectly.");
+
+namespace {
+
+static std::vector<vmill::PC> ParseEntryPCs(void) {
+  std::vector<vmill::PC> pcs;
+  std::stringstream ss(FLAGS_entry_pcs);
+  for (std::string pc_str; std::getline(ss, pc_str, ',');) {
+    if (pc_str.empty()) {
+      continue;
+    }
+    char *end = nullptr;
+    const auto pc = std::strtoull(pc_str.c_str(), &end, 16);
+    CHECK(end && !*end)
+        << "Invalid program counter " << pc_str << " in `--entry_pcs`";
+    pcs.push_back(static_cast<vmill::PC>(pc));
+  }
+  return pcs;
+}
+
+// Nothing runs while prelifting, so unless told otherwise, lift and compile
+// on every core.
+static void UseAllCores(void) {
+  const auto num_cores = std::max(1U, std::thread::hardware_concurrency());
+  if (google::GetCommandLineFlagInfoOrDie("num_lift_threads").is_default) {
+    FLAGS_num_lift_threads = num_cores;
+  }
+  if (google::GetCommandLineFlagInfoOrDie("num_compile_threads").is_default) {
+    FLAGS_num_compile_threads = num_cores;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+
+  std::stringstream ss;
+  ss << std::endl << std::endl
+     << "  " << argv[0] << " \\" << std::endl
+     << "    [--tool TOOL_NAME_OR_PATH] \\" << std::endl
+     << "    [--workspace WORKSPACE_DIR] \\" << std::endl
+     << "    [--entry_pcs PC,PC,...]" << std::endl;
+
+  google::InitGoogleLogging(argv[0]);
+  google::SetUsageMessage(ss.str());
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  FLAGS_logtostderr = true;
+
+  UseAllCores();
+  const auto extra_pcs = ParseEntryPCs();
+  auto snapshot = vmill::LoadSnapshotFromFile(vmill::Workspace::SnapshotPath());
+
+  // Take the target architecture from the snapshot file.
+  FLAGS_arch = snapshot->arch();
+  const auto arch_name = remill::GetArchName(FLAGS_arch);
+  CHECK(remill::kArchInvalid != arch_name)
+      << "Snapshot file corrupted; invalid architecture " << FLAGS_arch;
+
+  // Take the target OS from the snapshot file.
+  FLAGS_os = snapshot->os();
+  const auto os_name = remill::GetOSName(FLAGS_os);
+  CHECK(remill::kOSInvalid != os_name)
+      << "Snapshot file corrupted; invalid OS " << FLAGS_os;
+
+  vmill::Executor executor;
+  vmill::Workspace::LoadSnapshotIntoExecutor(snapshot, executor);
+  executor.Prelift(extra_pcs);
+
+  llvm::llvm_shutdown();
+  google::ShutDownCommandLineFlags();
+  google::ShutdownGoogleLogging();
+  return EXIT_SUCCESS;
+}
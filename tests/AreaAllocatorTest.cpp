@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "vmill/Util/AreaAllocator.h"
+
+namespace vmill {
+namespace {
+
+using FreeRange = std::pair<uint8_t *, size_t>;
+
+static std::vector<FreeRange> FreeRanges(const AreaAllocator &allocator) {
+  std::vector<FreeRange> ranges;
+  allocator.ForEachFreeRange([&ranges] (uint8_t *addr, size_t size) {
+    ranges.emplace_back(addr, size);
+  });
+  return ranges;
+}
+
+}  // namespace
+
+TEST(AreaAllocatorTest, FreeCoalescesWithBothNeighbours) {
+  AreaAllocator allocator(kAreaRW);
+  auto a = allocator.Allocate(256, 16);
+  auto b = allocator.Allocate(256, 16);
+  auto c = allocator.Allocate(256, 16);
+  auto d = allocator.Allocate(256, 16);
+  ASSERT_EQ(a + 256, b);
+  ASSERT_EQ(b + 256, c);
+  ASSERT_EQ(c + 256, d);
+
+  allocator.Free(a, 256);
+  allocator.Free(c, 256);
+  EXPECT_EQ((std::vector<FreeRange>{{a, 256}, {c, 256}}),
+            FreeRanges(allocator));
+
+  allocator.Free(b, 256);
+  EXPECT_EQ((std::vector<FreeRange>{{a, 768}}), FreeRanges(allocator));
+
+  allocator.Free(d, 256);
+  EXPECT_EQ((std::vector<FreeRange>{{a, 1024}}), FreeRanges(allocator));
+}
+
+TEST(AreaAllocatorTest, FreeCoalescesInAnyOrder) {
+  AreaAllocator allocator(kAreaRW);
+  auto a = allocator.Allocate(128);
+  auto b = allocator.Allocate(128);
+  auto c = allocator.Allocate(128);
+  allocator.Allocate(128);  // Keeps `c` from being at the end.
+
+  allocator.Free(c, 128);
+  allocator.Free(b, 128);
+  EXPECT_EQ((std::vector<FreeRange>{{b, 256}}), FreeRanges(allocator));
+
+  allocator.Free(a, 128);
+  EXPECT_EQ((std::vector<FreeRange>{{a, 384}}), FreeRanges(allocator));
+}
+
+TEST(AreaAllocatorTest, FreeDoesNotCoalesceWithDistantRanges) {
+  AreaAllocator allocator(kAreaRW);
+  auto a = allocator.Allocate(64);
+  allocator.Allocate(64);
+  auto c = allocator.Allocate(64);
+
+  allocator.Free(a, 64);
+  allocator.Free(c, 64);
+  allocator.Free(c, 0);
+  EXPECT_EQ((std::vector<FreeRange>{{a, 64}, {c, 64}}),
+            FreeRanges(allocator));
+}
+
+TEST(AreaAllocatorTest, AllocateReusesCoalescedRanges) {
+  AreaAllocator allocator(kAreaRW);
+  auto a = allocator.Allocate(100);
+  auto b = allocator.Allocate(100);
+  allocator.Allocate(100);
+
+  allocator.Free(a, 100);
+  allocator.Free(b, 100);
+
+  // Neither freed range fits on its own.
+  EXPECT_EQ(a, allocator.Allocate(150));
+  EXPECT_EQ((std::vector<FreeRange>{{a + 150, 50}}), FreeRanges(allocator));
+
+  // Alignment padding stays on the free list.
+  allocator.FreeAll();
+  auto base = allocator.Allocate(16, 64);
+  auto e = allocator.Allocate(112);
+  allocator.Allocate(16);
+  allocator.Free(e, 112);
+  EXPECT_EQ(base + 64, allocator.Allocate(32, 64));
+  EXPECT_EQ((std::vector<FreeRange>{{e, 48}, {base + 96, 32}}),
+            FreeRanges(allocator));
+}
+
+}  // namespace vmill
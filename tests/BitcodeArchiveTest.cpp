@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "tests/TempDirectory.h"
+#include "vmill/Workspace/BitcodeArchive.h"
+
+namespace vmill {
+namespace {
+
+using Module = std::pair<std::string, std::string>;
+
+static std::vector<Module> ReadModules(const std::string &path) {
+  std::vector<Module> modules;
+  auto archive = BitcodeArchive::Open(path);
+  archive->ForEachModule(
+      [&modules] (const std::string &name, const char *data, size_t size) {
+        modules.emplace_back(name, std::string(data, size));
+      });
+  return modules;
+}
+
+static void WriteModules(const std::string &path,
+                         const std::vector<Module> &modules) {
+  auto archive = BitcodeArchive::Open(path);
+  for (const auto &module : modules) {
+    archive->Add(module.first, module.second);
+  }
+  archive->Flush();
+}
+
+static uint64_t FileSize(const std::string &path) {
+  struct stat info = {};
+  EXPECT_EQ(0, stat(path.c_str(), &info));
+  return static_cast<uint64_t>(info.st_size);
+}
+
+class BitcodeArchiveTest : public TempDirectoryTest {
+ protected:
+  const std::vector<Module> modules = {
+      {"trace_1", std::string(100, 'a')},
+      {"trace_2", std::string(200, 'b')},
+      {"trace_3", std::string(300, 'c')}};
+};
+
+}  // namespace
+
+TEST_F(BitcodeArchiveTest, ModulesPersistAcrossOpens) {
+  const auto path = Path("bitcode");
+  WriteModules(path, {modules[0]});
+  WriteModules(path, {modules[1], modules[2]});
+  EXPECT_EQ(modules, ReadModules(path));
+}
+
+TEST_F(BitcodeArchiveTest, IndexOfTruncatedArchiveIsTruncated) {
+  const auto path = Path("bitcode");
+  const auto index_path = path + ".index";
+  WriteModules(path, modules);
+  ASSERT_EQ(3 * sizeof(BitcodeArchiveEntry), FileSize(index_path));
+
+  // Lose the end of the last module, as if the system crashed before the
+  // archive's data reached the disk.
+  ASSERT_EQ(0, truncate(path.c_str(), static_cast<off_t>(FileSize(path) - 1)));
+
+  EXPECT_EQ((std::vector<Module>{modules[0], modules[1]}), ReadModules(path));
+  EXPECT_EQ(2 * sizeof(BitcodeArchiveEntry), FileSize(index_path));
+
+  // New modules are indexed after the surviving ones.
+  const Module new_module = {"trace_4", std::string(50, 'd')};
+  WriteModules(path, {new_module});
+  EXPECT_EQ((std::vector<Module>{modules[0], modules[1], new_module}),
+            ReadModules(path));
+}
+
+TEST_F(BitcodeArchiveTest, EntriesAfterBadEntryAreDropped) {
+  const auto path = Path("bitcode");
+  const auto index_path = path + ".index";
+  WriteModules(path, modules);
+
+  // Make the second entry refer past the end of the archive, so that the
+  // intact third module is indexed after a bad entry.
+  do {
+    std::fstream index(index_path, std::ios::binary | std::ios::in |
+                                   std::ios::out);
+    const uint64_t bitcode_size = FileSize(path);
+    index.seekp(static_cast<std::streamoff>(
+        sizeof(BitcodeArchiveEntry) +
+        offsetof(BitcodeArchiveEntry, bitcode_size)));
+    index.write(reinterpret_cast<const char *>(&bitcode_size),
+                sizeof(bitcode_size));
+  } while (false);
+
+  EXPECT_EQ((std::vector<Module>{modules[0]}), ReadModules(path));
+  EXPECT_EQ(sizeof(BitcodeArchiveEntry), FileSize(index_path));
+}
+
+TEST_F(BitcodeArchiveTest, PartialIndexEntryIsOverwritten) {
+  const auto path = Path("bitcode");
+  const auto index_path = path + ".index";
+  WriteModules(path, {modules[0]});
+
+  // Leave part of an entry at the end of the index, as a crashed writer
+  // would.
+  do {
+    std::ofstream index(index_path, std::ios::binary | std::ios::app);
+    index.write("garbage", 7);
+  } while (false);
+
+  EXPECT_EQ((std::vector<Module>{modules[0]}), ReadModules(path));
+
+  WriteModules(path, {modules[1]});
+  EXPECT_EQ((std::vector<Module>{modules[0], modules[1]}), ReadModules(path));
+  EXPECT_EQ(2 * sizeof(BitcodeArchiveEntry), FileSize(index_path));
+}
+
+TEST_F(BitcodeArchiveTest, CorruptedModuleIsSkipped) {
+  const auto path = Path("bitcode");
+  WriteModules(path, modules);
+
+  // Overwrite a byte of the second module's bitcode.
+  do {
+    std::fstream archive(path, std::ios::binary | std::ios::in |
+                               std::ios::out);
+    archive.seekp(static_cast<std::streamoff>(
+        modules[0].first.size() + modules[0].second.size() +
+        modules[1].first.size()));
+    archive.put('z');
+  } while (false);
+
+  EXPECT_EQ((std::vector<Module>{modules[0], modules[2]}), ReadModules(path));
+}
+
+}  // namespace vmill
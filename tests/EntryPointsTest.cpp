@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <elf.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <llvm/IR/LLVMContext.h>
+
+#include "remill/Arch/Arch.h"
+#include "remill/Arch/Name.h"
+#include "remill/OS/OS.h"
+
+#include "vmill/Program/AddressSpace.h"
+#include "vmill/Program/EntryPoints.h"
+
+namespace vmill {
+namespace {
+
+// Path of a small, non-PIE amd64 Linux program, built from `hello.c`.
+static const char kHelloPath[] = VMILL_ELF_EXAMPLES_DIR "/hello_64";
+
+class EntryPointsTest : public ::testing::Test {
+ protected:
+  EntryPointsTest(void)
+      : arch(remill::Arch::Build(&context, remill::kOSLinux,
+                                 remill::kArchAMD64)),
+        memory(arch.get()) {}
+
+  // Map the loadable segments of the ELF image in `path` into `memory`, the
+  // same way that the loader would. Executable segments are only made
+  // executable if `can_exec` is `true`.
+  void LoadImage(const char *path, bool can_exec=true) {
+    std::ifstream file(path, std::ios::binary);
+    ASSERT_TRUE(file.good()) << "Cannot open " << path;
+    const std::string image((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+    ASSERT_LE(sizeof(Elf64_Ehdr), image.size());
+
+    Elf64_Ehdr header = {};
+    memcpy(&header, image.data(), sizeof(header));
+    for (unsigned i = 0; i < header.e_phnum; ++i) {
+      Elf64_Phdr segment = {};
+      const auto segment_offset = header.e_phoff + i * sizeof(segment);
+      ASSERT_LE(segment_offset + sizeof(segment), image.size());
+      memcpy(&segment, &(image[segment_offset]), sizeof(segment));
+      if (PT_LOAD != segment.p_type) {
+        continue;
+      }
+
+      ASSERT_LE(segment.p_offset + segment.p_filesz, image.size());
+      memory.AddMap(segment.p_vaddr, segment.p_memsz, path);
+      ASSERT_TRUE(memory.TryWrite(segment.p_vaddr,
+                                  &(image[segment.p_offset]),
+                                  segment.p_filesz));
+      memory.SetPermissions(segment.p_vaddr, segment.p_memsz,
+                            !!(segment.p_flags & PF_R),
+                            !!(segment.p_flags & PF_W),
+                            can_exec && (segment.p_flags & PF_X));
+    }
+  }
+
+  llvm::LLVMContext context;
+  const remill::Arch::ArchPtr arch;
+  AddressSpace memory;
+};
+
+}  // namespace
+
+TEST_F(EntryPointsTest, FindsEntryPointsOfHelloWorld) {
+  LoadImage(kHelloPath);
+
+  // `readelf -h -d --debug-dump=frames hello_64` lists the entry point
+  // (`_start`), `DT_INIT` (`_init`), `DT_FINI` (`_fini`), and the functions
+  // with unwind information (`main`, `__libc_csu_fini`, `__libc_csu_init`).
+  // The only dynamic function symbols are undefined imports.
+  const std::vector<PC> expected_pcs = {
+      static_cast<PC>(0x400370),  // `_init`.
+      static_cast<PC>(0x4003c0),  // `_start`.
+      static_cast<PC>(0x400498),  // `main`.
+      static_cast<PC>(0x4004b0),  // `__libc_csu_fini`.
+      static_cast<PC>(0x4004c0),  // `__libc_csu_init`.
+      static_cast<PC>(0x400588)   // `_fini`.
+  };
+  EXPECT_EQ(expected_pcs, FindEntryPoints(memory));
+}
+
+TEST_F(EntryPointsTest, IgnoresNonExecutableEntryPoints) {
+  LoadImage(kHelloPath, false);
+  EXPECT_TRUE(FindEntryPoints(memory).empty());
+}
+
+TEST_F(EntryPointsTest, IgnoresMemoryWithoutImages) {
+  memory.AddMap(0x10000, 0x1000);
+  memory.SetPermissions(0x10000, 0x1000, true, false, true);
+  EXPECT_TRUE(FindEntryPoints(memory).empty());
+}
+
+}  // namespace vmill
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "tests/TempDirectory.h"
+#include "vmill/Util/FileBackedHashMap.h"
+
+namespace vmill {
+namespace {
+
+using TestMap = FileBackedHashMap<uint64_t, uint64_t>;
+
+// Places keys differently than `std::hash`, which is the identity function
+// for integers in libstdc++ and libc++.
+struct ReversedHash {
+  size_t operator()(uint64_t key) const {
+    return static_cast<size_t>(__builtin_bswap64(key));
+  }
+};
+
+static std::string ReadFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+static void WriteFile(const std::string &path, const std::string &data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+class FileBackedHashMapTest : public TempDirectoryTest {};
+
+}  // namespace
+
+TEST_F(FileBackedHashMapTest, EntriesPersistAcrossOpens) {
+  const auto path = Path("map");
+  do {
+    auto map = TestMap::Open(path);
+    for (uint64_t key = 1; key <= 100; ++key) {
+      map->Insert(key, key * 10);
+    }
+  } while (false);
+
+  auto map = TestMap::Open(path);
+  EXPECT_EQ(100, map->Size());
+  for (uint64_t key = 1; key <= 100; ++key) {
+    uint64_t value = 0;
+    ASSERT_TRUE(map->Find(key, &value));
+    EXPECT_EQ(key * 10, value);
+  }
+
+  uint64_t value = 0;
+  EXPECT_FALSE(map->Find(101, &value));
+}
+
+TEST_F(FileBackedHashMapTest, RebuildGrowsTheTable) {
+  const auto path = Path("map");
+  const uint64_t num_entries = TestMap::kMinCapacity * 3;
+  do {
+    auto map = TestMap::Open(path);
+    const auto initial_size = ReadFile(path).size();
+    for (uint64_t key = 1; key <= num_entries; ++key) {
+      map->Insert(key, ~key);
+    }
+    map->Sync();
+    EXPECT_LT(initial_size, ReadFile(path).size());
+  } while (false);
+
+  auto map = TestMap::Open(path);
+  EXPECT_EQ(num_entries, map->Size());
+  for (uint64_t key = 1; key <= num_entries; ++key) {
+    uint64_t value = 0;
+    ASSERT_TRUE(map->Find(key, &value));
+    EXPECT_EQ(~key, value);
+  }
+}
+
+TEST_F(FileBackedHashMapTest, RebuildDropsRejectedEntries) {
+  const auto path = Path("map");
+  auto map = TestMap::Open(path, [] (uint64_t, uint64_t value) {
+    return !(value & 1);
+  });
+
+  for (uint64_t key = 1; key <= 100; ++key) {
+    map->Insert(key, key);
+  }
+  map->Sync();
+
+  // Only entries that were already in the table when it was rebuilt are
+  // checked with `keep`.
+  for (uint64_t key = 1000; key < 1000 + TestMap::kMinCapacity; ++key) {
+    map->Insert(key, key * 2);
+  }
+  map->Sync();
+
+  for (uint64_t key = 1; key <= 100; ++key) {
+    uint64_t value = 0;
+    EXPECT_EQ(!(key & 1), map->Find(key, &value)) << "Key " << key;
+  }
+  for (uint64_t key = 1000; key < 1000 + TestMap::kMinCapacity; ++key) {
+    uint64_t value = 0;
+    ASSERT_TRUE(map->Find(key, &value));
+    EXPECT_EQ(key * 2, value);
+  }
+}
+
+TEST_F(FileBackedHashMapTest, CorruptedSlotIsSkipped) {
+  const auto path = Path("map");
+  do {
+    auto map = TestMap::Open(path);
+    for (uint64_t key = 1; key <= 100; ++key) {
+      map->Insert(key, key * 10);
+    }
+  } while (false);
+
+  // Tear the value of the slot for key `42`, as a crash would.
+  const uint64_t torn_slot[2] = {42, 420};
+  auto data = ReadFile(path);
+  const auto slot_offset = data.find(
+      std::string(reinterpret_cast<const char *>(torn_slot),
+                  sizeof(torn_slot)));
+  ASSERT_NE(std::string::npos, slot_offset);
+  data[slot_offset + sizeof(uint64_t)] ^= 0x55;
+  WriteFile(path, data);
+
+  auto map = TestMap::Open(path);
+  uint64_t value = 0;
+  EXPECT_FALSE(map->Find(42, &value));
+
+  uint64_t num_entries = 0;
+  map->ForEach([&num_entries] (uint64_t key, uint64_t) {
+    EXPECT_NE(42, key);
+    ++num_entries;
+  });
+  EXPECT_EQ(99, num_entries);
+
+  for (uint64_t key = 1; key <= 100; ++key) {
+    if (42 != key) {
+      ASSERT_TRUE(map->Find(key, &value));
+      EXPECT_EQ(key * 10, value);
+    }
+  }
+
+  map->Insert(42, 420);
+  map->Sync();
+  ASSERT_TRUE(map->Find(42, &value));
+  EXPECT_EQ(420, value);
+}
+
+TEST_F(FileBackedHashMapTest, ErasedEntryIsGone) {
+  const auto path = Path("map");
+  do {
+    auto map = TestMap::Open(path);
+    for (uint64_t key = 1; key <= 100; ++key) {
+      map->Insert(key, key * 10);
+    }
+    map->Sync();
+    map->Erase(42);
+  } while (false);
+
+  auto map = TestMap::Open(path);
+  uint64_t value = 0;
+  EXPECT_FALSE(map->Find(42, &value));
+  ASSERT_TRUE(map->Find(43, &value));
+  EXPECT_EQ(430, value);
+}
+
+TEST_F(FileBackedHashMapTest, InvalidFileIsReplaced) {
+  const auto path = Path("map");
+  WriteFile(path, std::string(1000, '\xAB'));
+
+  auto map = TestMap::Open(path);
+  EXPECT_EQ(0, map->Size());
+
+  map->Insert(1, 2);
+  map->Sync();
+
+  uint64_t value = 0;
+  ASSERT_TRUE(map->Find(1, &value));
+  EXPECT_EQ(2, value);
+}
+
+TEST_F(FileBackedHashMapTest, ChangedHashFunctionRehashes) {
+  const auto path = Path("map");
+  do {
+    auto map = TestMap::Open(path);
+    for (uint64_t key = 1; key <= 100; ++key) {
+      map->Insert(key, key * 10);
+    }
+  } while (false);
+
+  auto map = FileBackedHashMap<uint64_t, uint64_t, ReversedHash>::Open(path);
+  for (uint64_t key = 1; key <= 100; ++key) {
+    uint64_t value = 0;
+    ASSERT_TRUE(map->Find(key, &value));
+    EXPECT_EQ(key * 10, value);
+  }
+}
+
+}  // namespace vmill
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef VMILL_TESTS_TEMPDIRECTORY_H_
+#define VMILL_TESTS_TEMPDIRECTORY_H_
+
+#include <cstdlib>
+#include <ftw.h>
+#include <stdio.h>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace vmill {
+
+// Test fixture that gives each test its own empty directory, which is
+// removed along with everything in it once the test is done.
+class TempDirectoryTest : public ::testing::Test {
+ protected:
+  void SetUp(void) override {
+    const char *tmp_dir = getenv("TMPDIR");
+    std::string path_template = tmp_dir ? tmp_dir : "/tmp";
+    path_template += "/vmill-test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(&(path_template[0])));
+    dir = path_template;
+  }
+
+  void TearDown(void) override {
+    if (!dir.empty()) {
+      nftw(dir.c_str(), RemovePath, 16, FTW_DEPTH | FTW_PHYS);
+    }
+  }
+
+  // Returns the path of the file `name` in the test's directory.
+  std::string Path(const std::string &name) const {
+    return dir + "/" + name;
+  }
+
+  std::string dir;
+
+ private:
+  static int RemovePath(const char *path, const struct stat *, int,
+                        struct FTW *) {
+    remove(path);
+    return 0;
+  }
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_TESTS_TEMPDIRECTORY_H_
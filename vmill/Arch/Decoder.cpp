@@ -21,6 +21,7 @@
 #include <limits>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 
 #include "remill/Arch/Arch.h"
@@ -32,29 +33,117 @@
 
 DECLARE_bool(verbose);
 
+DEFINE_bool(fold_immutable_loads, false,
+            "Read the values of loads from constant addresses in read-only "
+            "memory while decoding, and fold them into the lifted code. "
+            "Folded loads are never seen by tools that instrument memory "
+            "reads.");
+
+DEFINE_bool(recover_jump_tables, true,
+            "Recognize indirect jumps through jump tables in read-only "
+            "memory, and lift them as switches over the tables' targets.");
+
 namespace vmill {
 namespace {
 
-// Read instruction bytes using `byte_reader`.
-static std::string ReadInstructionBytes(
-    const remill::Arch *arch, AddressSpace &addr_space, uint64_t pc) {
-
-  std::string instr_bytes;
-  const auto max_num_bytes = arch->MaxInstructionSize();
-  instr_bytes.reserve(max_num_bytes);
-  for (uint64_t i = 0; i < max_num_bytes; ++i) {
-    uint8_t byte = 0;
-    auto byte_pc = pc + i;
-    if (!addr_space.TryReadExecutable(static_cast<PC>(byte_pc), &byte)) {
+enum : uint64_t {
+  kPageSize = 4096ULL,
+  kPageShift = (kPageSize - 1ULL),
+  kPageMask = ~kPageShift,
+
+  // Upper bound on how many decoded instructions are remembered per thread.
+  kMaxNumDecodedInstructions = 1ULL << 16,
+
+  // Upper bound on the number of entries in a recovered jump table.
+  kMaxNumJumpTableEntries = 1024,
+
+  // How many instructions before an indirect jump are searched for the
+  // computation of its target.
+  kMaxNumJumpTableContextInsts = 8
+};
+
+// Fetches instruction bytes out of a window of executable memory that covers
+// the page containing the last fetched PC and the page after it, so that
+// decoding the instructions of a page only reads the address space once.
+class InstructionFetcher {
+ public:
+  InstructionFetcher(const remill::Arch *arch_, AddressSpace &addr_space_)
+      : addr_space(addr_space_),
+        max_inst_size(arch_->MaxInstructionSize()) {}
+
+  std::string Fetch(uint64_t pc) {
+    if (pc < window_base ||
+        (pc + max_inst_size) > (window_base + kWindowSize)) {
+      window_base = pc & kPageMask;
+      window_size = addr_space.ReadExecutableBytes(
+          static_cast<PC>(window_base), window, kWindowSize);
+    }
+
+    std::string inst_bytes;
+    const auto window_limit = window_base + window_size;
+    if (pc < window_limit) {
+      const auto offset = pc - window_base;
+      inst_bytes.assign(reinterpret_cast<const char *>(&(window[offset])),
+                        std::min<uint64_t>(max_inst_size, window_limit - pc));
+    }
+
+    if (inst_bytes.size() < max_inst_size) {
       LOG(WARNING)
           << "Stopping decode at non-executable byte "
-          << std::hex << byte_pc << std::dec;
-      break;
+          << std::hex << (pc + inst_bytes.size()) << std::dec;
     }
-    instr_bytes.push_back(static_cast<char>(byte));
+
+    return inst_bytes;
+  }
+
+ private:
+  InstructionFetcher(void) = delete;
+
+  static constexpr uint64_t kWindowSize = 2 * kPageSize;
+
+  AddressSpace &addr_space;
+  const uint64_t max_inst_size;
+
+  // Bytes `[window_base, window_base + window_size)` are executable and
+  // cached in `window`.
+  uint64_t window_base{~0ULL};
+  uint64_t window_size{0};
+  uint8_t window[kWindowSize];
+};
+
+// Instructions decoded by this thread, keyed by their PC and the version of
+// the code that contained them. Overlapping traces, and traces that are
+// re-decoded (e.g. to be lifted into hot code) share most of their
+// instructions.
+static thread_local std::unordered_map<LiveTraceId, remill::Instruction>
+    tDecodedInstructions;
+
+// Decode the instruction at `pc`, or reuse a previous decoding of it. The
+// code version doesn't change for in-place writes to code unless code
+// versioning is enabled, so cached instructions are only reused when their
+// bytes still match.
+static bool DecodeInstruction(const remill::Arch *arch, CodeVersion version,
+                              uint64_t pc, const std::string &inst_bytes,
+                              remill::Instruction &inst) {
+  const LiveTraceId key = {static_cast<PC>(pc), version};
+  auto cached_inst_it = tDecodedInstructions.find(key);
+  if (cached_inst_it != tDecodedInstructions.end()) {
+    const auto &cached_inst = cached_inst_it->second;
+    if (!inst_bytes.compare(0, cached_inst.bytes.size(), cached_inst.bytes)) {
+      inst = cached_inst;
+      return true;
+    }
+  }
+
+  if (!arch->DecodeInstruction(pc, inst_bytes, inst)) {
+    return false;
   }
 
-  return instr_bytes;
+  if (tDecodedInstructions.size() >= kMaxNumDecodedInstructions) {
+    tDecodedInstructions.clear();
+  }
+  tDecodedInstructions[key] = inst;
+  return true;
 }
 
 using DecoderWorkList = std::set<uint64_t>;
@@ -117,17 +206,28 @@ static TraceId HashTraceInstructions(const DecodedTrace &trace) {
   TraceHashBaseType min_pc = 1;
   TraceHashBaseType max_pc = 1;
 
-  if (!trace.instructions.empty()) {
-    min_pc = static_cast<TraceHashBaseType>(
-        trace.instructions.begin()->first);
+  if (!insts.IsEmpty()) {
+    min_pc = static_cast<TraceHashBaseType>(insts.FirstPC());
+    max_pc = static_cast<TraceHashBaseType>(insts.LastPC());
+  }
+
+  Hasher<TraceHashBaseType> hash2(min_pc * max_pc * insts.Size());
+  for (const auto &inst : insts) {
+    hash2.Update(inst.bytes.data(), inst.bytes.size());
+  }
 
-    max_pc = static_cast<TraceHashBaseType>(
-        trace.instructions.rbegin()->first);
+  // Traces with the same instructions can differ in which of their indirect
+  // jumps are lifted as switches.
+  for (const auto &table : trace.jump_tables) {
+    hash2.Update(&(table.pc), sizeof(table.pc));
+    hash2.Update(table.targets.data(), table.targets.size() * sizeof(PC));
   }
 
-  Hasher<TraceHashBaseType> hash2(min_pc * max_pc * insts.size());
-  for (const auto &entry : insts) {
-    hash2.Update(entry.second.bytes.data(), entry.second.bytes.size());
+  // Likewise, they can differ in the values of the read-only memory that was
+  // folded into them.
+  for (const auto &load : trace.immutable_loads) {
+    hash2.Update(&(load.addr), sizeof(load.addr));
+    hash2.Update(&(load.value), sizeof(load.value));
   }
 
   return {trace.pc, static_cast<TraceHash>(hash2.Digest())};
@@ -136,7 +236,7 @@ static TraceId HashTraceInstructions(const DecodedTrace &trace) {
 bool VerifyTraces(const DecodedTraceList &traces) {
   bool out = true;
   for (auto &trace : traces) {
-    if (!trace.instructions.count(trace.pc)) {
+    if (!trace.instructions.Find(trace.pc)) {
       DLOG(WARNING) << "Trace at "
                     << std::hex << static_cast<uint64_t>(trace.pc) << std::dec
                     << " does not contain instruction at its begin addr!";
@@ -146,17 +246,562 @@ bool VerifyTraces(const DecodedTraceList &traces) {
   return out;
 }
 
+// Instructions of the trace being decoded by this thread, in the order they
+// were decoded, and the index of each PC in that order. These are reused from
+// trace to trace, so that decoding doesn't have to grow them from scratch
+// every time.
+static thread_local std::vector<remill::Instruction> tTraceInsts;
+static thread_local std::unordered_map<uint64_t, size_t> tTraceInstIndex;
+
+using DecodedInstList = std::vector<const remill::Instruction *>;
+
+// Returns up to `kMaxNumJumpTableContextInsts` instructions that run right
+// before `inst`, most recent first. These are found by following fall-through
+// edges backward, so the list stops at anything with another predecessor that
+// hasn't been decoded yet.
+static DecodedInstList FindPredecessors(
+    const remill::Arch *arch, const remill::Instruction &inst,
+    const std::vector<remill::Instruction> &insts,
+    const std::unordered_map<uint64_t, size_t> &inst_index) {
+  DecodedInstList preds;
+  auto pc = inst.pc;
+  while (preds.size() < kMaxNumJumpTableContextInsts) {
+    const remill::Instruction *pred = nullptr;
+    for (uint64_t size = 1; size <= arch->MaxInstructionSize() && size <= pc;
+         ++size) {
+      auto it = inst_index.find(pc - size);
+      if (it == inst_index.end()) {
+        continue;
+      }
+      const auto &pred_inst = insts[it->second];
+      if (pred_inst.next_pc != pc) {
+        continue;
+      }
+      switch (pred_inst.category) {
+        case remill::Instruction::kCategoryNormal:
+        case remill::Instruction::kCategoryNoOp:
+        case remill::Instruction::kCategoryConditionalBranch:
+          pred = &pred_inst;
+          break;
+        default:
+          break;
+      }
+      break;
+    }
+
+    if (!pred) {
+      break;
+    }
+    preds.push_back(pred);
+    pc = pred->pc;
+  }
+  return preds;
+}
+
+// Returns `true` if `inst` writes to the register `reg_name`.
+static bool WritesRegister(const remill::Instruction &inst,
+                           const std::string &reg_name) {
+  for (const auto &op : inst.operands) {
+    if (remill::Operand::kTypeRegister == op.type &&
+        remill::Operand::kActionWrite == op.action &&
+        op.reg.name == reg_name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the index of the most recent instruction in `preds`, starting from
+// `begin`, that writes to `reg_name`, or `preds.size()` if there is none.
+static size_t FindWriter(const DecodedInstList &preds, size_t begin,
+                         const std::string &reg_name) {
+  for (auto i = begin; i < preds.size(); ++i) {
+    if (WritesRegister(*(preds[i]), reg_name)) {
+      return i;
+    }
+  }
+  return preds.size();
+}
+
+static bool IsProgramCounter(const remill::Register &reg) {
+  return reg.name == "PC" || reg.name == "NEXT_PC" || reg.name == "RIP" ||
+         reg.name == "EIP";
+}
+
+// Returns the only memory or address operand of `inst`, or `nullptr`.
+static const remill::Operand *FindAddressOperand(
+    const remill::Instruction &inst) {
+  const remill::Operand *addr_op = nullptr;
+  for (const auto &op : inst.operands) {
+    if (remill::Operand::kTypeAddress == op.type) {
+      if (addr_op) {
+        return nullptr;
+      }
+      addr_op = &op;
+    }
+  }
+  return addr_op;
+}
+
+// Computes the address of `op` in `inst`, if it is a constant or relative to
+// the program counter.
+static bool TryGetConstantAddress(const remill::Instruction &inst,
+                                  const remill::Operand &op, uint64_t *addr) {
+  if (!op.addr.index_reg.name.empty()) {
+    return false;
+  }
+
+  // E.g. thread-local accesses through `fs` or `gs`.
+  const auto &segment = op.addr.segment_base_reg.name;
+  if (!segment.empty() && segment != "DSBASE" && segment != "SSBASE" &&
+      segment != "CSBASE" && segment != "ESBASE") {
+    return false;
+  }
+
+  uint64_t base = 0;
+  if (IsProgramCounter(op.addr.base_reg)) {
+    base = inst.next_pc;
+  } else if (!op.addr.base_reg.name.empty()) {
+    return false;
+  }
+
+  *addr = base + static_cast<uint64_t>(op.addr.displacement);
+  return true;
+}
+
+// Add the loads of `inst`, in the trace at `trace_pc`, from constant addresses
+// in read-only memory into `loads`, along with the values that they load.
+static void FindImmutableLoads(AddressSpace &addr_space, PC trace_pc,
+                               const remill::Instruction &inst,
+                               std::vector<ImmutableLoad> &loads) {
+  for (uint64_t i = 0; i < inst.operands.size(); ++i) {
+    const auto &op = inst.operands[i];
+    if (remill::Operand::kTypeAddress != op.type ||
+        remill::Operand::Address::kMemoryRead != op.addr.kind) {
+      continue;
+    }
+
+    const auto size = op.size / 8;
+    if (size != 1 && size != 2 && size != 4 && size != 8) {
+      continue;
+    }
+
+    uint64_t addr = 0;
+    if (!TryGetConstantAddress(inst, op, &addr)) {
+      continue;
+    }
+
+    const auto last_addr = addr + size - 1;
+    if (!addr_space.CanRead(addr) || addr_space.CanWrite(addr) ||
+        !addr_space.CanRead(last_addr) || addr_space.CanWrite(last_addr)) {
+      continue;
+    }
+
+    uint64_t value = 0;
+    if (!addr_space.TryRead(addr, &value, size)) {
+      continue;
+    }
+
+    AddressSpace::MarkAsFolded(trace_pc, addr, size);
+    loads.push_back({static_cast<PC>(inst.pc), i, addr, size, value});
+  }
+}
+
+// Returns the name of the full-width register that contains `reg_name`, e.g.
+// `RAX` for `EAX`, `AX`, `AL`, and `AH`, or `X0` for `W0`. Writing to any
+// register in a family can change the value of all of them.
+static std::string RegisterFamily(const std::string &reg_name) {
+  static const auto families = [] (void) {
+    std::unordered_map<std::string, std::string> map;
+    for (auto x : {"A", "B", "C", "D"}) {
+      const std::string r = x;
+      for (auto alias : {"R" + r + "X", "E" + r + "X", r + "X", r + "L",
+                         r + "H"}) {
+        map.emplace(alias, "R" + r + "X");
+      }
+    }
+    for (auto x : {"SI", "DI", "BP", "SP"}) {
+      const std::string r = x;
+      for (auto alias : {"R" + r, "E" + r, r, r + "L"}) {
+        map.emplace(alias, "R" + r);
+      }
+    }
+    for (auto i = 8; i < 16; ++i) {
+      const auto r = "R" + std::to_string(i);
+      for (auto alias : {r, r + "D", r + "W", r + "B"}) {
+        map.emplace(alias, r);
+      }
+    }
+    for (auto i = 0; i < 31; ++i) {
+      map.emplace("W" + std::to_string(i), "X" + std::to_string(i));
+    }
+    return map;
+  }();
+
+  const auto family_it = families.find(reg_name);
+  return family_it == families.end() ? reg_name : family_it->second;
+}
+
+// Returns `true` if `inst` reads a register in the family `reg_family`.
+static bool ReadsRegisterFamily(const remill::Instruction &inst,
+                                const std::string &reg_family) {
+  for (const auto &op : inst.operands) {
+    if (remill::Operand::kTypeRegister == op.type &&
+        remill::Operand::kActionRead == op.action &&
+        RegisterFamily(op.reg.name) == reg_family) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns `true` if `inst` writes to a register in the family `reg_family`.
+static bool WritesRegisterFamily(const remill::Instruction &inst,
+                                 const std::string &reg_family) {
+  for (const auto &op : inst.operands) {
+    if (remill::Operand::kTypeRegister == op.type &&
+        remill::Operand::kActionWrite == op.action &&
+        RegisterFamily(op.reg.name) == reg_family) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the number of entries in the jump table indexed by `index_reg`, if
+// it is range checked against a constant by one of `preds`, e.g.
+// `cmp eax, 5; ja default`, or zero if no bound was found.
+static uint64_t FindJumpTableBound(const DecodedInstList &preds,
+                                   const std::string &index_reg) {
+  const auto index_family = RegisterFamily(index_reg);
+  auto seen_cond_branch = false;
+  for (auto pred : preds) {
+    if (remill::Instruction::kCategoryConditionalBranch == pred->category) {
+      seen_cond_branch = true;
+      continue;
+    }
+
+    // The bounds check has to compare the index itself.
+    if (seen_cond_branch && !pred->function.compare(0, 3, "CMP")) {
+      if (!ReadsRegisterFamily(*pred, index_family)) {
+        return 0;
+      }
+      for (const auto &op : pred->operands) {
+        if (remill::Operand::kTypeImmediate == op.type &&
+            op.imm.val < kMaxNumJumpTableEntries) {
+          return op.imm.val + 1;
+        }
+      }
+      return 0;
+    }
+
+    // The index was changed after the bounds check. Copying or zero-extending
+    // the index into itself, e.g. `mov edi, edi`, can't make it bigger.
+    if (WritesRegisterFamily(*pred, index_family) &&
+        (pred->function.compare(0, 3, "MOV") ||
+         !pred->function.compare(0, 4, "MOVS") ||
+         !ReadsRegisterFamily(*pred, index_family))) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Reads the targets out of the jump table at `table_addr`. Entries are either
+// absolute addresses of `entry_size` bytes, or 32-bit offsets relative to
+// `table_addr`. Only tables in read-only memory are trusted. Without a known
+// `bound`, entries are read until one doesn't point to executable memory.
+static std::vector<PC> ReadJumpTable(AddressSpace &addr_space,
+                                     uint64_t table_addr, uint64_t entry_size,
+                                     bool is_relative, uint64_t bound) {
+  std::vector<PC> targets;
+  const auto max_num_entries = bound ? bound : kMaxNumJumpTableEntries;
+  for (uint64_t i = 0; i < max_num_entries; ++i) {
+    const auto entry_addr = table_addr + (i * entry_size);
+    const auto entry_last_addr = entry_addr + entry_size - 1;
+    if (!addr_space.CanRead(entry_addr) || addr_space.CanWrite(entry_addr) ||
+        !addr_space.CanRead(entry_last_addr) ||
+        addr_space.CanWrite(entry_last_addr)) {
+      break;
+    }
+
+    uint64_t target = 0;
+    if (is_relative) {
+      uint32_t offset = 0;
+      if (!addr_space.TryRead(entry_addr, &offset)) {
+        break;
+      }
+      target = table_addr + static_cast<uint64_t>(
+          static_cast<int64_t>(static_cast<int32_t>(offset)));
+
+    } else if (8 == entry_size) {
+      if (!addr_space.TryRead(entry_addr, &target)) {
+        break;
+      }
+
+    } else {
+      uint32_t target32 = 0;
+      if (!addr_space.TryRead(entry_addr, &target32)) {
+        break;
+      }
+      target = target32;
+    }
+
+    if (!addr_space.CanExecute(target)) {
+      break;
+    }
+    targets.push_back(static_cast<PC>(target));
+  }
+
+  std::sort(targets.begin(), targets.end());
+  targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+  return targets;
+}
+
+// Try to recover the targets of the indirect jump `inst`, if it goes through
+// a jump table. This recognizes the two idioms that compilers use for x86
+// switch statements:
+//
+//    jmp [table + index * 8]           ; Absolute entries.
+//
+//    lea table_reg, [rip + table]      ; Position-independent entries.
+//    movsxd offset, [table_reg + index * 4]
+//    add offset, table_reg
+//    jmp offset
+static std::vector<PC> RecoverJumpTable(
+    const remill::Arch *arch, AddressSpace &addr_space,
+    const remill::Instruction &inst,
+    const std::vector<remill::Instruction> &insts,
+    const std::unordered_map<uint64_t, size_t> &inst_index) {
+
+  if (!arch->IsX86() && !arch->IsAMD64()) {
+    return {};
+  }
+
+  const auto preds = FindPredecessors(arch, inst, insts, inst_index);
+  const uint64_t addr_size = arch->address_size / 8;
+
+  // `jmp [table + index * 8]`.
+  if (auto mem_op = FindAddressOperand(inst)) {
+    const auto &addr = mem_op->addr;
+    if (addr.index_reg.name.empty() ||
+        static_cast<uint64_t>(addr.scale) != addr_size ||
+        (!addr.base_reg.name.empty() && !IsProgramCounter(addr.base_reg))) {
+      return {};
+    }
+
+    auto table_addr = static_cast<uint64_t>(addr.displacement);
+    if (IsProgramCounter(addr.base_reg)) {
+      table_addr += inst.next_pc;
+    }
+
+    return ReadJumpTable(addr_space, table_addr, addr_size, false,
+                         FindJumpTableBound(preds, addr.index_reg.name));
+  }
+
+  // `jmp offset`, where `offset` comes from `add offset, table_reg`.
+  const remill::Operand *target_op = nullptr;
+  for (const auto &op : inst.operands) {
+    if (remill::Operand::kTypeRegister == op.type &&
+        remill::Operand::kActionRead == op.action) {
+      target_op = &op;
+      break;
+    }
+  }
+
+  if (!target_op) {
+    return {};
+  }
+
+  const auto &target_reg = target_op->reg.name;
+  const auto add_index = FindWriter(preds, 0, target_reg);
+  if (add_index >= preds.size() ||
+      preds[add_index]->function.compare(0, 4, "ADD_")) {
+    return {};
+  }
+
+  std::vector<std::string> source_regs;
+  for (const auto &op : preds[add_index]->operands) {
+    if (remill::Operand::kTypeRegister == op.type &&
+        remill::Operand::kActionRead == op.action) {
+      source_regs.push_back(op.reg.name);
+    }
+  }
+
+  if (2 != source_regs.size()) {
+    return {};
+  }
+
+  // One of the sources of the `add` is the address of the table, and the
+  // other is an entry loaded out of that same table.
+  for (auto i = 0U; i < 2; ++i) {
+    const auto &table_reg = source_regs[i];
+    const auto &offset_reg = source_regs[1 - i];
+
+    const auto lea_index = FindWriter(preds, add_index + 1, table_reg);
+    const auto load_index = FindWriter(preds, add_index + 1, offset_reg);
+    if (lea_index >= preds.size() || load_index >= preds.size() ||
+        load_index >= lea_index ||
+        preds[lea_index]->function.compare(0, 4, "LEA_") ||
+        preds[load_index]->function.compare(0, 6, "MOVSXD")) {
+      continue;
+    }
+
+    const auto lea = preds[lea_index];
+    const auto lea_op = FindAddressOperand(*lea);
+    const auto load_op = FindAddressOperand(*(preds[load_index]));
+    uint64_t table_addr = 0;
+    if (!lea_op || !load_op ||
+        !TryGetConstantAddress(*lea, *lea_op, &table_addr) ||
+        load_op->addr.base_reg.name != table_reg ||
+        load_op->addr.index_reg.name.empty() ||
+        4 != load_op->addr.scale || load_op->addr.displacement) {
+      continue;
+    }
+
+    return ReadJumpTable(
+        addr_space, table_addr, 4, true,
+        FindJumpTableBound(preds, load_op->addr.index_reg.name));
+  }
+
+  return {};
+}
+
+// Decode at most `max_num_insts` instructions (if non-zero) of the trace
+// starting at `trace_pc`, and add the heads of any traces that it calls into
+// `trace_list`.
+static DecodedTrace DecodeTraceAt(const remill::Arch *arch,
+                                  AddressSpace &addr_space,
+                                  InstructionFetcher &fetcher, PC trace_pc,
+                                  DecoderWorkList &trace_list,
+                                  uint64_t max_num_insts) {
+  DecoderWorkList work_list;
+  work_list.insert(static_cast<uint64_t>(trace_pc));
+
+  DecodedTrace trace;
+  trace.pc = trace_pc;
+  trace.code_version = addr_space.ComputeCodeVersion(trace_pc);
+
+  auto &insts = tTraceInsts;
+  auto &inst_index = tTraceInstIndex;
+  insts.clear();
+  inst_index.clear();
+
+  while (!work_list.empty()) {
+    auto entry_it = work_list.begin();
+    const auto pc = *entry_it;
+    work_list.erase(entry_it);
+
+    if (inst_index.count(pc)) {
+      continue;
+    }
+
+    if (max_num_insts && insts.size() >= max_num_insts) {
+      DLOG_IF(INFO, FLAGS_verbose)
+          << "Out of decode budget for trace at "
+          << std::hex << static_cast<uint64_t>(trace_pc) << std::dec;
+      break;
+    }
+
+    inst_index[pc] = insts.size();
+    insts.emplace_back();
+
+    auto &inst = insts.back();
+    auto inst_bytes = fetcher.Fetch(pc);
+    //LOG_IF(INFO, inst_bytes.size() == 0) << "0 bytes at: " << std::hex << static_cast<uint64_t>(pc) << std::dec;
+    auto decode_successful = DecodeInstruction(
+        arch, trace.code_version, pc, inst_bytes, inst);
+
+    // The instruction map is keyed by `inst.pc`, which a failed decode might
+    // not have filled in.
+    inst.pc = pc;
+
+    if (!decode_successful) {
+      LOG(WARNING)
+          << "Cannot decode instruction at " << std::hex << pc << std::dec
+          << ": " << inst.Serialize();
+      continue;
+    } else {
+      AddSuccessorsToWorkList(inst, work_list);
+      AddSuccessorsToTraceList(inst, trace_list);
+    }
+
+    if (FLAGS_fold_immutable_loads) {
+      FindImmutableLoads(addr_space, trace_pc, inst, trace.immutable_loads);
+    }
+
+    if (FLAGS_recover_jump_tables &&
+        remill::Instruction::kCategoryIndirectJump == inst.category) {
+      auto targets = RecoverJumpTable(
+          arch, addr_space, inst, insts, inst_index);
+      if (!targets.empty()) {
+        for (auto target : targets) {
+          work_list.insert(static_cast<uint64_t>(target));
+        }
+        trace.jump_tables.push_back({static_cast<PC>(pc), std::move(targets)});
+      }
+    }
+  }
+
+  std::sort(trace.jump_tables.begin(), trace.jump_tables.end(),
+            [] (const JumpTable &a, const JumpTable &b) {
+              return a.pc < b.pc;
+            });
+  std::sort(trace.immutable_loads.begin(), trace.immutable_loads.end(),
+            [] (const ImmutableLoad &a, const ImmutableLoad &b) {
+              return a.pc < b.pc || (a.pc == b.pc && a.operand < b.operand);
+            });
+
+  // The code version of a trace with folded loads covers the folded values
+  // in `addr_space`, so that the trace isn't reused by an address space
+  // where those values are different.
+  if (!trace.immutable_loads.empty()) {
+    trace.code_version = addr_space.ComputeCodeVersion(trace_pc);
+  }
+
+  trace.instructions.Assign(insts);
+  trace.id = HashTraceInstructions(trace);
+
+  DLOG_IF(INFO, FLAGS_verbose)
+      << "Decoded " << trace.instructions.Size()
+      << " instructions starting from "
+      << std::hex << static_cast<uint64_t>(trace.pc) << std::dec;
+
+  return trace;
+}
+
 }  // namespace
 
+void InstructionMap::Assign(std::vector<remill::Instruction> &new_insts) {
+  std::vector<std::pair<uint64_t, size_t>> order;
+  order.reserve(new_insts.size());
+  for (size_t i = 0; i < new_insts.size(); ++i) {
+    order.emplace_back(new_insts[i].pc, i);
+  }
+  std::sort(order.begin(), order.end());
+
+  pcs.clear();
+  insts.clear();
+  pcs.reserve(order.size());
+  insts.reserve(order.size());
+  for (const auto &entry : order) {
+    pcs.push_back(static_cast<PC>(entry.first));
+    insts.push_back(std::move(new_insts[entry.second]));
+  }
+  new_insts.clear();
+}
+
 // Starting from `start_pc`, read executable bytes out of a memory region
 // using `byte_reader`, and returns a mapping of decoded instruction program
 // counters to the decoded instructions themselves.
 DecodedTraceList DecodeTraces(const remill::Arch *arch,
-                              AddressSpace &addr_space, PC start_pc) {
+                              AddressSpace &addr_space, PC start_pc,
+                              const DecodeBudget &budget) {
 
   DecodedTraceList traces;
+  uint64_t num_insts = 0;
   DecoderWorkList trace_list;
-  DecoderWorkList work_list;
+  InstructionFetcher fetcher(arch, addr_space);
 
   DLOG_IF(INFO, FLAGS_verbose)
       << "Recursively decoding machine code, beginning at "
@@ -174,55 +819,39 @@ DecodedTraceList DecodeTraces(const remill::Arch *arch,
       continue;
     }
 
-    addr_space.MarkAsTraceHead(trace_pc);
-    CHECK(work_list.empty());
-    work_list.insert(trace_pc_uint);
-
-    DecodedTrace trace;
-    trace.pc = static_cast<PC>(trace_pc_uint);
-    trace.code_version = addr_space.ComputeCodeVersion(trace_pc);
-
-    while (!work_list.empty()) {
-      auto entry_it = work_list.begin();
-      const auto pc = *entry_it;
-      work_list.erase(entry_it);
-
-      if (trace.instructions.count(static_cast<PC>(pc))) {
-        continue;
-      }
-
-      remill::Instruction inst;
-      auto inst_bytes = ReadInstructionBytes(arch, addr_space, pc);
-      //LOG_IF(INFO, inst_bytes.size() == 0) << "0 bytes at: " << std::hex << static_cast<uint64_t>(pc) << std::dec;
-      auto decode_successful = arch->DecodeInstruction(
-          pc, inst_bytes, inst);
-
-      //LOG(INFO) << "Adding inst at " << std::hex << static_cast<uint64_t>(pc) << std::dec << std::endl;
-      trace.instructions[static_cast<PC>(pc)] = inst;
-
-      if (!decode_successful) {
-        LOG(WARNING)
-            << "Cannot decode instruction at " << std::hex << pc << std::dec
-            << ": " << inst.Serialize();
-        continue;
-      } else {
-        AddSuccessorsToWorkList(inst, work_list);
-        AddSuccessorsToTraceList(inst, trace_list);
-      }
+    // Leave the remaining traces to be decoded when they're first executed.
+    if (!traces.empty() &&
+        ((budget.max_num_traces && traces.size() >= budget.max_num_traces) ||
+         (budget.max_num_instructions &&
+          num_insts >= budget.max_num_instructions))) {
+      DLOG_IF(INFO, FLAGS_verbose)
+          << "Out of decode budget after " << traces.size() << " traces and "
+          << num_insts << " instructions; deferring " << (trace_list.size() + 1)
+          << " traces";
+      break;
     }
 
-    trace.id = HashTraceInstructions(trace);
-
-    DLOG_IF(INFO, FLAGS_verbose)
-        << "Decoded " << trace.instructions.size()
-        << " instructions starting from "
-        << std::hex << static_cast<uint64_t>(trace.pc) << std::dec;
+    uint64_t max_num_insts = 0;
+    if (budget.max_num_instructions) {
+      max_num_insts = budget.max_num_instructions - num_insts;
+    }
 
-    traces.push_back(std::move(trace));
+    addr_space.MarkAsTraceHead(trace_pc);
+    traces.push_back(DecodeTraceAt(arch, addr_space, fetcher, trace_pc,
+                                   trace_list, max_num_insts));
+    num_insts += traces.back().instructions.Size();
   }
 
   DCHECK(VerifyTraces(traces));
   return traces;
 }
 
+DecodedTrace DecodeTrace(const remill::Arch *arch, AddressSpace &addr_space,
+                         PC trace_pc) {
+  DecoderWorkList ignored_trace_list;
+  InstructionFetcher fetcher(arch, addr_space);
+  return DecodeTraceAt(arch, addr_space, fetcher, trace_pc,
+                       ignored_trace_list, 0);
+}
+
 }  // namespace vmill
@@ -17,9 +17,10 @@
 #ifndef VMILL_ARCH_DECODER_H_
 #define VMILL_ARCH_DECODER_H_
 
+#include <algorithm>
+#include <cstddef>
 #include <functional>
-#include <list>
-#include <map>
+#include <vector>
 
 #include "remill/Arch/Instruction.h"
 #include "vmill/BC/Trace.h"
@@ -31,22 +32,117 @@ namespace vmill {
 
 class AddressSpace;
 
-using InstructionMap = std::map<PC, remill::Instruction>;
+// The instructions of a trace, sorted by PC. The PCs are kept in their own
+// dense array, so that searching for an instruction doesn't have to skip over
+// the (large) instructions themselves.
+class InstructionMap {
+ public:
+  using const_iterator = std::vector<remill::Instruction>::const_iterator;
+
+  // Replace the contents of this map with `insts`, which must all have
+  // unique PCs. `insts` is left empty, but keeps its capacity.
+  void Assign(std::vector<remill::Instruction> &insts);
+
+  // Returns the instruction at `pc`, or `nullptr` if there is none.
+  inline const remill::Instruction *Find(PC pc) const {
+    auto it = std::lower_bound(pcs.begin(), pcs.end(), pc);
+    if (it == pcs.end() || *it != pc) {
+      return nullptr;
+    }
+    return &(insts[static_cast<size_t>(it - pcs.begin())]);
+  }
+
+  inline size_t Size(void) const {
+    return insts.size();
+  }
+
+  inline bool IsEmpty(void) const {
+    return insts.empty();
+  }
+
+  inline PC FirstPC(void) const {
+    return pcs.front();
+  }
+
+  inline PC LastPC(void) const {
+    return pcs.back();
+  }
+
+  inline const_iterator begin(void) const {
+    return insts.begin();
+  }
+
+  inline const_iterator end(void) const {
+    return insts.end();
+  }
+
+ private:
+  std::vector<PC> pcs;
+  std::vector<remill::Instruction> insts;
+};
+
+// The targets of an indirect jump through a jump table, as recovered by the
+// decoder. The jump can still go elsewhere, e.g. if the table is changed.
+struct JumpTable {
+  PC pc;  // PC of the indirect jump.
+  std::vector<PC> targets;  // Sorted and unique.
+};
+
+// A load from a constant address in read-only memory, whose value was read
+// by the decoder so that the lifter can fold it into a constant.
+struct ImmutableLoad {
+  PC pc;  // PC of the loading instruction.
+  uint64_t operand;  // Index of the loaded operand in the instruction.
+  uint64_t addr;
+  uint64_t size;  // In bytes; at most 8.
+  uint64_t value;
+};
 
 struct DecodedTrace {
   PC pc;  // Entry PC of the trace.
   CodeVersion code_version; // Version of address space at decode time.
   TraceId id;  // Unique ID for a given trace.
   InstructionMap instructions;
+  std::vector<JumpTable> jump_tables;  // Sorted by PC.
+  std::vector<ImmutableLoad> immutable_loads;  // Sorted by PC.
+
+  // Returns the jump table of the indirect jump at `jump_pc`, or `nullptr` if
+  // its targets weren't recovered.
+  inline const JumpTable *FindJumpTable(PC jump_pc) const {
+    for (const auto &table : jump_tables) {
+      if (table.pc == jump_pc) {
+        return &table;
+      }
+    }
+    return nullptr;
+  }
 };
 
-class DecodedTraceList : public std::list<DecodedTrace> {};
+// Traces are stored contiguously. Nothing holds onto a trace in a list that
+// is still being added to.
+class DecodedTraceList : public std::vector<DecodedTrace> {};
+
+// Limits on how much code one call to `DecodeTraces` decodes. A limit of zero
+// means no limit. The trace at the starting PC is always decoded. Direct call
+// targets that don't fit into the budget aren't decoded, and successors of
+// instructions that don't fit are left as missing blocks; the lifted code
+// dispatches to, and so decodes, either kind of target when it first runs.
+struct DecodeBudget {
+  uint64_t max_num_traces{0};
+  uint64_t max_num_instructions{0};
+};
 
 // Starting from `start_pc`, read executable bytes out of a memory region
 // using `byte_reader`, and returns a mapping of decoded instruction program
 // counters to the decoded instructions themselves.
 DecodedTraceList DecodeTraces(const remill::Arch *arch,
-                              AddressSpace &addr_space, PC start_pc);
+                              AddressSpace &addr_space, PC start_pc,
+                              const DecodeBudget &budget=DecodeBudget());
+
+// Decode only the trace starting at `trace_pc`, regardless of whether or not
+// it has already been decoded, and without marking it as a trace head.
+DecodedTrace DecodeTrace(const remill::Arch *arch, AddressSpace &addr_space,
+                         PC trace_pc);
 
 }  // namespace vmill
 
@@ -56,6 +56,12 @@
 DEFINE_bool(disable_optimizer, false,
             "Should the optimized machine code be produced?");
 
+DEFINE_bool(compact_code_layout, false,
+            "Place the runtime and all lifted code and data within a single "
+            "2 GiB window backed by huge pages, and compile it with the "
+            "small code model, so that calls and data accesses can use "
+            "32-bit PC-relative displacements.");
+
 namespace vmill {
 namespace {
 
@@ -85,12 +91,26 @@ static std::string GetNativeFeatureString(void) {
   return target_features.getString();
 }
 
-static llvm::CodeGenOpt::Level CodeGenOptLevel(void) {
+static llvm::CodeGenOpt::Level CodeGenOptLevel(
+    llvm::CodeGenOpt::Level opt_level) {
   // TODO(pag): Using anything above `None` produces bugs :-(
   if (FLAGS_disable_optimizer) {
     return llvm::CodeGenOpt::None;
   } else {
-    return llvm::CodeGenOpt::Aggressive;
+    return opt_level;
+  }
+}
+
+// The large code model makes no assumptions about where code and data will be
+// loaded, at the cost of every call and global access going through a 64-bit
+// absolute address. With the compact layout, the JIT keeps everything close
+// enough together for the small code model; anything farther away (e.g. in
+// the executor) is reached through stubs and GOT entries made by the JIT.
+static llvm::CodeModel::Model JITCodeModel(void) {
+  if (FLAGS_compact_code_layout) {
+    return llvm::CodeModel::Small;
+  } else {
+    return llvm::CodeModel::Large;
   }
 }
 
@@ -123,7 +143,8 @@ static void MoveConstructors(llvm::Module &module) {
 
 Compiler::~Compiler(void) {}
 
-Compiler::Compiler(const std::shared_ptr<llvm::LLVMContext> &context_)
+Compiler::Compiler(const std::shared_ptr<llvm::LLVMContext> &context_,
+                   llvm::CodeGenOpt::Level opt_level)
     : context(context_),
       host_triple(llvm::sys::getProcessTriple()) {
 
@@ -139,8 +160,8 @@ Compiler::Compiler(const std::shared_ptr<llvm::LLVMContext> &context_)
   machine = std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
       host_triple.str(), cpu, GetNativeFeatureString(), options,
       llvm::Reloc::PIC_,
-      llvm::CodeModel::Large,
-      CodeGenOptLevel()));
+      JITCodeModel(),
+      CodeGenOptLevel(opt_level)));
 
   CHECK(machine)
       << "Cannot create target machine for triple "
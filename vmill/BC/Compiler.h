@@ -18,6 +18,7 @@
 
 #include <memory>
 
+#include <llvm/Support/CodeGen.h>
 #include <llvm/Target/TargetOptions.h>
 
 namespace llvm {
@@ -36,8 +37,11 @@ class Compiler {
  public:
   virtual ~Compiler(void);
 
+  // `opt_level` is the most aggressive code generation optimization level
+  // that this compiler will use.
   explicit Compiler(
-      const std::shared_ptr<llvm::LLVMContext> &context_);
+      const std::shared_ptr<llvm::LLVMContext> &context_,
+      llvm::CodeGenOpt::Level opt_level=llvm::CodeGenOpt::Aggressive);
 
   void CompileModuleToFile(
       llvm::Module &module, const std::string &path);
@@ -17,8 +17,10 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
+#include <iterator>
 #include <limits>
 #include <memory>
 #include <sstream>
@@ -30,14 +32,17 @@
 #include <llvm/ADT/Triple.h>
 
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
 
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/Local.h>
 #include <llvm/Transforms/Utils/ModuleUtils.h>
@@ -58,12 +63,31 @@
 #include "vmill/BC/Optimize.h"
 #include "vmill/BC/Trace.h"
 #include "vmill/BC/Util.h"
+#include "vmill/Runtime/Task.h"
 
 DEFINE_string(instruction_callback, "",
               "Name of a function to call before each lifted instruction.");
 
 DEFINE_bool(check_pcs, false, "Check program counters on block entry.");
 
+DEFINE_bool(chain_traces, true,
+            "Chain direct function calls between lifted traces, so that "
+            "they bypass the dispatcher once the target trace is known.");
+
+DEFINE_bool(cache_indirect_branches, true,
+            "Give each indirect jump and call site an inline cache of its "
+            "most recent targets.");
+
+DEFINE_uint64(preempt_budget, 0,
+              "If non-zero, then lifted code preempts a task after it has "
+              "executed this many trace entries and loop back-edges, and "
+              "indirect control flow no longer yields to the scheduler.");
+
+DEFINE_uint64(hot_trace_threshold, 10000,
+              "Number of executions after which a trace is considered hot, "
+              "and is re-lifted into aggressively optimized code. Zero "
+              "disables this.");
+
 namespace vmill {
 namespace {
 
@@ -132,6 +156,327 @@ static void ClearVariableNames(llvm::Function *func) {
   }
 }
 
+// Direct function calls to traces that were not lifted into the same module
+// as their callers are lifted as calls to `__vmill_chain_call`. Here we
+// rewrite each such call so that it goes through a per-call-site "chain slot".
+// The slot starts off as null, in which case we call `__vmill_chain_miss`,
+// which dispatches like `__remill_function_call`, then fills in the slot with
+// the target trace. Later executions of the call site call the target trace
+// directly.
+static void ChainDirectCalls(llvm::Module *module) {
+  auto chain_func = module->getFunction("__vmill_chain_call");
+  if (!chain_func) {
+    return;
+  }
+
+  std::vector<llvm::CallInst *> calls;
+  for (auto user : chain_func->users()) {
+    if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
+      calls.push_back(call_inst);
+    }
+  }
+
+  auto func_type = chain_func->getFunctionType();
+  auto func_ptr_type = llvm::PointerType::get(func_type, 0);
+  auto null_func_ptr = llvm::Constant::getNullValue(func_ptr_type);
+
+  std::vector<llvm::Type *> miss_param_types(
+      func_type->param_begin(), func_type->param_end());
+  miss_param_types.push_back(llvm::PointerType::get(func_ptr_type, 0));
+
+  auto miss_func_type = llvm::FunctionType::get(
+      func_type->getReturnType(), miss_param_types, false);
+  auto miss_func = llvm::dyn_cast<llvm::Function>(
+      module->getOrInsertFunction("__vmill_chain_miss", miss_func_type)
+      IF_LLVM_GTE_900(.getCallee()));
+
+  for (auto call_inst : calls) {
+    auto slot = new llvm::GlobalVariable(
+        *module, func_ptr_type, false, llvm::GlobalValue::PrivateLinkage,
+        null_func_ptr);
+
+    llvm::IRBuilder<> ir(call_inst);
+    auto target_func = ir.CreateLoad(func_ptr_type, slot);
+    auto is_linked = ir.CreateICmpNE(target_func, null_func_ptr);
+
+    llvm::Instruction *linked_term = nullptr;
+    llvm::Instruction *missed_term = nullptr;
+    llvm::SplitBlockAndInsertIfThenElse(
+        is_linked, call_inst, &linked_term, &missed_term);
+
+    std::vector<llvm::Value *> args(
+        call_inst->arg_begin(), call_inst->arg_end());
+
+    ir.SetInsertPoint(linked_term);
+    auto linked_mem_ptr = ir.CreateCall(func_type, target_func, args);
+
+    args.push_back(slot);
+    ir.SetInsertPoint(missed_term);
+    auto missed_mem_ptr = ir.CreateCall(miss_func, args);
+
+    ir.SetInsertPoint(call_inst);
+    auto mem_ptr = ir.CreatePHI(func_type->getReturnType(), 2);
+    mem_ptr->addIncoming(linked_mem_ptr, linked_term->getParent());
+    mem_ptr->addIncoming(missed_mem_ptr, missed_term->getParent());
+
+    call_inst->replaceAllUsesWith(mem_ptr);
+    call_inst->eraseFromParent();
+  }
+
+  if (chain_func->use_empty()) {
+    chain_func->eraseFromParent();
+  }
+}
+
+// Indirect jumps and calls are lifted as calls to `__vmill_cached_jump` and
+// `__vmill_cached_call`, respectively. Here we rewrite each such call to
+// compare the target PC against the entries of a per-site inline cache, and
+// to call the cached lifted function directly on a hit. On a miss, we call
+// `miss_func_name`, which dispatches like `__remill_jump` (or
+// `__remill_function_call`), and then adds the target into the cache.
+static void CacheIndirectBranches(llvm::Module *module,
+                                  const char *marker_func_name,
+                                  const char *miss_func_name) {
+  auto marker_func = module->getFunction(marker_func_name);
+  if (!marker_func) {
+    return;
+  }
+
+  std::vector<llvm::CallInst *> calls;
+  for (auto user : marker_func->users()) {
+    if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
+      calls.push_back(call_inst);
+    }
+  }
+
+  auto &context = module->getContext();
+  auto func_type = marker_func->getFunctionType();
+  auto func_ptr_type = llvm::PointerType::get(func_type, 0);
+  auto int32_type = llvm::Type::getInt32Ty(context);
+  auto int64_type = llvm::Type::getInt64Ty(context);
+
+  // Type of an `InlineCacheEntry`.
+  auto entry_type = llvm::StructType::get(
+      context, {int64_type, func_ptr_type}, false);
+  auto cache_type = llvm::ArrayType::get(entry_type, kNumInlineCacheEntries);
+
+  llvm::Constant *empty_entry_vals[] = {
+      llvm::ConstantInt::get(int64_type, kInvalidInlineCachePC),
+      llvm::Constant::getNullValue(func_ptr_type)};
+  auto empty_entry = llvm::ConstantStruct::get(entry_type, empty_entry_vals);
+  std::vector<llvm::Constant *> empty_entries(
+      kNumInlineCacheEntries, empty_entry);
+  auto empty_cache = llvm::ConstantArray::get(cache_type, empty_entries);
+
+  std::vector<llvm::Type *> miss_param_types(
+      func_type->param_begin(), func_type->param_end());
+  miss_param_types.push_back(llvm::PointerType::get(entry_type, 0));
+
+  auto miss_func_type = llvm::FunctionType::get(
+      func_type->getReturnType(), miss_param_types, false);
+  auto miss_func = llvm::dyn_cast<llvm::Function>(
+      module->getOrInsertFunction(miss_func_name, miss_func_type)
+      IF_LLVM_GTE_900(.getCallee()));
+
+  auto zero = llvm::ConstantInt::get(int32_type, 0);
+  auto one = llvm::ConstantInt::get(int32_type, 1);
+
+  for (auto call_inst : calls) {
+    auto cache = new llvm::GlobalVariable(
+        *module, cache_type, false, llvm::GlobalValue::PrivateLinkage,
+        empty_cache);
+
+    // Jumps are lifted as tail calls; keep them that way so that chains of
+    // indirect jumps don't grow the native stack.
+    auto is_tail_call = llvm::isa<llvm::ReturnInst>(call_inst->getNextNode());
+
+    auto block = call_inst->getParent();
+    auto func = block->getParent();
+    auto cont_block = block->splitBasicBlock(call_inst);
+    block->getTerminator()->eraseFromParent();
+
+    std::vector<llvm::Value *> args(
+        call_inst->arg_begin(), call_inst->arg_end());
+
+    llvm::IRBuilder<> ir(block);
+    auto target_pc = ir.CreateZExtOrBitCast(
+        args[remill::kPCArgNum], int64_type);
+
+    std::vector<llvm::CallInst *> results;
+    for (auto i = 0U; i < kNumInlineCacheEntries; ++i) {
+      auto index = llvm::ConstantInt::get(int32_type, i);
+      auto cached_pc = ir.CreateLoad(
+          int64_type, ir.CreateInBoundsGEP(cache_type, cache,
+                                           {zero, index, zero}));
+
+      auto hit_block = llvm::BasicBlock::Create(
+          context, llvm::Twine::createNull(), func);
+      auto next_block = llvm::BasicBlock::Create(
+          context, llvm::Twine::createNull(), func);
+      ir.CreateCondBr(ir.CreateICmpEQ(cached_pc, target_pc),
+                      hit_block, next_block);
+
+      ir.SetInsertPoint(hit_block);
+      auto cached_func = ir.CreateLoad(
+          func_ptr_type, ir.CreateInBoundsGEP(cache_type, cache,
+                                              {zero, index, one}));
+      results.push_back(ir.CreateCall(func_type, cached_func, args));
+      ir.SetInsertPoint(next_block);
+    }
+
+    args.push_back(ir.CreateInBoundsGEP(cache_type, cache, {zero, zero}));
+    results.push_back(ir.CreateCall(miss_func, args));
+
+    for (auto result : results) {
+      ir.SetInsertPoint(result->getParent());
+      if (is_tail_call) {
+        result->setTailCall(true);
+        ir.CreateRet(result);
+      } else {
+        ir.CreateBr(cont_block);
+      }
+    }
+
+    if (is_tail_call) {
+      cont_block->eraseFromParent();
+
+    } else {
+      ir.SetInsertPoint(call_inst);
+      auto mem_ptr = ir.CreatePHI(func_type->getReturnType(),
+                                  static_cast<unsigned>(results.size()));
+      for (auto result : results) {
+        mem_ptr->addIncoming(result, result->getParent());
+      }
+      call_inst->replaceAllUsesWith(mem_ptr);
+      call_inst->eraseFromParent();
+    }
+  }
+
+  if (marker_func->use_empty()) {
+    marker_func->eraseFromParent();
+  }
+}
+
+// Returns a pointer to the 64-bit field at `offset` bytes into the task that
+// owns `state`. The runtime allocates each task's state right after a pointer
+// back to the task, so that lifted code can find the task from its state
+// argument.
+static llvm::Value *LoadTaskFieldPtr(llvm::IRBuilder<> &ir,
+                                     llvm::Value *state,
+                                     uint64_t offset) {
+  auto &context = ir.getContext();
+  auto int8_type = llvm::Type::getInt8Ty(context);
+  auto int8_ptr_type = llvm::Type::getInt8PtrTy(context);
+  auto task_ptr = ir.CreateBitCast(
+      ir.CreateConstGEP1_64(
+          int8_type, ir.CreateBitCast(state, int8_ptr_type),
+          -static_cast<int64_t>(kStateTaskPointerOffset)),
+      int8_ptr_type->getPointerTo());
+  auto task = ir.CreateLoad(int8_ptr_type, task_ptr);
+  return ir.CreateBitCast(
+      ir.CreateConstInBoundsGEP1_64(int8_type, task, offset),
+      llvm::Type::getInt64PtrTy(context));
+}
+
+// Trace entries and loop back-edges are marked with calls to
+// `__vmill_check_budget`, which take the PC that execution is going to. Here
+// we inline a decrement of the running task's preemption budget, and a call
+// to `__vmill_preempt` for when the budget has run out.
+static void InlineBudgetChecks(llvm::Module *module) {
+  auto check_func = module->getFunction("__vmill_check_budget");
+  if (!check_func) {
+    return;
+  }
+
+  std::vector<llvm::CallInst *> calls;
+  for (auto user : check_func->users()) {
+    if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
+      calls.push_back(call_inst);
+    }
+  }
+
+  auto &context = module->getContext();
+  auto int64_type = llvm::Type::getInt64Ty(context);
+  auto preempt_func = llvm::dyn_cast<llvm::Function>(
+      module->getOrInsertFunction(
+          "__vmill_preempt", check_func->getFunctionType())
+      IF_LLVM_GTE_900(.getCallee()));
+  preempt_func->addFnAttr(llvm::Attribute::Cold);
+
+  auto zero = llvm::ConstantInt::get(int64_type, 0);
+  auto one = llvm::ConstantInt::get(int64_type, 1);
+  auto weights = llvm::MDBuilder(context).createBranchWeights(1, 1000);
+
+  for (auto call_inst : calls) {
+    llvm::IRBuilder<> ir(call_inst);
+    auto state = remill::NthArgument(
+        call_inst->getFunction(), remill::kStatePointerArgNum);
+    auto budget_ptr = LoadTaskFieldPtr(
+        ir, state, __builtin_offsetof(Task, preempt_budget));
+    auto budget = ir.CreateSub(ir.CreateLoad(int64_type, budget_ptr), one);
+    ir.CreateStore(budget, budget_ptr);
+
+    auto preempt_term = llvm::SplitBlockAndInsertIfThen(
+        ir.CreateICmpSLE(budget, zero), call_inst, false, weights);
+    ir.SetInsertPoint(preempt_term);
+    ir.CreateCall(preempt_func, {call_inst->getArgOperand(0)});
+    call_inst->eraseFromParent();
+  }
+
+  check_func->eraseFromParent();
+}
+
+// Trace entries are marked with calls to `__vmill_count_execution`, which
+// take the trace's PC. Each one gets its own private counter that starts at
+// `--hot_trace_threshold` and counts down; when it reaches zero, the trace is
+// reported as hot to `__vmill_hot_trace`. The counter keeps going after that,
+// so it only reaches zero again after wrapping around.
+static void InlineExecutionCounters(llvm::Module *module) {
+  auto count_func = module->getFunction("__vmill_count_execution");
+  if (!count_func) {
+    return;
+  }
+
+  std::vector<llvm::CallInst *> calls;
+  for (auto user : count_func->users()) {
+    if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
+      calls.push_back(call_inst);
+    }
+  }
+
+  auto &context = module->getContext();
+  auto int64_type = llvm::Type::getInt64Ty(context);
+  auto hot_func = llvm::dyn_cast<llvm::Function>(
+      module->getOrInsertFunction(
+          "__vmill_hot_trace", count_func->getFunctionType())
+      IF_LLVM_GTE_900(.getCallee()));
+  hot_func->addFnAttr(llvm::Attribute::Cold);
+
+  auto threshold = llvm::ConstantInt::get(
+      int64_type, FLAGS_hot_trace_threshold);
+  auto zero = llvm::ConstantInt::get(int64_type, 0);
+  auto one = llvm::ConstantInt::get(int64_type, 1);
+  auto weights = llvm::MDBuilder(context).createBranchWeights(1, 1000);
+
+  for (auto call_inst : calls) {
+    auto counter = new llvm::GlobalVariable(
+        *module, int64_type, false, llvm::GlobalValue::PrivateLinkage,
+        threshold);
+
+    llvm::IRBuilder<> ir(call_inst);
+    auto count = ir.CreateSub(ir.CreateLoad(int64_type, counter), one);
+    ir.CreateStore(count, counter);
+
+    auto hot_term = llvm::SplitBlockAndInsertIfThen(
+        ir.CreateICmpEQ(count, zero), call_inst, false, weights);
+    ir.SetInsertPoint(hot_term);
+    ir.CreateCall(hot_func, {call_inst->getArgOperand(0)});
+    call_inst->eraseFromParent();
+  }
+
+  count_func->eraseFromParent();
+}
+
 // Optimize a function.
 static void OptimizeFunction(llvm::Function *func) {
   std::vector<llvm::CallInst *> calls_to_inline;
@@ -173,6 +518,108 @@ static void OptimizeFunction(llvm::Function *func) {
   fpm.doFinalization();
 }
 
+// Returns the semantics function that the instruction lifter calls for
+// `inst`, which is named by its `ISEL_*` variable in `module`.
+static llvm::Function *GetSemanticsFunction(llvm::Module *module,
+                                            const remill::Instruction &inst) {
+  auto isel = module->getGlobalVariable("ISEL_" + inst.function, true);
+  if (!isel || !isel->hasInitializer()) {
+    return nullptr;
+  }
+  return llvm::dyn_cast<llvm::Function>(
+      isel->getInitializer()->stripPointerCasts());
+}
+
+// The decoder resolved the loads in `loads` of `inst` to constant addresses
+// in read-only memory. `inst` was lifted into the instructions of `block`
+// starting at `lifted_begin`. Pass those addresses to the call to its
+// semantics as constants, so that the loads end up with constant addresses
+// once the semantics are inlined, and can be folded by `FoldImmutableLoads`.
+// Lifted semantics are called with the memory and state pointers, then one
+// argument per operand.
+static void UseConstantLoadAddresses(
+    const remill::Instruction &inst, llvm::BasicBlock *block,
+    llvm::BasicBlock::iterator lifted_begin,
+    const std::vector<const ImmutableLoad *> &loads) {
+  const auto sem_func = GetSemanticsFunction(block->getModule(), inst);
+  if (!sem_func) {
+    return;
+  }
+
+  const auto num_args = inst.operands.size() + 2;
+  for (auto it = lifted_begin; it != block->end(); ++it) {
+    auto call_inst = llvm::dyn_cast<llvm::CallInst>(&*it);
+    if (!call_inst || call_inst->getCalledFunction() != sem_func ||
+        call_inst->getNumArgOperands() != num_args) {
+      continue;
+    }
+
+    for (auto load : loads) {
+      const auto arg_num = static_cast<unsigned>(load->operand + 2);
+      auto arg_type = call_inst->getArgOperand(arg_num)->getType();
+      if (arg_type->isIntegerTy()) {
+        call_inst->setArgOperand(
+            arg_num, llvm::ConstantInt::get(arg_type, load->addr, false));
+      }
+    }
+    return;
+  }
+}
+
+// Replace the loads out of read-only memory in `func`, the lifted function of
+// `trace`, with the values that the decoder read.
+static void FoldImmutableLoads(llvm::Function *func,
+                               const DecodedTrace &trace) {
+  std::unordered_map<uint64_t, const ImmutableLoad *> loads;
+  for (const auto &load : trace.immutable_loads) {
+    loads[load.addr] = &load;
+  }
+
+  std::vector<std::pair<llvm::CallInst *, const ImmutableLoad *>> folds;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      auto call_inst = llvm::dyn_cast<llvm::CallInst>(&inst);
+      if (!call_inst) {
+        continue;
+      }
+
+      auto called_func = call_inst->getCalledFunction();
+      if (!called_func ||
+          !called_func->getName().startswith("__remill_read_memory_") ||
+          2 != call_inst->getNumArgOperands()) {
+        continue;
+      }
+
+      auto addr = llvm::dyn_cast<llvm::ConstantInt>(
+          call_inst->getArgOperand(1));
+      if (!addr) {
+        continue;
+      }
+
+      auto load_it = loads.find(addr->getZExtValue());
+      const auto type = call_inst->getType();
+      if (load_it != loads.end() &&
+          (load_it->second->size * 8) == type->getPrimitiveSizeInBits()) {
+        folds.emplace_back(call_inst, load_it->second);
+      }
+    }
+  }
+
+  for (const auto &fold : folds) {
+    auto call_inst = fold.first;
+    const auto type = call_inst->getType();
+    llvm::Constant *value = llvm::ConstantInt::get(
+        llvm::Type::getIntNTy(func->getContext(),
+                              static_cast<unsigned>(fold.second->size * 8)),
+        fold.second->value, false);
+    if (!type->isIntegerTy()) {
+      value = llvm::ConstantExpr::getBitCast(value, type);
+    }
+    call_inst->replaceAllUsesWith(value);
+    call_inst->eraseFromParent();
+  }
+}
+
 }  // namespace
 
 class LifterImpl{
@@ -180,9 +627,10 @@ class LifterImpl{
   explicit LifterImpl(const remill::Arch *arch_,
                       const std::shared_ptr<llvm::LLVMContext> &);
 
-  std::unique_ptr<llvm::Module> Lift(const DecodedTraceList &traces);
+  std::unique_ptr<llvm::Module> Lift(const DecodedTraceList &traces,
+                                     CodeTier tier);
 
-  llvm::Function *LiftTrace(const DecodedTrace &trace);
+  llvm::Function *LiftTrace(const DecodedTrace &trace, CodeTier tier);
 
   void LiftTracesIntoModule(const FuncToTraceMap &lifted_funcs,
                             llvm::Module *module);
@@ -213,6 +661,23 @@ class LifterImpl{
 
   llvm::Function *instruction_callback{nullptr};
 
+  // The `__vmill_chain_call` function, used to mark direct function calls
+  // to traces in other modules.
+  llvm::Function *chain_call{nullptr};
+
+  // The `__vmill_cached_jump` and `__vmill_cached_call` functions, used to
+  // mark indirect jumps and calls that should get inline caches.
+  llvm::Function *cached_jump{nullptr};
+  llvm::Function *cached_call{nullptr};
+
+  // The `__vmill_check_budget` function, used to mark trace entries and loop
+  // back-edges where a task might be preempted.
+  llvm::Function *check_budget{nullptr};
+
+  // The `__vmill_count_execution` function, used to mark trace entries whose
+  // executions are counted to find hot traces.
+  llvm::Function *count_execution{nullptr};
+
  private:
   LifterImpl(void) = delete;
 };
@@ -241,10 +706,47 @@ LifterImpl::LifterImpl(const remill::Arch *arch_,
         FLAGS_instruction_callback, arch->LiftedFunctionType())
         IF_LLVM_GTE_900(.getCallee()));
   }
+
+  if (FLAGS_chain_traces) {
+    chain_call = llvm::dyn_cast<llvm::Function>(
+        semantics->getOrInsertFunction(
+        "__vmill_chain_call", arch->LiftedFunctionType())
+        IF_LLVM_GTE_900(.getCallee()));
+  }
+
+  if (FLAGS_cache_indirect_branches) {
+    cached_jump = llvm::dyn_cast<llvm::Function>(
+        semantics->getOrInsertFunction(
+        "__vmill_cached_jump", arch->LiftedFunctionType())
+        IF_LLVM_GTE_900(.getCallee()));
+
+    cached_call = llvm::dyn_cast<llvm::Function>(
+        semantics->getOrInsertFunction(
+        "__vmill_cached_call", arch->LiftedFunctionType())
+        IF_LLVM_GTE_900(.getCallee()));
+  }
+
+  if (FLAGS_preempt_budget) {
+    check_budget = llvm::dyn_cast<llvm::Function>(
+        semantics->getOrInsertFunction(
+        "__vmill_check_budget",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*context),
+                                {llvm::Type::getInt64Ty(*context)}, false))
+        IF_LLVM_GTE_900(.getCallee()));
+  }
+
+  if (FLAGS_hot_trace_threshold) {
+    count_execution = llvm::dyn_cast<llvm::Function>(
+        semantics->getOrInsertFunction(
+        "__vmill_count_execution",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*context),
+                                {llvm::Type::getInt64Ty(*context)}, false))
+        IF_LLVM_GTE_900(.getCallee()));
+  }
 }
 
 std::unique_ptr<llvm::Module> LifterImpl::Lift(
-    const DecodedTraceList &traces) {
+    const DecodedTraceList &traces, CodeTier tier) {
 
   std::unique_ptr<llvm::Module> module;
 
@@ -265,7 +767,7 @@ std::unique_ptr<llvm::Module> LifterImpl::Lift(
   lifted_funcs.reserve(traces.size());
 
   for (const auto &trace : traces) {
-    lifted_funcs[LiftTrace(trace)] = &trace;
+    lifted_funcs[LiftTrace(trace, tier)] = &trace;
   }
 
   if (module) {
@@ -275,7 +777,8 @@ std::unique_ptr<llvm::Module> LifterImpl::Lift(
   return module;
 }
 
-llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
+llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace,
+                                      CodeTier tier) {
 
   lifter.ClearCache();
 
@@ -306,6 +809,18 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
     llvm::IRBuilder<> ir(func_entry_block);
     ir.CreateStore(pc, next_pc_ptr);
     ir.CreateStore(pc, pc_ptr);
+    if (check_budget) {
+      ir.CreateCall(check_budget, {llvm::ConstantInt::get(
+          llvm::Type::getInt64Ty(*context_ptr),
+          static_cast<uint64_t>(trace.pc))});
+    }
+
+    // Hot code is already as optimized as it's going to get.
+    if (count_execution && kCodeTierHot != tier) {
+      ir.CreateCall(count_execution, {llvm::ConstantInt::get(
+          llvm::Type::getInt64Ty(*context_ptr),
+          static_cast<uint64_t>(trace.pc))});
+    }
   } while (false);
 
   llvm::BasicBlock *out_of_sync_block = nullptr;
@@ -353,7 +868,7 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
 
   // Guarantee that a basic block exists, even if the first instruction
   // failed to decode.
-  if (!insts.count(trace.pc)) {
+  if (!insts.Find(trace.pc)) {
     remill::AddTerminatingTailCall(entry_block, intrinsics.error);
     OptimizeFunction(func);
     return func;
@@ -366,15 +881,17 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
     memory_ptr_ref = remill::LoadMemoryPointerRef(entry_block);
   }
 
+  std::vector<const ImmutableLoad *> inst_loads;
+
   // Lift each instruction into its own basic block.
-  for (const auto &entry : insts) {
-    (void) GetOrCreateBlock(entry.first);
-    auto block = blocks[static_cast<uint64_t>(entry.first)].second;
+  for (const auto &decoded_inst : insts) {
+    (void) GetOrCreateBlock(static_cast<PC>(decoded_inst.pc));
+    auto block = blocks[decoded_inst.pc].second;
     if (!block->empty()) {
       continue;
     }
 
-    auto &inst = const_cast<remill::Instruction &>(entry.second);
+    auto &inst = const_cast<remill::Instruction &>(decoded_inst);
 
     if (callback) {
       llvm::Value *args[remill::kNumBlockArgs];
@@ -391,12 +908,52 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
       ret_pc = llvm::ConstantInt::get(pc_type, inst.branch_not_taken_pc, false);
     }
 
+    // Branches backward within a trace likely form loops, which could
+    // otherwise spin without ever giving other tasks a chance to run. This
+    // returns the block to branch to in order to reach `target_pc`, which
+    // checks the budget on the way there if the branch is a back-edge.
+    auto CheckBudgetOnBackEdge = [&] (uint64_t target_pc) {
+      auto target_block = GetOrCreateBlock(static_cast<PC>(target_pc));
+      if (!check_budget || target_pc > inst.pc) {
+        return target_block;
+      }
+
+      auto back_edge_block = llvm::BasicBlock::Create(
+          *context_ptr, llvm::Twine::createNull(), func);
+      llvm::IRBuilder<> ir(back_edge_block);
+      ir.CreateCall(check_budget, {llvm::ConstantInt::get(
+          llvm::Type::getInt64Ty(*context_ptr), target_pc, false)});
+      ir.CreateBr(target_block);
+      return back_edge_block;
+    };
+
+    // Remember where the lifted instruction starts, so that the call to its
+    // semantics can be found.
+    const auto last_inst = block->empty() ? nullptr : &(block->back());
     const auto lift_status = lifter.LiftIntoBlock(inst, block, state_ptr);
     if (remill::kLiftedInstruction != lift_status) {
       remill::AddTerminatingTailCall(block, intrinsics.error);
       continue;
     }
 
+    // Loads out of read-only memory that the decoder resolved.
+    inst_loads.clear();
+    for (auto load_it = std::lower_bound(
+             trace.immutable_loads.begin(), trace.immutable_loads.end(),
+             static_cast<PC>(inst.pc),
+             [] (const ImmutableLoad &load, PC pc) { return load.pc < pc; });
+         load_it != trace.immutable_loads.end() &&
+             load_it->pc == static_cast<PC>(inst.pc);
+         ++load_it) {
+      inst_loads.push_back(&*load_it);
+    }
+    if (!inst_loads.empty()) {
+      UseConstantLoadAddresses(
+          inst, block,
+          last_inst ? std::next(last_inst->getIterator()) : block->begin(),
+          inst_loads);
+    }
+
     CHECK(!arch->MayHaveDelaySlot(inst))
         << "TODO: Delay slots are not yet handled in VMill";
 
@@ -416,13 +973,42 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
 
       case remill::Instruction::kCategoryDirectJump:
         llvm::BranchInst::Create(
-            GetOrCreateBlock(static_cast<PC>(inst.branch_taken_pc)),
-            block);
+            CheckBudgetOnBackEdge(inst.branch_taken_pc), block);
         break;
 
-      case remill::Instruction::kCategoryIndirectJump:
-        remill::AddTerminatingTailCall(block, intrinsics.jump);
+      case remill::Instruction::kCategoryIndirectJump: {
+        const auto jump_func = cached_jump ? cached_jump : intrinsics.jump;
+        const auto jump_table = trace.FindJumpTable(static_cast<PC>(inst.pc));
+        if (!jump_table) {
+          remill::AddTerminatingTailCall(block, jump_func);
+          break;
+        }
+
+        // Switch over the targets recovered from the jump table, and go
+        // through the dispatcher for anything else.
+        auto unknown_target_block = llvm::BasicBlock::Create(
+            *context_ptr, llvm::Twine::createNull(), func);
+        remill::AddTerminatingTailCall(unknown_target_block, jump_func);
+
+        // Switches are the back-edges of interpreter loops.
+        llvm::IRBuilder<> ir(block);
+        auto target_pc = ir.CreateLoad(pc_type, next_pc_ptr);
+        if (check_budget) {
+          ir.CreateCall(check_budget, {ir.CreateZExtOrTrunc(
+              target_pc, llvm::Type::getInt64Ty(*context_ptr))});
+        }
+
+        auto switch_inst = ir.CreateSwitch(
+            target_pc, unknown_target_block,
+            static_cast<unsigned>(jump_table->targets.size()));
+        for (auto target : jump_table->targets) {
+          switch_inst->addCase(
+              llvm::ConstantInt::get(
+                  pc_type, static_cast<uint64_t>(target), false),
+              GetOrCreateBlock(target));
+        }
         break;
+      }
 
       case remill::Instruction::kCategoryDirectFunctionCall:
         if (inst.branch_taken_pc != inst.branch_not_taken_pc) {
@@ -433,7 +1019,8 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
           auto target_func = semantics->getFunction(target_func_name);
           llvm::Value *mem_ptr = nullptr;
           if (!target_func) {
-            mem_ptr = remill::AddCall(block, intrinsics.function_call);
+            mem_ptr = remill::AddCall(
+                block, chain_call ? chain_call : intrinsics.function_call);
 
           } else {
             mem_ptr = remill::AddCall(block, target_func);
@@ -452,7 +1039,8 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
         break;
 
       case remill::Instruction::kCategoryIndirectFunctionCall: {
-        auto mem_ptr = remill::AddCall(block, intrinsics.function_call);
+        auto mem_ptr = remill::AddCall(
+            block, cached_call ? cached_call : intrinsics.function_call);
         LiftPostFunctionCall(
             block, GetOrCreateBlock(static_cast<PC>(inst.branch_not_taken_pc)),
             ret_pc, mem_ptr);
@@ -463,9 +1051,10 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
         remill::AddTerminatingTailCall(block, intrinsics.function_return);
         break;
 
+      // Only the taken edge counts against the budget.
       case remill::Instruction::kCategoryConditionalBranch:
         llvm::BranchInst::Create(
-            GetOrCreateBlock(static_cast<PC>(inst.branch_taken_pc)),
+            CheckBudgetOnBackEdge(inst.branch_taken_pc),
             GetOrCreateBlock(static_cast<PC>(inst.branch_not_taken_pc)),
             remill::LoadBranchTaken(block), block);
         break;
@@ -508,6 +1097,9 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
   }
 
   OptimizeFunction(func);
+  if (!trace.immutable_loads.empty()) {
+    FoldImmutableLoads(func, trace);
+  }
   return func;
 }
 
@@ -580,6 +1172,12 @@ void LifterImpl::LiftTracesIntoModule(const FuncToTraceMap &lifted_funcs,
     used_list.push_back(llvm::ConstantExpr::getBitCast(var, int8_ptr_type));
   }
 
+  ChainDirectCalls(module);
+  CacheIndirectBranches(module, "__vmill_cached_jump", "__vmill_jump_miss");
+  CacheIndirectBranches(module, "__vmill_cached_call", "__vmill_call_miss");
+  InlineBudgetChecks(module);
+  InlineExecutionCounters(module);
+
   // Mark all the translations as used.
   auto used_type = llvm::ArrayType::get(int8_ptr_type, used_list.size());
   auto used = new llvm::GlobalVariable(
@@ -608,8 +1206,8 @@ Lifter::~Lifter(void) {}
 // Lift a list of decoded traces into a new LLVM bitcode module, and
 // return the resulting module.
 std::unique_ptr<llvm::Module> Lifter::Lift(
-    const DecodedTraceList &traces) const {
-  return impl->Lift(traces);
+    const DecodedTraceList &traces, CodeTier tier) const {
+  return impl->Lift(traces, tier);
 }
 
 }  // namespace vmill
@@ -21,6 +21,8 @@
 #include <memory>
 #include <vector>
 
+#include "vmill/BC/Trace.h"
+
 namespace llvm {
 class LLVMContext;
 class Module;
@@ -50,8 +52,10 @@ class Lifter {
                   const std::shared_ptr<llvm::LLVMContext> &context);
 
   // Lift a list of decoded traces into a new LLVM bitcode module, and
-  // return the resulting module.
-  std::unique_ptr<llvm::Module> Lift(const DecodedTraceList &traces) const;
+  // return the resulting module. `tier` is the code tier into which the
+  // module will be compiled.
+  std::unique_ptr<llvm::Module> Lift(const DecodedTraceList &traces,
+                                     CodeTier tier=kCodeTierWarm) const;
 
  protected:
   Lifter(void) = delete;
@@ -33,7 +33,8 @@
 namespace vmill {
 
 void OptimizeModule(llvm::Module *module,
-                    std::function<llvm::Function *(void)> generator) {
+                    std::function<llvm::Function *(void)> generator,
+                    unsigned opt_level) {
   llvm::legacy::FunctionPassManager func_manager(module);
   llvm::legacy::PassManager module_manager;
 
@@ -43,12 +44,14 @@ void OptimizeModule(llvm::Module *module,
   TLI->disableAllFunctions();  // `-fno-builtin`.
 
   llvm::PassManagerBuilder builder;
-  builder.OptLevel = 3;
+  builder.OptLevel = opt_level;
   builder.SizeLevel = 0;
-  builder.Inliner = llvm::createFunctionInliningPass(
-      std::numeric_limits<int>::max());
+  if (2 <= opt_level) {
+    builder.Inliner = llvm::createFunctionInliningPass(
+        std::numeric_limits<int>::max());
+  }
   builder.LibraryInfo = TLI;  // Deleted by `llvm::~PassManagerBuilder`.
-  builder.DisableUnrollLoops = false;  // Unroll loops!
+  builder.DisableUnrollLoops = 2 > opt_level;  // Unroll loops!
   builder.RerollLoops = false;
   builder.SLPVectorize = false;
   builder.LoopVectorize = false;
@@ -25,9 +25,13 @@ class Module;
 
 namespace vmill {
 
+// Optimize the functions produced by `generator`, then the whole `module`, at
+// `opt_level` (0 through 3). Functions are only inlined into each other at
+// levels 2 and above.
 void OptimizeModule(
     llvm::Module *module,
-    std::function<llvm::Function *(void)> generator);
+    std::function<llvm::Function *(void)> generator,
+    unsigned opt_level=3);
 
 }  // namespace vmill
 
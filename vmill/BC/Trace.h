@@ -29,6 +29,28 @@ enum class TraceHash : TraceHashBaseType;
 enum class PC : uint64_t;
 enum class CodeVersion : uint64_t;
 
+enum : unsigned {
+  // Number of `(PC, lifted function)` pairs in the inline cache of each lifted
+  // indirect jump or call site.
+  kNumInlineCacheEntries = 2
+};
+
+// The PC of an empty inline cache entry. No instruction can start at this
+// address, so comparisons against it always fail.
+static constexpr uint64_t kInvalidInlineCachePC = ~0ULL;
+
+// How much effort is spent compiling lifted code. Cold code is compiled
+// quickly so that it can start running as soon as possible, and is never
+// saved to disk. Warm code is cheaply compiled in the background, and
+// replaces cold code. Traces that execute often enough are re-lifted into
+// hot code, which is aggressively optimized and replaces warm code.
+enum CodeTier : unsigned {
+  kCodeTierCold,
+  kCodeTierWarm,
+  kCodeTierHot,
+  kNumCodeTiers
+};
+
 // Hash of the bytes of the machine code in the trace.
 struct TraceId {
  public:
@@ -56,6 +78,17 @@ struct LiveTraceId {
   }
 };
 
+// Mix the bits of `val` so that nearby values (e.g. program counters) end up
+// far apart in the low-order bits. This is the finalizer of MurmurHash3.
+inline uint64_t MixHashBits(uint64_t val) {
+  val ^= val >> 33;
+  val *= 0xff51afd7ed558ccdULL;
+  val ^= val >> 33;
+  val *= 0xc4ceb9fe1a85ec53ULL;
+  val ^= val >> 33;
+  return val;
+}
+
 }  // namespace vmill
 
 namespace std {
@@ -66,7 +99,9 @@ struct hash<vmill::TraceId> {
   using result_type = uint64_t;
   using argument_type = vmill::TraceId;
   inline result_type operator()(const argument_type &val) const {
-    return static_cast<result_type>(val.hash);
+    const auto pc_uint = static_cast<uint64_t>(val.pc);
+    const auto hash_uint = static_cast<uint64_t>(val.hash);
+    return hash_uint ^ vmill::MixHashBits(pc_uint);
   }
 };
 
@@ -78,7 +113,7 @@ struct hash<vmill::LiveTraceId> {
   inline result_type operator()(const argument_type &val) const {
     const auto pc_uint = static_cast<uint64_t>(val.pc);
     const auto code_version_uint = static_cast<uint64_t>(val.code_version);
-    return pc_uint ^ code_version_uint;
+    return vmill::MixHashBits(pc_uint) ^ code_version_uint;
   }
 };
 
@@ -16,13 +16,32 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <link.h>
+#include <list>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <vector>
 #include <sstream>
 #include <string>
+#include <signal.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 
 #include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/IR/Constant.h>
@@ -30,12 +49,14 @@
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Host.h>
 #include <llvm/Support/MemoryBuffer.h>
 
 #include "remill/BC/Compat/Error.h"
 #include "remill/BC/Compat/RuntimeDyld.h"
 #include "remill/BC/Compat/JITSymbol.h"
 #include "remill/BC/Util.h"
+#include "remill/BC/Version.h"
 #include "remill/OS/FileSystem.h"
 
 #include "vmill/BC/Compiler.h"
@@ -44,16 +65,48 @@
 #include "vmill/Program/AddressSpace.h"
 #include "vmill/Util/AreaAllocator.h"
 #include "vmill/Util/Compiler.h"
+#include "vmill/Util/FileBackedHashMap.h"
+#include "vmill/Util/FlatMap.h"
+#include "vmill/Util/Hash.h"
+#include "vmill/Workspace/BitcodeArchive.h"
 #include "vmill/Workspace/Tool.h"
 #include "vmill/Workspace/Workspace.h"
 
+#include "third_party/ThreadPool/ThreadPool.h"
+
 #include <gflags/gflags.h>
 
+DECLARE_bool(compact_code_layout);
+DECLARE_string(tool);
+
+DEFINE_uint64(max_code_cache_size, 0,
+              "Maximum number of bytes of memory that loaded lifted code can "
+              "use before the least useful code is evicted. A value of zero "
+              "means that the code cache is unbounded.");
+
+DEFINE_uint64(num_recompile_threads, 0,
+              "Number of threads used to recompile already lifted bitcode "
+              "when the code cache has to be rebuilt, e.g. for a new tool. "
+              "Zero means one thread per CPU core.");
+
+DEFINE_bool(share_code_cache, false,
+            "Map lifted code out of the code cache snapshot instead of "
+            "copying it, so that its memory is shared by every process "
+            "running against the same workspace. Only one of those "
+            "processes at a time updates the snapshot.");
+
+DEFINE_bool(lazy_load_libraries, true,
+            "Only load a cached library when one of its traces is first "
+            "needed, instead of loading every cached library at startup.");
+
 extern "C" {
 // Used to register exception handling frames with the JIT.
 __attribute__((weak))
 extern void __register_frame(void *);
 
+__attribute__((weak))
+extern void __deregister_frame(void *);
+
 }  // extern C
 namespace vmill {
 namespace {
@@ -81,6 +134,334 @@ struct MemoryMap {
   }
 };
 
+// An object file of lifted code that has been loaded into the code cache.
+// This tracks everything needed to unload the object.
+struct LoadedObject {
+  std::string path;
+  CodeTier tier;
+  std::vector<MemoryMap> ranges;
+  std::vector<TraceId> trace_ids;
+  std::vector<uint8_t *> eh_frames;
+  size_t size;
+};
+
+// The persistent index of which library implements which trace maps a trace
+// in some code tier to the file name of its library.
+struct LibraryIndexKey {
+  TraceId trace_id;
+  uint32_t tier;
+
+  inline bool operator==(const LibraryIndexKey &that) const {
+    return trace_id == that.trace_id && tier == that.tier;
+  }
+} __attribute__((packed));
+
+struct LibraryIndexKeyHash {
+  inline uint64_t operator()(const LibraryIndexKey &key) const {
+    return std::hash<TraceId>()(key.trace_id) ^ MixHashBits(key.tier);
+  }
+};
+
+struct LibraryFileName {
+  char file_name[60];
+
+  inline bool operator==(const LibraryFileName &that) const {
+    return !memcmp(file_name, that.file_name, sizeof(file_name));
+  }
+} __attribute__((packed));
+
+using LibraryIndex = FileBackedHashMap<LibraryIndexKey, LibraryFileName,
+                                       LibraryIndexKeyHash>;
+
+// Returns the path of the library whose file name is `name`.
+static std::string IndexedLibraryPath(const LibraryFileName &name) {
+  std::stringstream ss;
+  ss << Workspace::LibraryDir() << remill::PathSeparator()
+     << std::string(name.file_name, strnlen(name.file_name,
+                                            sizeof(name.file_name)));
+  return ss.str();
+}
+
+// A cached library that is only loaded when one of its traces is needed.
+struct LazyLibrary {
+  std::string path;
+  CodeTier tier;
+  bool is_loaded;
+  bool exists;
+};
+
+// Header of the code cache snapshot file. A snapshot holds lifted code that
+// has already been relocated to its addresses in the code cache, and so it is
+// only usable if everything that the code was compiled and linked against is
+// the same as in the run that saved it. The exception is functions outside of
+// the code cache, which lifted code calls through link stubs.
+struct SnapshotHeader {
+  uint64_t magic;
+  uint64_t format_version;
+  uint64_t runtime_hash;
+  uint64_t tool_hash;
+  uint64_t llvm_version;
+  uint64_t cpu_hash;
+  uint64_t payload_size;
+  uint64_t payload_hash;
+};
+
+enum : uint64_t {
+  kSnapshotMagic = 0x45484341434c4d56ULL,  // `VMLCACHE`.
+  kSnapshotFormatVersion = 4ULL,
+
+  // The contents of each area begin at a multiple of this many bytes, both in
+  // memory and in the snapshot file, so that they can be mapped directly out
+  // of the file. This is the largest page size of any supported host.
+  kSnapshotAreaAlignment = 65536ULL
+};
+
+// A `MemoryMap`, as stored in a snapshot.
+struct SnapshotRange {
+  uint64_t base;
+  uint64_t size;
+  uint32_t section_id;
+  uint8_t can_read;
+  uint8_t can_write;
+  uint8_t can_exec;
+  uint8_t is_index;
+} __attribute__((packed));
+
+// The used part of one of the code cache's allocators, as stored in a
+// snapshot.
+struct SnapshotArea {
+  uint8_t *begin;
+  uint64_t size;
+  const uint8_t *bytes;
+  uint64_t file_offset;
+  std::vector<std::pair<uint8_t *, uint64_t>> free_ranges;
+};
+
+// Serializes plain data into the payload of a snapshot.
+class SnapshotWriter {
+ public:
+  template <typename T>
+  void Write(const T &val) {
+    WriteBytes(&val, sizeof(val));
+  }
+
+  void WriteBytes(const void *data, size_t size) {
+    payload.append(reinterpret_cast<const char *>(data), size);
+  }
+
+  void WriteString(const std::string &str) {
+    Write<uint64_t>(str.size());
+    WriteBytes(str.data(), str.size());
+  }
+
+  // Pad the payload with zeroes until the next write lands a multiple of
+  // `align` bytes into the file, given that the payload begins `origin`
+  // bytes into the file.
+  void AlignTo(uint64_t align, uint64_t origin) {
+    const auto offset = origin + payload.size();
+    payload.append(static_cast<size_t>((align - (offset % align)) % align),
+                   '\0');
+  }
+
+  std::string payload;
+};
+
+// Deserializes plain data out of the payload of a snapshot. Once one read
+// runs off of the end of the payload, all future reads fail.
+class SnapshotReader {
+ public:
+  SnapshotReader(const uint8_t *begin_, const uint8_t *end_)
+      : cursor(begin_),
+        end(end_) {}
+
+  template <typename T>
+  bool Read(T &val) {
+    if (auto bytes = Skip(sizeof(val))) {
+      memcpy(&val, bytes, sizeof(val));
+      return true;
+    }
+    return false;
+  }
+
+  bool ReadString(std::string &str) {
+    uint64_t size = 0;
+    if (!Read(size)) {
+      return false;
+    }
+    if (auto bytes = Skip(size)) {
+      str.assign(reinterpret_cast<const char *>(bytes), size);
+      return true;
+    }
+    return false;
+  }
+
+  // Skip the padding written by `SnapshotWriter::AlignTo`, where `origin` is
+  // the beginning of the file.
+  void AlignTo(uint64_t align, const uint8_t *origin) {
+    if (cursor) {
+      const auto offset = static_cast<uint64_t>(cursor - origin);
+      Skip((align - (offset % align)) % align);
+    }
+  }
+
+  // Returns `true` if no read has failed.
+  inline bool Ok(void) const {
+    return cursor != nullptr;
+  }
+
+  // Returns a pointer to the next `size` bytes of the payload, and moves past
+  // them.
+  const uint8_t *Skip(uint64_t size) {
+    if (!cursor || static_cast<uint64_t>(end - cursor) < size) {
+      cursor = nullptr;
+      return nullptr;
+    }
+    auto bytes = cursor;
+    cursor += size;
+    return bytes;
+  }
+
+ private:
+  const uint8_t *cursor;
+  const uint8_t * const end;
+};
+
+enum : unsigned {
+  kNumSnapshotAreas = 4
+};
+
+enum : size_t {
+  kLinkStubSize = 16
+};
+
+// Returns `true` if `addr` is inside of an executable segment of the
+// executable or of a shared library, i.e. if it's a function whose address
+// can change from run to run.
+static bool IsInExecutableSegment(uint64_t addr) {
+#if defined(__x86_64__) && defined(__linux__)
+  auto found = false;
+  std::pair<uint64_t, bool *> data = {addr, &found};
+  dl_iterate_phdr(
+      [] (struct dl_phdr_info *info, size_t, void *data_) {
+        auto &data = *reinterpret_cast<std::pair<uint64_t, bool *> *>(data_);
+        for (auto i = 0U; i < info->dlpi_phnum; ++i) {
+          const auto &phdr = info->dlpi_phdr[i];
+          const auto seg_begin = info->dlpi_addr + phdr.p_vaddr;
+          if (PT_LOAD == phdr.p_type && (phdr.p_flags & PF_X) &&
+              seg_begin <= data.first &&
+              data.first < (seg_begin + phdr.p_memsz)) {
+            *data.second = true;
+            return 1;
+          }
+        }
+        return 0;
+      },
+      &data);
+  return found;
+#else
+  (void) addr;
+  return false;
+#endif
+}
+
+// Write a stub at `stub` that jumps to `target`. The target is the last eight
+// bytes of the stub, so that it can be changed without touching any code.
+static void WriteLinkStub(uint8_t *stub, uint64_t target) {
+  static const uint8_t kJumpToTarget[] = {
+      0xFF, 0x25, 0x02, 0x00, 0x00, 0x00,  // `jmp [rip + 2]`.
+      0xCC, 0xCC};
+  static_assert((sizeof(kJumpToTarget) + sizeof(target)) == kLinkStubSize,
+                "Invalid size of link stub.");
+  memcpy(stub, kJumpToTarget, sizeof(kJumpToTarget));
+  memcpy(&(stub[sizeof(kJumpToTarget)]), &target, sizeof(target));
+}
+
+// An LLVM context and compilers that are private to one compiling thread.
+// These mirror the code cache's own compilers for each code tier.
+struct ThreadCompiler {
+  ThreadCompiler(void)
+      : context(new llvm::LLVMContext),
+        compiler(context),
+        cold_compiler(context, llvm::CodeGenOpt::None),
+        warm_compiler(context, llvm::CodeGenOpt::Less) {}
+
+  const std::shared_ptr<llvm::LLVMContext> context;
+  Compiler compiler;
+  Compiler cold_compiler;
+  Compiler warm_compiler;
+};
+
+static thread_local std::optional<ThreadCompiler> tCompiler;
+
+// Already lifted bitcode, either in its own file at `path`, or in the
+// bitcode archive as the module `name`.
+struct LiftedBitcodeSource {
+  std::string path;
+  std::string name;
+  const char *data{nullptr};
+  size_t size{0};
+};
+
+// Returns a description of the host CPU. Lifted code is compiled to use all
+// features of the host CPU (see `Compiler`).
+static std::string HostCPUDescription(void) {
+  std::vector<std::string> features;
+  llvm::StringMap<bool> host_features;
+  if (llvm::sys::getHostCPUFeatures(host_features)) {
+    for (auto &feature : host_features) {
+      if (feature.second) {
+        features.push_back(feature.first().str());
+      }
+    }
+  }
+  std::sort(features.begin(), features.end());
+
+  std::stringstream ss;
+  ss << llvm::sys::getProcessTriple() << ' '
+     << llvm::sys::getHostCPUName().str();
+  for (const auto &feature : features) {
+    ss << ' ' << feature;
+  }
+  return ss.str();
+}
+
+// Write all of `size` bytes from `data` into `fd`.
+static bool WriteAll(int fd, const void *data, size_t size) {
+  auto bytes = reinterpret_cast<const uint8_t *>(data);
+  while (size) {
+    auto ret = write(fd, bytes, size);
+    if (-1 == ret) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return false;
+    }
+    bytes += ret;
+    size -= static_cast<size_t>(ret);
+  }
+  return true;
+}
+
+// Returns the name of a file that only this process writes to, and that
+// will be renamed to `path` once it's complete.
+static std::string PrivatePath(const std::string &path, const char *suffix) {
+  std::stringstream ss;
+  ss << path << "." << getpid() << suffix;
+  return ss.str();
+}
+
+// Compile `module` into the object file `path`. Other processes sharing the
+// workspace might be loading `path`, so the object file is written to a
+// private file first.
+static void CompileModuleToPath(Compiler &compiler, llvm::Module &module,
+                                const std::string &path) {
+  const auto temp_path = PrivatePath(path, ".tmp");
+  compiler.CompileModuleToFile(module, temp_path);
+  CHECK(!rename(temp_path.c_str(), path.c_str()))
+      << "Unable to rename " << temp_path << " to " << path << ": "
+      << strerror(errno);
+}
+
 class CodeCacheImpl : public CodeCache,
                       public llvm::RuntimeDyld::MemoryManager,
                       public llvm::JITSymbolResolver {
@@ -90,10 +471,37 @@ class CodeCacheImpl : public CodeCache,
 
   virtual ~CodeCacheImpl(void);
 
-  LiftedFunction *Lookup(TraceId trace_id) const final;
+  LiftedFunction *Lookup(TraceId trace_id) final;
+
+  bool IsCached(TraceId trace_id) const final;
+
+  bool OwnsWorkspace(void) const final {
+    return is_snapshot_writer;
+  }
 
   uintptr_t Lookup(const char *symbol) final;
 
+  bool IsOverBudget(void) const final {
+    return FLAGS_max_code_cache_size &&
+           loaded_size > FLAGS_max_code_cache_size;
+  }
+
+  bool ContainsCode(uintptr_t addr) const final {
+    const auto addr_bytes = reinterpret_cast<uint8_t *>(addr);
+    return code_allocator.Contains(addr_bytes) ||
+           hot_code_allocator.Contains(addr_bytes);
+  }
+
+  bool IsLoaded(LiftedFunction *lifted_func) const final;
+
+  void EvictCode(
+      const std::function<bool(LiftedFunction *)> &is_live,
+      const std::function<bool(uintptr_t, uintptr_t)> &is_pinned) final;
+
+  void EvictColdCode(
+      const std::function<bool(LiftedFunction *)> &is_live,
+      const std::function<bool(uintptr_t, uintptr_t)> &is_pinned) final;
+
   // Called to run constructors in the runtime.
   void RunConstructors(void) final {
     if (constructors.empty()) {
@@ -114,16 +522,22 @@ class CodeCacheImpl : public CodeCache,
   }
 
   // Called just after the end of a run.
-  void TearDown(void) final {
+  void TearDown(bool save_snapshot) final {
     tool->TearDown();
+    library_index->Sync();
+    if (save_snapshot) {
+      SaveSnapshot();
+    }
+    LogSymbolStats();
   }
 
   // Load the runtime library, this must be done first, as it supported all
   // lifted code execution.
   void LoadRuntimeLibrary(void);
 
-  // Load a JIT-compiled module from a file `path`.
-  void LoadLibrary(const std::string &path, bool is_runtime=false);
+  // Load a JIT-compiled module from a file `path`. Returns `false` if the
+  // file can't be opened, e.g. because another process evicted it.
+  bool LoadLibrary(const std::string &path, bool is_runtime=false);
 
   // Load all JIT-compiled modules from the libraries directory. Returns the
   // number of loaded libraries.
@@ -132,9 +546,26 @@ class CodeCacheImpl : public CodeCache,
   // JIT compile any already lifted bitcode.
   void ReloadLibraries(void);
 
-  // Implementing the `CodeCache` interface. This takes ownership of the
-  // module.
-  void AddModuleToCache(const std::unique_ptr<llvm::Module> &module) final;
+  // Instrument and compile the lifted bitcode `source` into a warm library,
+  // using the calling thread's own LLVM context. Returns the path of the
+  // library, or an empty string if the bitcode can't be loaded.
+  std::string RecompileBitcode(const LiftedBitcodeSource &source);
+
+  // Implementing the `CodeCache` interface.
+  void AddModuleToCache(const std::unique_ptr<llvm::Module> &module,
+                        CodeTier tier) final;
+
+  std::string CompileModule(const std::unique_ptr<llvm::Module> &module,
+                            CodeTier tier) final;
+
+  llvm::LLVMContext &ThreadContext(void) final {
+    if (unlikely(!tCompiler)) {
+      tCompiler.emplace();
+    }
+    return *(tCompiler->context);
+  }
+
+  void LoadCompiledModule(const std::string &path, CodeTier tier) final;
 
   // Implementing the `llvm::RuntimeDyld::MemoryManager` interface:
 
@@ -151,7 +582,7 @@ class CodeCacheImpl : public CodeCache,
   void registerEHFrames(uint8_t *addr, uint64_t load_addr,
                         size_t size) final;
 
-  // We never unload JITed code.
+  // Frames are deregistered when their object is evicted, in `UnloadObject`.
   void deregisterEHFrames(
       IF_LLVM_LT(5, 0, uint8_t *, uint64_t, size_t)) final {}
 
@@ -189,15 +620,81 @@ class CodeCacheImpl : public CodeCache,
   bool LoadIndex(const MemoryMap &range, std::string *error_message);
   void LoadConstructors(const MemoryMap &range);
 
-  void ReoptimizeModule(const std::unique_ptr<llvm::Module> &module);
-  void InstrumentTraces(const std::unique_ptr<llvm::Module> &module);
+  // Remove all traces of `object` from the code cache, and free its memory.
+  void UnloadObject(const LoadedObject &object);
+
+  // Unload objects that pass `can_evict` until at most `target_size` bytes of
+  // lifted code remain loaded. Objects none of whose functions satisfy
+  // `is_live` are unloaded first, then, unless `only_dead` is `true`, the
+  // oldest objects.
+  void EvictObjects(
+      const std::function<bool(LiftedFunction *)> &is_live,
+      const std::function<bool(uintptr_t, uintptr_t)> &is_pinned,
+      const std::function<bool(const LoadedObject &)> &can_evict,
+      size_t target_size, bool only_dead);
+
+  // Resolve the external symbol `name` by looking in the process, then in
+  // the runtime, and then giving the tool a chance to override it. Returns
+  // `0` if `name` can't be resolved.
+  uint64_t ResolveSymbol(const std::string &name);
+
+  // Pre-resolve every symbol exported by the runtime object `runtime`. These
+  // are the intrinsics that every lifted module links against.
+  void AddRuntimeSymbols(const llvm::object::ObjectFile &runtime);
+
+  // Log how many symbols were looked up, and how long resolving them took.
+  void LogSymbolStats(void) const;
+
+  // Returns the address that lifted code links against to reach the
+  // symbol `name`, which resolved to `addr`.
+  uint64_t LinkAddress(const std::string &name, uint64_t addr);
+
+  // Returns `true` if `addr` is in memory managed by the code cache.
+  bool IsInCodeCache(uint64_t addr) const;
+
+  // Record the traces of `object` in the library index, so that future runs
+  // can load it lazily.
+  void IndexLibrary(const LoadedObject &object);
+
+  // Load the not-yet-loaded library that implements `trace_id` in `tier`.
+  LiftedFunction *LoadLazily(TraceId trace_id, CodeTier tier);
+
+  // Returns the snapshot header that matches this run, minus its payload.
+  SnapshotHeader ExpectedSnapshotHeader(void) const;
+
+  // Load all lifted code from the snapshot file. Returns `false`, having
+  // loaded nothing, if there is no usable snapshot.
+  bool LoadSnapshot(void);
+  bool LoadSnapshotFile(const std::string &path, int fd);
+
+  // Save all loaded lifted code into the snapshot file, if it has changed
+  // since the snapshot was loaded.
+  void SaveSnapshot(void);
+
+  void ReoptimizeModule(const std::unique_ptr<llvm::Module> &module,
+                        unsigned opt_level=3);
+  void InstrumentTraces(const std::unique_ptr<llvm::Module> &module,
+                        CodeTier tier);
 
   const std::unique_ptr<Tool> tool;
 
+  // Serializes uses of `tool` by the recompiling and compiling threads, and
+  // by the symbol resolution of libraries that are loaded while they run.
+  std::mutex tool_lock;
+
   const std::shared_ptr<llvm::LLVMContext> &context;
 
   Compiler compiler;
+
+  // Used to quickly compile cold and warm code. The above `compiler` is used
+  // for hot code.
+  Compiler cold_compiler;
+  Compiler warm_compiler;
+
+  // Hot code is kept apart from cold and warm code, so that it is packed
+  // into as few (huge) pages as possible.
   AreaAllocator code_allocator;
+  AreaAllocator hot_code_allocator;
   AreaAllocator data_allocator;
   AreaAllocator index_allocator;
   AreaAllocator ctor_allocator;
@@ -208,7 +705,69 @@ class CodeCacheImpl : public CodeCache,
   std::unique_ptr<llvm::RuntimeDyld> pending_loader;
   std::unique_ptr<llvm::RuntimeDyld> runtime_loader;
   std::string pending_source_file;
-  std::unordered_map<TraceId, LiftedFunction *> lifted_functions;
+
+  // Lifted traces, indexed by the tier of the code that implements them. A
+  // lookup prefers the hottest available implementation of a trace.
+  FlatMap<TraceId, LiftedFunction *> lifted_functions[kNumCodeTiers];
+
+  // Tier of the library that is currently being loaded.
+  CodeTier pending_tier{kCodeTierWarm};
+
+  // Persistent index of the traces in each cached library, and the cached
+  // libraries that haven't been loaded yet, indexed by their traces.
+  const std::unique_ptr<LibraryIndex> library_index;
+  std::vector<LazyLibrary> lazy_libraries;
+  std::unordered_map<TraceId, size_t> lazy_traces[kNumCodeTiers];
+
+  // Loaded lifted code, oldest first, and the library that is currently
+  // being loaded.
+  std::list<LoadedObject> loaded_objects;
+  LoadedObject pending_object;
+
+  // Total size of the memory used by `loaded_objects`.
+  size_t loaded_size{0};
+
+  // The allocators whose contents are saved in snapshots, and where each of
+  // them ended after the runtime was loaded. Everything after that belongs
+  // to lifted code.
+  AreaAllocator * const snapshot_areas[kNumSnapshotAreas];
+  uint8_t *runtime_ends[kNumSnapshotAreas];
+
+  // With `--share_code_cache`, only the process holding a lock on
+  // `snapshot_lock_fd` writes (or deletes) the snapshot, and deletes
+  // libraries. All others only read them.
+  int snapshot_lock_fd{-1};
+  bool is_snapshot_writer{true};
+
+  // Hash of the runtime library's object file.
+  uint64_t runtime_hash{0};
+
+  // Symbols outside of lifted code that lifted code has been linked against.
+  // A snapshot is only usable if these resolve to the same addresses.
+  std::map<std::string, uint64_t> linked_symbols;
+  bool is_loading_lifted_code{false};
+
+  // Lifted code reaches functions outside of the code cache, e.g. in the
+  // executor or in libc, through these stubs in `code_allocator`. Loading a
+  // snapshot re-targets the stubs, so that the snapshot remains usable when
+  // ASLR loads the executor and its libraries at different addresses.
+  std::map<std::string, uint8_t *> link_stubs;
+
+  // Memoized addresses of resolved external symbols. Only symbols whose
+  // addresses can't change (i.e. ones that aren't defined by lifted code)
+  // go in here; traces are found through `lifted_functions` instead.
+  std::unordered_map<std::string, uint64_t> symbol_table;
+
+  // Statistics about symbol resolution.
+  uint64_t num_symbol_lookups{0};
+  uint64_t num_symbol_table_hits{0};
+  uint64_t num_resolved_symbols{0};
+  std::chrono::steady_clock::duration symbol_resolution_time{0};
+
+  // Whether or not the loaded lifted code differs from what is in the
+  // snapshot file.
+  bool snapshot_is_stale{true};
+
   std::vector<void(*)(void)> constructors;
 };
 
@@ -218,24 +777,63 @@ CodeCacheImpl::CodeCacheImpl(std::unique_ptr<Tool> tool_,
       tool(std::move(tool_)),
       context(context_),
       compiler(context_),
-      code_allocator(kAreaRWX, kAreaCodeCacheCode),
-      data_allocator(kAreaRW, kAreaCodeCacheData),
+      cold_compiler(context_, llvm::CodeGenOpt::None),
+      warm_compiler(context_, llvm::CodeGenOpt::Less),
+      code_allocator(kAreaRWX, kAreaCodeCacheCode, k2MiB,
+                     kAreaCodeCacheHotCode - kAreaCodeCacheCode,
+                     FLAGS_compact_code_layout),
+      hot_code_allocator(kAreaRWX, kAreaCodeCacheHotCode, k2MiB,
+                         kAreaCodeCacheData - kAreaCodeCacheHotCode,
+                         FLAGS_compact_code_layout),
+      data_allocator(kAreaRW, kAreaCodeCacheData, k2MiB,
+                     FLAGS_compact_code_layout ? k512MiB : 0),
       index_allocator(kAreaRW, kAreaCodeCacheIndex),
       ctor_allocator(kAreaRW),
-      event_listener(llvm::JITEventListener::createGDBRegistrationListener()) {
+      event_listener(llvm::JITEventListener::createGDBRegistrationListener()),
+      library_index(LibraryIndex::Open(
+          Workspace::LibraryIndexPath(),
+          [] (const LibraryIndexKey &, const LibraryFileName &name) {
+            return remill::FileExists(IndexedLibraryPath(name));
+          })),
+      snapshot_areas{&code_allocator, &hot_code_allocator, &data_allocator,
+                     &index_allocator} {
   LoadRuntimeLibrary();
-  if (!LoadLibraries()) {
+  for (auto i = 0U; i < kNumSnapshotAreas; ++i) {
+    snapshot_areas[i]->Allocate(0, kSnapshotAreaAlignment);
+    runtime_ends[i] = snapshot_areas[i]->End();
+  }
+
+  if (FLAGS_share_code_cache) {
+    const auto lock_path = Workspace::CodeCachePath() + ".lock";
+    snapshot_lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                            0666);
+    is_snapshot_writer = -1 != snapshot_lock_fd &&
+                         !flock(snapshot_lock_fd, LOCK_EX | LOCK_NB);
+    LOG(INFO)
+        << "This process is a " << (is_snapshot_writer ? "writer" : "reader")
+        << " of the shared code cache snapshot";
+  }
+
+  // Object files that are newer than the snapshot are loaded on top of it.
+  const auto loaded_snapshot = LoadSnapshot();
+  if (!LoadLibraries() && !loaded_snapshot) {
     ReloadLibraries();
   }
 }
 
-CodeCacheImpl::~CodeCacheImpl(void) {}
+CodeCacheImpl::~CodeCacheImpl(void) {
+  if (-1 != snapshot_lock_fd) {
+    close(snapshot_lock_fd);
+  }
+}
 
 // Allocate memory for a code section.
 uint8_t *CodeCacheImpl::allocateCodeSection(
     uintptr_t size, unsigned alignment, unsigned section_id,
     llvm::StringRef name) {
-  MemoryMap map = {code_allocator.Allocate(size, alignment), size,
+  auto &allocator = kCodeTierHot == pending_tier ? hot_code_allocator :
+                                                   code_allocator;
+  MemoryMap map = {allocator.Allocate(size, alignment), size,
                    section_id, true, false, true, false, false,
                    pending_source_file};
   pending_jit_ranges[section_id] = map;
@@ -273,6 +871,7 @@ uint8_t *CodeCacheImpl::allocateDataSection(
 void CodeCacheImpl::registerEHFrames(uint8_t *addr, uint64_t, size_t) {
   if (__register_frame) {
     __register_frame(addr);
+    pending_object.eh_frames.push_back(addr);
   }
 }
 
@@ -286,7 +885,8 @@ bool CodeCacheImpl::LoadIndex(const MemoryMap &range,
     if (!static_cast<uint64_t>(base->trace_id.pc)) {
       continue;
 
-    } else if (!code_allocator.Contains(base->lifted_function)) {
+    } else if (!ContainsCode(reinterpret_cast<uintptr_t>(
+                   base->lifted_function))) {
       if (error_message) {
         *error_message = "Lifted function address is not managed by the "
                          "code cache allocator.";
@@ -303,7 +903,8 @@ bool CodeCacheImpl::LoadIndex(const MemoryMap &range,
       continue;
     }
 
-    auto &lifted_func = lifted_functions[base->trace_id];
+    auto &functions = lifted_functions[pending_tier];
+    auto lifted_func = functions.Find(base->trace_id);
     if (lifted_func != nullptr) {
       LOG(ERROR)
           << "Code at " << reinterpret_cast<void *>(base->lifted_function)
@@ -313,7 +914,8 @@ bool CodeCacheImpl::LoadIndex(const MemoryMap &range,
           << ") already implemented at "
           << reinterpret_cast<void *>(lifted_func);
     } else {
-      lifted_func = base->lifted_function;
+      functions.Insert(base->trace_id, base->lifted_function);
+      pending_object.trace_ids.push_back(base->trace_id);
     }
   }
   return all_good;
@@ -343,6 +945,8 @@ bool CodeCacheImpl::finalizeMemory(std::string *error_message) {
   for (const auto &entry : pending_jit_ranges) {
     const auto &range = entry.second;
     jit_ranges[range.base] = range;
+    pending_object.ranges.push_back(range);
+    pending_object.size += range.size;
 
     if (range.is_ctors) {
       LoadConstructors(range);
@@ -367,8 +971,61 @@ llvm::JITSymbol CodeCacheImpl::findSymbolInLogicalDylib(
   return llvm::JITSymbol(addr, llvm::JITSymbolFlags::None);
 }
 
-// Resolve external/exported symbols during linking.
+// Resolve external/exported symbols during linking. The same few hundred
+// runtime intrinsics are referenced by every lifted module, so resolved
+// symbols are memoized in `symbol_table`.
 llvm::JITSymbol CodeCacheImpl::findSymbol(const std::string &name) {
+  num_symbol_lookups++;
+
+  uint64_t resolved_addr = 0;
+  if (auto it = symbol_table.find(name); it != symbol_table.end()) {
+    resolved_addr = it->second;
+    num_symbol_table_hits++;
+
+  } else {
+    const auto start_time = std::chrono::steady_clock::now();
+    resolved_addr = ResolveSymbol(name);
+    symbol_resolution_time += std::chrono::steady_clock::now() - start_time;
+    num_resolved_symbols++;
+
+    // Don't remember symbols defined by the most recently loaded lifted
+    // code, as that code can later be evicted.
+    if (resolved_addr &&
+        (!pending_loader || !pending_loader->getSymbol(name))) {
+      symbol_table.emplace(name, resolved_addr);
+    }
+  }
+
+  if (is_loading_lifted_code && resolved_addr) {
+    resolved_addr = LinkAddress(name, resolved_addr);
+  }
+  return llvm::JITSymbol(resolved_addr, llvm::JITSymbolFlags::None);
+}
+
+uint64_t CodeCacheImpl::LinkAddress(const std::string &name, uint64_t addr) {
+  if (IsInCodeCache(addr) || !IsInExecutableSegment(addr)) {
+    linked_symbols[name] = addr;
+    return addr;
+  }
+
+  auto &stub = link_stubs[name];
+  if (!stub) {
+    stub = code_allocator.Allocate(kLinkStubSize, kLinkStubSize);
+    WriteLinkStub(stub, addr);
+  }
+  return reinterpret_cast<uintptr_t>(stub);
+}
+
+bool CodeCacheImpl::IsInCodeCache(uint64_t addr) const {
+  const auto addr_bytes = reinterpret_cast<uint8_t *>(addr);
+  return code_allocator.Contains(addr_bytes) ||
+         hot_code_allocator.Contains(addr_bytes) ||
+         data_allocator.Contains(addr_bytes) ||
+         index_allocator.Contains(addr_bytes) ||
+         ctor_allocator.Contains(addr_bytes);
+}
+
+uint64_t CodeCacheImpl::ResolveSymbol(const std::string &name) {
   auto addr = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name);
 
 #ifdef __APPLE__
@@ -397,7 +1054,12 @@ llvm::JITSymbol CodeCacheImpl::findSymbol(const std::string &name) {
 #endif
   }
 
+  // Libraries can be loaded (e.g. lazily) while the compiling thread is
+  // instrumenting code with the tool.
+  std::unique_lock<std::mutex> locker(tool_lock);
   auto resolved_addr = tool->FindSymbolForLinking(name, addr);
+  locker.unlock();
+
   if (!resolved_addr) {
     if (addr) {
       resolved_addr = addr;
@@ -406,7 +1068,50 @@ llvm::JITSymbol CodeCacheImpl::findSymbol(const std::string &name) {
           << "Could not locate address of symbol " << name;
     }
   }
-  return llvm::JITSymbol(resolved_addr, llvm::JITSymbolFlags::None);
+  return resolved_addr;
+}
+
+void CodeCacheImpl::AddRuntimeSymbols(
+    const llvm::object::ObjectFile &runtime) {
+  const auto start_time = std::chrono::steady_clock::now();
+  for (const auto &sym : runtime.symbols()) {
+    auto maybe_name = sym.getName();
+    if (remill::IsError(maybe_name)) {
+      LOG(ERROR)
+          << "Unable to get the name of a runtime symbol: "
+          << remill::GetErrorString(maybe_name);
+      continue;
+    }
+
+    // Only symbols that the runtime exports are in its global symbol table.
+    const auto name = remill::GetReference(maybe_name).str();
+    if (name.empty() || !pending_loader->getSymbol(name) ||
+        symbol_table.count(name)) {
+      continue;
+    }
+
+    if (auto addr = ResolveSymbol(name)) {
+      symbol_table.emplace(name, addr);
+      num_resolved_symbols++;
+    }
+  }
+  symbol_resolution_time += std::chrono::steady_clock::now() - start_time;
+
+  DLOG(INFO)
+      << "Pre-resolved " << symbol_table.size() << " runtime symbols";
+}
+
+void CodeCacheImpl::LogSymbolStats(void) const {
+  if (!num_symbol_lookups) {
+    return;
+  }
+
+  LOG(INFO)
+      << "Resolved " << num_resolved_symbols << " symbols in "
+      << std::chrono::duration<double, std::milli>(
+             symbol_resolution_time).count()
+      << "ms; " << num_symbol_table_hits << " of " << num_symbol_lookups
+      << " lookups hit the symbol table";
 }
 
 // Load the runtime library, this must be done first, as it supported all
@@ -435,7 +1140,7 @@ void CodeCacheImpl::LoadRuntimeLibrary(void) {
 
     DLOG(INFO)
         << "JIT-compiling runtime library bitcode";
-    compiler.CompileModuleToFile(*runtime, pending_source_file);
+    CompileModuleToPath(compiler, *runtime, pending_source_file);
   }
 
   DLOG(INFO)
@@ -489,21 +1194,30 @@ CodeCacheImpl::getResponsibilitySet(
 #endif
 
 // Load a JIT-compiled module from a file `path`.
-void CodeCacheImpl::LoadLibrary(const std::string &path, bool is_runtime) {
-  pending_source_file = path;
-  pending_loader.reset(new llvm::RuntimeDyld(*this, *this));
-
+bool CodeCacheImpl::LoadLibrary(const std::string &path, bool is_runtime) {
   auto maybe_buff_ptr = llvm::MemoryBuffer::getFile(
-      pending_source_file, -1 /* FileSize */,
-      false /* RequiresNullTerminator */);
+      path, -1 /* FileSize */, false /* RequiresNullTerminator */);
 
   if (remill::IsError(maybe_buff_ptr)) {
-    LOG(FATAL)
-        << "Unable to open shared library " << pending_source_file << ": "
+    LOG_IF(FATAL, is_runtime)
+        << "Unable to open runtime library " << path << ": "
+        << remill::GetErrorString(maybe_buff_ptr);
+    LOG(WARNING)
+        << "Unable to open shared library " << path << ": "
         << remill::GetErrorString(maybe_buff_ptr);
+    return false;
   }
 
+  pending_source_file = path;
+  pending_loader.reset(new llvm::RuntimeDyld(*this, *this));
+  pending_object = {path, pending_tier, {}, {}, {}, 0};
+  is_loading_lifted_code = !is_runtime;
+
   auto &buff_ptr = remill::GetReference(maybe_buff_ptr);
+  if (is_runtime) {
+    runtime_hash = Hash(buff_ptr->getBufferStart(), buff_ptr->getBufferSize());
+  }
+
   auto maybe_obj_file_ptr = llvm::object::ObjectFile::createObjectFile(
       *buff_ptr);
 
@@ -533,61 +1247,353 @@ void CodeCacheImpl::LoadLibrary(const std::string &path, bool is_runtime) {
               object_file_ptr->getData().data())),
           *object_file_ptr, *info);)
     }
+
+    if (is_runtime) {
+      AddRuntimeSymbols(*object_file_ptr);
+    }
   }
 
   pending_loader->finalizeWithMemoryManagerLocking();
 
+  // The runtime is never unloaded.
+  if (!is_runtime) {
+    loaded_size += pending_object.size;
+    loaded_objects.push_back(std::move(pending_object));
+    snapshot_is_stale = true;
+  }
+  pending_object = {};
+  is_loading_lifted_code = false;
+
   // TODO(pag): Issue #12: Is the library's `_start` function called?
+  return true;
+}
+
+// Returns the suffix of the object file of a library in the code tier `tier`.
+static const char *LibrarySuffix(CodeTier tier) {
+  switch (tier) {
+    case kCodeTierCold: return ".cold.obj";
+    case kCodeTierHot: return ".hot.obj";
+    default: return ".obj";
+  }
+}
+
+// Returns `true` if `path` ends with `suffix`.
+static bool HasSuffix(const std::string &path, const std::string &suffix) {
+  return path.size() >= suffix.size() &&
+         !path.compare(path.size() - suffix.size(), suffix.size(), suffix);
 }
 
-// Load all JIT-compiled modules from the libraries directory.
+// Returns `true` if `path` is the object file of a library in the code tier
+// `tier`.
+static bool IsLibraryInTier(const std::string &path, CodeTier tier) {
+  return HasSuffix(path, LibrarySuffix(tier));
+}
+
+// Returns `true` if `path`, a file named by `PrivatePath(..., suffix)`, was
+// left behind by a process that has since exited. Private files without a
+// process ID predate private naming.
+static bool IsAbandonedPrivateFile(const std::string &path,
+                                   const std::string &suffix) {
+  const auto end = path.size() - suffix.size();
+  const auto dot = path.rfind('.', end - 1);
+  if (std::string::npos == dot || dot + 1 == end ||
+      end != path.find_first_not_of("0123456789", dot + 1)) {
+    return true;
+  }
+  const auto pid = static_cast<pid_t>(
+      strtol(path.substr(dot + 1, end - dot - 1).c_str(), nullptr, 10));
+  return pid != getpid() && kill(pid, 0) && ESRCH == errno;
+}
+
+// Returns the last component of the path `name`.
+static std::string PathTailName(std::string name) {
+  std::reverse(name.begin(), name.end());
+  auto pos = name.find(remill::PathSeparator()[0]);
+  if (std::string::npos != pos) {
+    name = name.substr(0, pos);
+  }
+  std::reverse(name.begin(), name.end());
+  return name;
+}
+
+static std::string ModuleTailName(const std::unique_ptr<llvm::Module> &module) {
+  return PathTailName(remill::ModuleName(module));
+}
+
+// Returns the path of the library compiled from `module` into the code tier
+// `tier`.
+static std::string LibraryPath(const std::unique_ptr<llvm::Module> &module,
+                               CodeTier tier) {
+  std::stringstream lib_ss;
+  lib_ss << Workspace::LibraryDir() << remill::PathSeparator()
+         << ModuleTailName(module);
+
+  // Cold libraries are deleted as soon as they're loaded, so they're private
+  // to the process that compiled them.
+  if (kCodeTierCold == tier) {
+    return PrivatePath(lib_ss.str(), LibrarySuffix(tier));
+  }
+
+  lib_ss << LibrarySuffix(tier);
+  return lib_ss.str();
+}
+
+// Load all JIT-compiled modules from the libraries directory. Libraries
+// in the library index are only loaded once one of their traces is needed.
 int CodeCacheImpl::LoadLibraries(void) {
+  std::unordered_set<std::string> snapshot_paths;
+  for (const auto &object : loaded_objects) {
+    snapshot_paths.insert(object.path);
+  }
+
+  std::unordered_map<std::string, size_t> lazy_ids;
+  if (FLAGS_lazy_load_libraries) {
+    library_index->ForEach(
+        [&snapshot_paths, &lazy_ids, this] (const LibraryIndexKey &key,
+                                            const LibraryFileName &name) {
+          const auto path = IndexedLibraryPath(name);
+          if (snapshot_paths.count(path) || kCodeTierHot < key.tier) {
+            return;
+          }
+
+          const auto tier = static_cast<CodeTier>(key.tier);
+          auto lazy_it = lazy_ids.find(path);
+          if (lazy_it == lazy_ids.end()) {
+            lazy_it = lazy_ids.emplace(path, lazy_libraries.size()).first;
+            lazy_libraries.push_back({path, tier, false, false});
+          }
+          lazy_traces[tier].emplace(key.trace_id, lazy_it->second);
+        });
+  }
+
   int num_loaded = 0;
   remill::ForEachFileInDirectory(Workspace::LibraryDir(),
-      [&num_loaded, this] (const std::string &path) {
+      [&num_loaded, &snapshot_paths, &lazy_ids, this] (
+          const std::string &path) {
+
+        // Cold code and partially written libraries belong to the process
+        // that compiled them. Once it exits, they're garbage; the warm
+        // version of the same code lives in its own library or bitcode file.
+        for (auto suffix : {LibrarySuffix(kCodeTierCold), ".tmp"}) {
+          if (HasSuffix(path, suffix)) {
+            if (is_snapshot_writer && IsAbandonedPrivateFile(path, suffix)) {
+              remill::RemoveFile(path);
+            }
+            return true;
+          }
+        }
+
+        if (!HasSuffix(path, ".obj")) {
+          return true;
+        }
+
+        // Already loaded out of the snapshot.
+        if (snapshot_paths.count(path)) {
+          return true;
+        }
+
+        num_loaded++;
+        if (auto lazy_it = lazy_ids.find(path); lazy_it != lazy_ids.end()) {
+          lazy_libraries[lazy_it->second].exists = true;
+          return true;
+        }
+
         DLOG(INFO)
             << "Loading cached library " << path;
-        LoadLibrary(path);
-        num_loaded++;
+
+        if (IsLibraryInTier(path, kCodeTierHot)) {
+          pending_tier = kCodeTierHot;
+        }
+        const auto loaded = LoadLibrary(path);
+        pending_tier = kCodeTierWarm;
+
+        // Libraries from before the index existed, or from runs without
+        // lazy loading, can be loaded lazily next time.
+        if (loaded && FLAGS_lazy_load_libraries) {
+          IndexLibrary(loaded_objects.back());
+        }
         return true;
       });
+
+  // Forget about indexed libraries that have since been evicted.
+  for (auto &traces : lazy_traces) {
+    for (auto trace_it = traces.begin(); trace_it != traces.end(); ) {
+      if (lazy_libraries[trace_it->second].exists) {
+        ++trace_it;
+      } else {
+        trace_it = traces.erase(trace_it);
+      }
+    }
+  }
+
+  LOG_IF(INFO, !lazy_libraries.empty())
+      << "Deferred loading " << lazy_libraries.size() << " cached libraries";
   return num_loaded;
 }
 
-// JIT compile any already lifted bitcode.
+void CodeCacheImpl::IndexLibrary(const LoadedObject &object) {
+  const auto sep = object.path.rfind(remill::PathSeparator()[0]);
+  const auto file_name = std::string::npos == sep ?
+                         object.path : object.path.substr(sep + 1);
+
+  // Libraries with unusually long names are loaded eagerly.
+  LibraryFileName name = {};
+  if (file_name.size() >= sizeof(name.file_name)) {
+    return;
+  }
+  memcpy(name.file_name, file_name.data(), file_name.size());
+
+  // Re-lifting a trace replaces its old entry, and entries of libraries that
+  // no longer exist are dropped when the index grows.
+  LibraryIndexKey key = {};
+  key.tier = object.tier;
+  for (const auto &trace_id : object.trace_ids) {
+    key.trace_id = trace_id;
+    library_index->Insert(key, name);
+  }
+}
+
+LiftedFunction *CodeCacheImpl::LoadLazily(TraceId trace_id, CodeTier tier) {
+  const auto &traces = lazy_traces[tier];
+  const auto trace_it = traces.find(trace_id);
+  if (trace_it == traces.end()) {
+    return nullptr;
+  }
+
+  auto &library = lazy_libraries[trace_it->second];
+  if (library.is_loaded) {
+    return nullptr;
+  }
+  library.is_loaded = true;
+
+  DLOG(INFO)
+      << "Lazily loading cached library " << library.path;
+
+  // The library could have been evicted by this or another run.
+  pending_tier = tier;
+  const auto loaded = LoadLibrary(library.path);
+  pending_loader.reset();
+  pending_tier = kCodeTierWarm;
+  if (!loaded) {
+    return nullptr;
+  }
+  RunConstructors();
+
+  return lifted_functions[tier].Find(trace_id);
+}
+
+// JIT compile any already lifted bitcode. Modules are recompiled in
+// parallel, but loaded in order of their names, so that the resulting code
+// cache doesn't depend on which thread finishes first.
 void CodeCacheImpl::ReloadLibraries(void) {
+  std::map<std::string, LiftedBitcodeSource> sources;
+
+  // Bitcode saved as individual files by older versions of the executor.
   remill::ForEachFileInDirectory(Workspace::BitcodeDir(),
-      [this] (const std::string &path) {
-        std::unique_ptr<llvm::Module> module(
-            remill::LoadModuleFromFile(context.get(), path, true));
-
-        if (module) {
-          LOG(INFO)
-              << "JIT compiling already lifted code from " << path;
-          AddModuleToCache(module);
-        } else {
-          LOG(ERROR)
-              << "Could not load already lifted bitcode module from " << path;
-          remill::RemoveFile(path);
-        }
+      [&sources] (const std::string &path) {
+        auto &source = sources[PathTailName(path)];
+        source.path = path;
         return true;
       });
+
+  // Later modules in the archive replace earlier ones of the same name.
+  auto archive = BitcodeArchive::Open(Workspace::BitcodeArchivePath());
+  archive->ForEachModule(
+      [&sources] (const std::string &name, const char *data, size_t size) {
+        auto &source = sources[PathTailName(name)];
+        source.path.clear();
+        source.name = name;
+        source.data = data;
+        source.size = size;
+      });
+
+  if (sources.empty()) {
+    return;
+  }
+
+  size_t num_threads = FLAGS_num_recompile_threads;
+  if (!num_threads) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min(num_threads, sources.size());
+
+  LOG(INFO)
+      << "JIT compiling " << sources.size()
+      << " already lifted bitcode modules using " << num_threads
+      << " threads";
+
+  ThreadPool pool(num_threads);
+  std::vector<std::future<std::string>> lib_paths;
+  lib_paths.reserve(sources.size());
+  for (const auto &entry : sources) {
+    const auto *source = &(entry.second);
+    lib_paths.push_back(pool.Submit([this, source] (void) {
+      return RecompileBitcode(*source);
+    }));
+  }
+
+  auto lib_path_it = lib_paths.begin();
+  for (const auto &entry : sources) {
+    const auto &source = entry.second;
+    const auto lib_path = (lib_path_it++)->get();
+    if (!lib_path.empty()) {
+      LoadCompiledModule(lib_path, kCodeTierWarm);
+
+    } else if (!source.path.empty()) {
+      LOG(ERROR)
+          << "Could not load already lifted bitcode module from "
+          << source.path;
+      if (is_snapshot_writer) {
+        remill::RemoveFile(source.path);
+      }
+
+    } else {
+      LOG(ERROR)
+          << "Could not load already lifted bitcode module " << source.name
+          << " from the bitcode archive";
+    }
+  }
 }
 
-static std::string ModuleTailName(const std::unique_ptr<llvm::Module> &module) {
-  auto name = remill::ModuleName(module);
-  std::reverse(name.begin(), name.end());
-  auto pos = name.find(remill::PathSeparator()[0]);
-  if (std::string::npos != pos) {
-    name = name.substr(0, pos);
+std::string CodeCacheImpl::RecompileBitcode(
+    const LiftedBitcodeSource &source) {
+  auto &thread_context = ThreadContext();
+
+  std::unique_ptr<llvm::Module> module;
+  if (!source.path.empty()) {
+    module.reset(remill::LoadModuleFromFile(
+        &thread_context, source.path, true));
+
+  } else {
+    auto buff = llvm::MemoryBuffer::getMemBuffer(
+        llvm::StringRef(source.data, source.size), source.name,
+        false /* RequiresNullTerminator */);
+    auto maybe_module = llvm::parseBitcodeFile(
+        buff->getMemBufferRef(), thread_context);
+    if (remill::IsError(maybe_module)) {
+      LOG(ERROR)
+          << "Unable to parse lifted bitcode of module " << source.name
+          << ": " << remill::GetErrorString(maybe_module);
+    } else {
+      module = std::move(remill::GetReference(maybe_module));
+    }
   }
-  std::reverse(name.begin(), name.end());
-  return name;
+
+  if (!module) {
+    return "";
+  }
+
+  DLOG(INFO)
+      << "JIT compiling already lifted code of module "
+      << remill::ModuleName(module);
+
+  return CompileModule(module, kCodeTierWarm);
 }
 
+
 // Reoptimize the module `module` after it has been instrumented by a tool.
 void CodeCacheImpl::ReoptimizeModule(
-    const std::unique_ptr<llvm::Module> &module) {
+    const std::unique_ptr<llvm::Module> &module, unsigned opt_level) {
   llvm::Module::iterator func_it;
   llvm::Module::iterator func_it_end;
 
@@ -605,7 +1611,7 @@ void CodeCacheImpl::ReoptimizeModule(
     }
   };
 
-  OptimizeModule(module.get(), func_generator);
+  OptimizeModule(module.get(), func_generator, opt_level);
 //  auto undef_taint = llvm::UndefValue::get(llvm::Type::getInt1Ty(module->getContext()));
 //  for (auto user : undef_taint->users()) {
 //    if (auto inst = llvm::dyn_cast<llvm::Instruction>(user)) {
@@ -615,11 +1621,11 @@ void CodeCacheImpl::ReoptimizeModule(
 //  }
 }
 
-// Tell the tool to instrument each lifted function.
+// Tell the tool to instrument each lifted function. Hot code is always
+// optimized across traces; other code only gets a cheap cleanup, and only
+// if the tool changed it.
 void CodeCacheImpl::InstrumentTraces(
-    const std::unique_ptr<llvm::Module> &module) {
-
-  tool->PrepareModule(module.get());
+    const std::unique_ptr<llvm::Module> &module, CodeTier tier) {
 
   std::vector<llvm::Function *> funcs;
   funcs.reserve(module->getFunctionList().size());
@@ -630,8 +1636,11 @@ void CodeCacheImpl::InstrumentTraces(
     }
   }
 
+  std::unique_lock<std::mutex> locker(tool_lock);
+  tool->PrepareModule(module.get());
+
   auto changed = false;
-  auto md_id = context->getMDKindID("PC");
+  auto md_id = module->getContext().getMDKindID("PC");
   for (auto func : funcs) {
     auto node = func->getMetadata(md_id);
     if (!node) {
@@ -647,38 +1656,612 @@ void CodeCacheImpl::InstrumentTraces(
       changed = tool->InstrumentTrace(func, pc) || changed;
     }
   }
+  locker.unlock();
 
-  if (changed) {
-    ReoptimizeModule(module);
+  if (kCodeTierHot == tier) {
+    ReoptimizeModule(module, 3);
+  } else if (changed) {
+    ReoptimizeModule(module, 1);
   }
 }
 
-// Load a JIT-compiled library.
+// Compile and load a JIT-compiled library.
 void CodeCacheImpl::AddModuleToCache(
-    const std::unique_ptr<llvm::Module> &module) {
-
-  InstrumentTraces(module);
+    const std::unique_ptr<llvm::Module> &module, CodeTier tier) {
+  LoadCompiledModule(CompileModule(module, tier), tier);
+}
 
-  std::stringstream lib_ss;
-  lib_ss << Workspace::LibraryDir() << remill::PathSeparator()
-         << ModuleTailName(module) << ".obj";
+// Instrument and compile `module` into an object file in the libraries
+// directory.
+std::string CodeCacheImpl::CompileModule(
+    const std::unique_ptr<llvm::Module> &module, CodeTier tier) {
+
+  InstrumentTraces(module, tier);
+
+  // Modules in a thread's own context are compiled by that thread's own
+  // compilers, as compilers can't be shared between threads.
+  auto thread_compiler = (tCompiler && &(module->getContext()) ==
+                                           tCompiler->context.get())
+                         ? &*tCompiler : nullptr;
+
+  const auto lib_path = LibraryPath(module, tier);
+  switch (tier) {
+    case kCodeTierCold:
+      CompileModuleToPath(
+          thread_compiler ? thread_compiler->cold_compiler : cold_compiler,
+          *module, lib_path);
+      break;
+    case kCodeTierHot:
+      CompileModuleToPath(
+          thread_compiler ? thread_compiler->compiler : compiler,
+          *module, lib_path);
+      break;
+    default:
+      CompileModuleToPath(
+          thread_compiler ? thread_compiler->warm_compiler : warm_compiler,
+          *module, lib_path);
+      break;
+  }
 
-  auto lib_path = lib_ss.str();
-  compiler.CompileModuleToFile(*module, lib_path);
+  return lib_path;
+}
 
-  LoadLibrary(lib_path);
+// Load a JIT-compiled library. Cold libraries are not kept around for
+// future runs.
+void CodeCacheImpl::LoadCompiledModule(const std::string &path,
+                                       CodeTier tier) {
+  pending_tier = tier;
+  CHECK(LoadLibrary(path))
+      << "Unable to load compiled library " << path;
   pending_loader.reset();
-}
+  pending_tier = kCodeTierWarm;
 
-LiftedFunction *CodeCacheImpl::Lookup(TraceId trace_id) const {
-  auto entry_it = lifted_functions.find(trace_id);
-  if (likely(entry_it != lifted_functions.end())) {
-    return entry_it->second;
+  if (kCodeTierCold == tier) {
+    remill::RemoveFile(path);
   } else {
-    return nullptr;
+    IndexLibrary(loaded_objects.back());
   }
 }
 
+bool CodeCacheImpl::IsCached(TraceId trace_id) const {
+  for (auto tier = 0U; tier < kNumCodeTiers; ++tier) {
+    if (lifted_functions[tier].Find(trace_id)) {
+      return true;
+    }
+    const auto trace_it = lazy_traces[tier].find(trace_id);
+    if (trace_it != lazy_traces[tier].end() &&
+        !lazy_libraries[trace_it->second].is_loaded) {
+      return true;
+    }
+  }
+  return false;
+}
+
+LiftedFunction *CodeCacheImpl::Lookup(TraceId trace_id) {
+  for (auto tier = static_cast<unsigned>(kNumCodeTiers); tier-- > 0; ) {
+    if (auto lifted_func = lifted_functions[tier].Find(trace_id)) {
+      return lifted_func;
+    }
+    if (auto lifted_func = LoadLazily(trace_id, static_cast<CodeTier>(tier))) {
+      return lifted_func;
+    }
+  }
+  return nullptr;
+}
+
+bool CodeCacheImpl::IsLoaded(LiftedFunction *lifted_func) const {
+  const auto addr = reinterpret_cast<uint8_t *>(lifted_func);
+  auto range_it = jit_ranges.upper_bound(addr);
+  if (range_it == jit_ranges.begin()) {
+    return false;
+  }
+  const auto &range = (--range_it)->second;
+  return range.can_exec && addr < &(range.base[range.size]);
+}
+
+void CodeCacheImpl::UnloadObject(const LoadedObject &object) {
+  auto &functions = lifted_functions[object.tier];
+  for (const auto &trace_id : object.trace_ids) {
+    functions.Erase(trace_id);
+  }
+
+  if (__deregister_frame) {
+    for (auto eh_frame : object.eh_frames) {
+      __deregister_frame(eh_frame);
+    }
+  }
+
+  for (const auto &range : object.ranges) {
+    jit_ranges.erase(range.base);
+    if (range.can_exec && hot_code_allocator.Contains(range.base)) {
+      hot_code_allocator.Free(range.base, range.size);
+    } else if (range.can_exec) {
+      code_allocator.Free(range.base, range.size);
+    } else if (range.is_index) {
+      index_allocator.Free(range.base, range.size);
+    } else if (range.is_ctors) {
+      ctor_allocator.Free(range.base, range.size);
+    } else {
+      data_allocator.Free(range.base, range.size);
+    }
+  }
+
+  // The traces will be re-lifted if they are needed again, and so there is
+  // no point in loading this object in a future run. Other processes sharing
+  // the workspace might still be using it, though, so only the snapshot
+  // writer deletes libraries.
+  if (is_snapshot_writer) {
+    remill::RemoveFile(object.path);
+  }
+
+  loaded_size -= object.size;
+  snapshot_is_stale = true;
+  LOG(INFO)
+      << "Evicted " << object.trace_ids.size() << " traces and " << object.size
+      << " bytes of lifted code from " << object.path;
+}
+
+// Evict objects down to three quarters of the budget, so that the next few
+// loads don't immediately trigger another eviction.
+void CodeCacheImpl::EvictCode(
+    const std::function<bool(LiftedFunction *)> &is_live,
+    const std::function<bool(uintptr_t, uintptr_t)> &is_pinned) {
+  const auto target_size = FLAGS_max_code_cache_size -
+                           (FLAGS_max_code_cache_size / 4);
+
+  EvictObjects(is_live, is_pinned,
+               [] (const LoadedObject &) { return true; },
+               target_size, false);
+
+  LOG_IF(WARNING, loaded_size > FLAGS_max_code_cache_size)
+      << "Code cache uses " << loaded_size << " bytes, which is over its "
+      << FLAGS_max_code_cache_size << "-byte budget, even after eviction";
+}
+
+void CodeCacheImpl::EvictColdCode(
+    const std::function<bool(LiftedFunction *)> &is_live,
+    const std::function<bool(uintptr_t, uintptr_t)> &is_pinned) {
+  EvictObjects(is_live, is_pinned,
+               [] (const LoadedObject &object) {
+                 return kCodeTierCold == object.tier;
+               },
+               0, true);
+}
+
+void CodeCacheImpl::EvictObjects(
+    const std::function<bool(LiftedFunction *)> &is_live,
+    const std::function<bool(uintptr_t, uintptr_t)> &is_pinned,
+    const std::function<bool(const LoadedObject &)> &can_evict_object,
+    size_t target_size, bool only_dead) {
+
+  auto can_evict = [&] (const LoadedObject &object) {
+    if (!can_evict_object(object)) {
+      return false;
+    }
+    for (const auto &range : object.ranges) {
+      const auto begin = reinterpret_cast<uintptr_t>(range.base);
+      if (range.can_exec && is_pinned(begin, begin + range.size)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  auto has_live_traces = [&] (const LoadedObject &object) {
+    const auto &functions = lifted_functions[object.tier];
+    for (const auto &trace_id : object.trace_ids) {
+      if (is_live(functions.Find(trace_id))) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  // First get rid of objects whose traces have all been replaced by hotter
+  // code or invalidated, then fall back on evicting the oldest objects.
+  for (auto dead_pass : {true, false}) {
+    if (!dead_pass && only_dead) {
+      break;
+    }
+    auto object_it = loaded_objects.begin();
+    while (loaded_size > target_size && object_it != loaded_objects.end()) {
+      if ((dead_pass && has_live_traces(*object_it)) ||
+          !can_evict(*object_it)) {
+        ++object_it;
+      } else {
+        UnloadObject(*object_it);
+        object_it = loaded_objects.erase(object_it);
+      }
+    }
+  }
+}
+
+SnapshotHeader CodeCacheImpl::ExpectedSnapshotHeader(void) const {
+  SnapshotHeader header = {};
+  header.magic = kSnapshotMagic;
+  header.format_version = kSnapshotFormatVersion;
+  header.runtime_hash = runtime_hash;
+  header.tool_hash = Hash(FLAGS_tool);
+  header.llvm_version = LLVM_VERSION_NUMBER;
+  header.cpu_hash = Hash(HostCPUDescription());
+  return header;
+}
+
+bool CodeCacheImpl::LoadSnapshot(void) {
+  const auto &path = Workspace::CodeCachePath();
+  if (!remill::FileExists(path)) {
+    return false;
+  }
+
+  // Everything is read and mapped through the same file descriptor, in case
+  // the writer replaces the snapshot in the meantime.
+  auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (-1 == fd) {
+    LOG(ERROR)
+        << "Unable to open code cache snapshot " << path << ": "
+        << strerror(errno);
+    return false;
+  }
+
+  const auto loaded = LoadSnapshotFile(path, fd);
+  close(fd);
+  return loaded;
+}
+
+bool CodeCacheImpl::LoadSnapshotFile(const std::string &path, int fd) {
+  struct stat info = {};
+  if (fstat(fd, &info)) {
+    LOG(ERROR)
+        << "Unable to stat code cache snapshot " << path << ": "
+        << strerror(errno);
+    return false;
+  }
+
+  auto maybe_buff_ptr = llvm::MemoryBuffer::getOpenFile(
+      fd, path, static_cast<uint64_t>(info.st_size),
+      false /* RequiresNullTerminator */);
+  if (remill::IsError(maybe_buff_ptr)) {
+    LOG(ERROR)
+        << "Unable to open code cache snapshot " << path << ": "
+        << remill::GetErrorString(maybe_buff_ptr);
+    return false;
+  }
+
+  auto &buff_ptr = remill::GetReference(maybe_buff_ptr);
+  const auto begin = reinterpret_cast<const uint8_t *>(
+      buff_ptr->getBufferStart());
+  const auto end = begin + buff_ptr->getBufferSize();
+
+  auto discard = [this, &path] (const char *reason) {
+    LOG(INFO)
+        << "Discarding code cache snapshot " << path << ": " << reason;
+    if (is_snapshot_writer) {
+      remill::RemoveFile(path);
+    }
+    return false;
+  };
+
+  SnapshotHeader header = {};
+  SnapshotReader header_reader(begin, end);
+  if (!header_reader.Read(header)) {
+    return discard("it is truncated");
+  }
+
+  const auto expected = ExpectedSnapshotHeader();
+  if (header.magic != expected.magic ||
+      header.format_version != expected.format_version) {
+    return discard("it is not a code cache snapshot");
+
+  } else if (header.runtime_hash != expected.runtime_hash ||
+             header.tool_hash != expected.tool_hash) {
+    return discard("the runtime or tool has changed");
+
+  } else if (header.llvm_version != expected.llvm_version ||
+             header.cpu_hash != expected.cpu_hash) {
+    return discard("the compiler or CPU has changed");
+  }
+
+  const auto payload = header_reader.Skip(header.payload_size);
+  if (!payload || header_reader.Skip(1) ||
+      Hash(payload, header.payload_size) != header.payload_hash) {
+    return discard("its checksum does not match");
+  }
+
+  // Parse and validate the whole snapshot before changing anything.
+  SnapshotReader reader(payload, payload + header.payload_size);
+  SnapshotArea areas[kNumSnapshotAreas];
+  for (auto i = 0U; i < kNumSnapshotAreas; ++i) {
+    auto &area = areas[i];
+    uint64_t begin_addr = 0;
+    uint64_t num_free_ranges = 0;
+    reader.Read(begin_addr);
+    reader.Read(area.size);
+    area.begin = reinterpret_cast<uint8_t *>(begin_addr);
+    reader.AlignTo(kSnapshotAreaAlignment, begin);
+    area.bytes = reader.Skip(area.size);
+    area.file_offset = static_cast<uint64_t>(area.bytes - begin);
+    reader.Read(num_free_ranges);
+    for (uint64_t j = 0; j < num_free_ranges && reader.Ok(); ++j) {
+      uint64_t addr = 0;
+      uint64_t size = 0;
+      reader.Read(addr);
+      reader.Read(size);
+      area.free_ranges.emplace_back(reinterpret_cast<uint8_t *>(addr), size);
+    }
+
+    // The runtime has to have been allocated exactly as it was in the run
+    // that saved the snapshot.
+    if (area.begin != runtime_ends[i]) {
+      return discard("the runtime was loaded at a different address");
+    }
+  }
+
+  std::list<LoadedObject> objects;
+  uint64_t num_objects = 0;
+  reader.Read(num_objects);
+  for (uint64_t i = 0; i < num_objects && reader.Ok(); ++i) {
+    LoadedObject object = {};
+    uint32_t tier = 0;
+    uint64_t num_ranges = 0;
+    uint64_t num_eh_frames = 0;
+    reader.ReadString(object.path);
+    reader.Read(tier);
+    object.tier = static_cast<CodeTier>(std::min<uint32_t>(
+        tier, kCodeTierHot));
+
+    reader.Read(num_ranges);
+    for (uint64_t j = 0; j < num_ranges && reader.Ok(); ++j) {
+      SnapshotRange range = {};
+      reader.Read(range);
+      MemoryMap map = {reinterpret_cast<uint8_t *>(range.base), range.size,
+                       range.section_id, !!range.can_read, !!range.can_write,
+                       !!range.can_exec, !!range.is_index, false, object.path};
+      object.ranges.push_back(map);
+      object.size += map.size;
+    }
+
+    reader.Read(num_eh_frames);
+    for (uint64_t j = 0; j < num_eh_frames && reader.Ok(); ++j) {
+      uint64_t addr = 0;
+      reader.Read(addr);
+      object.eh_frames.push_back(reinterpret_cast<uint8_t *>(addr));
+    }
+    objects.push_back(std::move(object));
+  }
+
+  std::map<std::string, uint64_t> symbols;
+  uint64_t num_symbols = 0;
+  reader.Read(num_symbols);
+  for (uint64_t i = 0; i < num_symbols && reader.Ok(); ++i) {
+    std::string name;
+    uint64_t addr = 0;
+    reader.ReadString(name);
+    reader.Read(addr);
+    symbols[name] = addr;
+  }
+
+  // Link stubs, and the addresses of the functions that they jump to in
+  // this run.
+  std::map<std::string, uint8_t *> stubs;
+  std::vector<std::pair<uint8_t *, uint64_t>> stub_targets;
+  uint64_t num_stubs = 0;
+  reader.Read(num_stubs);
+  for (uint64_t i = 0; i < num_stubs && reader.Ok(); ++i) {
+    std::string name;
+    uint64_t addr = 0;
+    reader.ReadString(name);
+    reader.Read(addr);
+    stubs[name] = reinterpret_cast<uint8_t *>(addr);
+  }
+
+  if (!reader.Ok()) {
+    return discard("it is malformed");
+  }
+
+  for (const auto &symbol : symbols) {
+    auto sym = findSymbol(symbol.first);
+    auto maybe_addr = sym.getAddress();
+    if (remill::IsError(maybe_addr) ||
+        symbol.second != (maybe_addr IF_LLVM_GTE_500(.get()))) {
+      return discard("a linked symbol has moved");
+    }
+  }
+
+  const auto &code_area = areas[0];
+  for (const auto &stub : stubs) {
+    if (stub.second < code_area.begin ||
+        (stub.second + kLinkStubSize) > (code_area.begin + code_area.size)) {
+      return discard("it is malformed");
+    }
+    auto sym = findSymbol(stub.first);
+    auto maybe_addr = sym.getAddress();
+    if (remill::IsError(maybe_addr) ||
+        !(maybe_addr IF_LLVM_GTE_500(.get()))) {
+      return discard("a linked function is missing");
+    }
+    stub_targets.emplace_back(stub.second,
+                              maybe_addr IF_LLVM_GTE_500(.get()));
+  }
+
+  // Copy the lifted code and data into place. They already have all of
+  // their relocations applied. When sharing, the whole pages of code and of
+  // the index are instead mapped from the snapshot file; data is always
+  // copied, as lifted code writes to it.
+  uint64_t num_mapped_bytes = 0;
+  for (auto i = 0U; i < kNumSnapshotAreas; ++i) {
+    const auto &area = areas[i];
+    if (!area.size) {
+      continue;
+    }
+    auto allocator = snapshot_areas[i];
+    CHECK(allocator->Allocate(area.size, 0) == area.begin)
+        << "Unable to reserve memory for code cache snapshot " << path;
+
+    uint64_t mapped_size = 0;
+    if (FLAGS_share_code_cache && allocator != &data_allocator) {
+      mapped_size = area.size & ~(kSnapshotAreaAlignment - 1);
+      if (mapped_size && !allocator->MapFile(area.begin, mapped_size, fd,
+                                             area.file_offset)) {
+        mapped_size = 0;
+      }
+    }
+
+    memcpy(area.begin + mapped_size, area.bytes + mapped_size,
+           area.size - mapped_size);
+    num_mapped_bytes += mapped_size;
+    for (const auto &free_range : area.free_ranges) {
+      allocator->Free(free_range.first, free_range.second);
+    }
+  }
+
+  // Point the link stubs at where their functions are in this run. When
+  // sharing, this makes private copies of only the pages holding stubs.
+  for (const auto &stub_target : stub_targets) {
+    WriteLinkStub(stub_target.first, stub_target.second);
+  }
+
+  // Rebuild the trace index, exception handling frames, and eviction state
+  // of each object.
+  for (auto &object : objects) {
+    pending_object = std::move(object);
+    pending_tier = pending_object.tier;
+    for (const auto &range : pending_object.ranges) {
+      jit_ranges[range.base] = range;
+      if (range.is_index) {
+        LoadIndex(range, nullptr);
+      }
+    }
+
+    if (__register_frame) {
+      for (auto eh_frame : pending_object.eh_frames) {
+        __register_frame(eh_frame);
+      }
+    }
+
+    loaded_size += pending_object.size;
+    loaded_objects.push_back(std::move(pending_object));
+  }
+  pending_object = {};
+  pending_tier = kCodeTierWarm;
+
+  linked_symbols.swap(symbols);
+  link_stubs.swap(stubs);
+  snapshot_is_stale = false;
+
+  LOG(INFO)
+      << "Loaded " << loaded_objects.size() << " objects and " << loaded_size
+      << " bytes of lifted code from code cache snapshot " << path
+      << ", of which " << num_mapped_bytes << " bytes are shared";
+  return true;
+}
+
+void CodeCacheImpl::SaveSnapshot(void) {
+  if (!snapshot_is_stale || !is_snapshot_writer) {
+    return;
+  }
+
+  const auto &path = Workspace::CodeCachePath();
+
+  // Constructors are allocated at unpredictable addresses, and would have to
+  // be re-run.
+  for (const auto &object : loaded_objects) {
+    for (const auto &range : object.ranges) {
+      if (range.is_ctors) {
+        LOG(WARNING)
+            << "Not saving code cache snapshot " << path << " because "
+            << object.path << " has constructors";
+        remill::RemoveFile(path);
+        return;
+      }
+    }
+  }
+
+  SnapshotWriter writer;
+  for (auto i = 0U; i < kNumSnapshotAreas; ++i) {
+    const auto begin = runtime_ends[i];
+    const auto size = static_cast<uint64_t>(snapshot_areas[i]->End() - begin);
+    writer.Write(reinterpret_cast<uint64_t>(begin));
+    writer.Write(size);
+    writer.AlignTo(kSnapshotAreaAlignment, sizeof(SnapshotHeader));
+    writer.WriteBytes(begin, size);
+
+    std::vector<std::pair<uint8_t *, size_t>> free_ranges;
+    snapshot_areas[i]->ForEachFreeRange(
+        [&free_ranges] (uint8_t *addr, size_t free_size) {
+          free_ranges.emplace_back(addr, free_size);
+        });
+
+    writer.Write<uint64_t>(free_ranges.size());
+    for (const auto &free_range : free_ranges) {
+      writer.Write(reinterpret_cast<uint64_t>(free_range.first));
+      writer.Write<uint64_t>(free_range.second);
+    }
+  }
+
+  writer.Write<uint64_t>(loaded_objects.size());
+  for (const auto &object : loaded_objects) {
+    writer.WriteString(object.path);
+    writer.Write<uint32_t>(object.tier);
+    writer.Write<uint64_t>(object.ranges.size());
+    for (const auto &range : object.ranges) {
+      SnapshotRange saved_range = {
+          reinterpret_cast<uint64_t>(range.base), range.size,
+          range.section_id, range.can_read, range.can_write, range.can_exec,
+          range.is_index};
+      writer.Write(saved_range);
+    }
+    writer.Write<uint64_t>(object.eh_frames.size());
+    for (auto eh_frame : object.eh_frames) {
+      writer.Write(reinterpret_cast<uint64_t>(eh_frame));
+    }
+  }
+
+  writer.Write<uint64_t>(linked_symbols.size());
+  for (const auto &symbol : linked_symbols) {
+    writer.WriteString(symbol.first);
+    writer.Write(symbol.second);
+  }
+
+  writer.Write<uint64_t>(link_stubs.size());
+  for (const auto &stub : link_stubs) {
+    writer.WriteString(stub.first);
+    writer.Write(reinterpret_cast<uint64_t>(stub.second));
+  }
+
+  auto header = ExpectedSnapshotHeader();
+  header.payload_size = writer.payload.size();
+  header.payload_hash = Hash(writer.payload);
+
+  // Write to a temporary file and then rename it, so that a concurrent or
+  // crashed run never leaves behind a partial snapshot.
+  const auto temp_path = path + ".tmp";
+  auto fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0666);
+  if (-1 == fd) {
+    LOG(ERROR)
+        << "Unable to create code cache snapshot " << temp_path << ": "
+        << strerror(errno);
+    return;
+  }
+
+  auto written = WriteAll(fd, &header, sizeof(header)) &&
+                 WriteAll(fd, writer.payload.data(), writer.payload.size());
+  close(fd);
+
+  if (!written || rename(temp_path.c_str(), path.c_str())) {
+    LOG(ERROR)
+        << "Unable to save code cache snapshot " << path << ": "
+        << strerror(errno);
+    remill::RemoveFile(temp_path);
+    return;
+  }
+
+  snapshot_is_stale = false;
+  LOG(INFO)
+      << "Saved " << loaded_objects.size() << " objects and " << loaded_size
+      << " bytes of lifted code to code cache snapshot " << path;
+}
+
 uintptr_t CodeCacheImpl::Lookup(const char *symbol) {
   std::string name(symbol);
   llvm::JITSymbol sym = findSymbolInLogicalDylib(name);
@@ -17,7 +17,10 @@
 #ifndef VMILL_EXECUTOR_CODECACHE_H_
 #define VMILL_EXECUTOR_CODECACHE_H_
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <string>
 #include <unordered_map>
 
 #include "vmill/BC/Trace.h"
@@ -44,21 +47,79 @@ class CodeCache {
       std::unique_ptr<Tool> tool_,
       const std::shared_ptr<llvm::LLVMContext> &context_);
 
+  // Compile `module` and load it into the code cache.
   virtual void AddModuleToCache(
-      const std::unique_ptr<llvm::Module> &module) = 0;
-
-  virtual LiftedFunction *Lookup(TraceId trace_id) const = 0;
+      const std::unique_ptr<llvm::Module> &module,
+      CodeTier tier=kCodeTierWarm) = 0;
+
+  // Instrument and compile `module` into an object file, and return the path
+  // of that file. This does not modify the code cache, and so it can be used
+  // from a thread other than the one executing lifted code, so long as the
+  // caller serializes all uses of the module's LLVM context. If `module` is
+  // in the calling thread's own context (see `ThreadContext`), then it is
+  // also compiled by the calling thread's own compilers, and so several
+  // threads can compile modules at once.
+  virtual std::string CompileModule(
+      const std::unique_ptr<llvm::Module> &module, CodeTier tier) = 0;
+
+  // Returns an LLVM context that is private to the calling thread.
+  virtual llvm::LLVMContext &ThreadContext(void) = 0;
+
+  // Load an object file produced by `CompileModule` into the code cache.
+  virtual void LoadCompiledModule(const std::string &path, CodeTier tier) = 0;
+
+  // Returns the hottest lifted code implementing `trace_id`. This may load
+  // a cached library that contains the trace.
+  virtual LiftedFunction *Lookup(TraceId trace_id) = 0;
+
+  // Returns `true` if code implementing `trace_id` is loaded, or can be
+  // loaded from a cached library. This never loads anything.
+  virtual bool IsCached(TraceId trace_id) const = 0;
+
+  // Returns `true` if this process may delete or compact what other
+  // processes sharing the workspace have cached. With `--share_code_cache`,
+  // only the writer of the code cache snapshot does.
+  virtual bool OwnsWorkspace(void) const = 0;
 
   virtual uintptr_t Lookup(const char *symbol) = 0;
 
+  // Returns `true` if the loaded lifted code uses more memory than the
+  // budget given by `--max_code_cache_size`.
+  virtual bool IsOverBudget(void) const = 0;
+
+  // Returns `true` if `addr` is inside of memory used for lifted code.
+  virtual bool ContainsCode(uintptr_t addr) const = 0;
+
+  // Returns `true` if `lifted_func` is still loaded.
+  virtual bool IsLoaded(LiftedFunction *lifted_func) const = 0;
+
+  // Unload object files until the code cache is back under its budget.
+  // Objects none of whose functions satisfy `is_live` are unloaded first,
+  // then the oldest objects. An object is never unloaded if `is_pinned`
+  // returns `true` for one of its code ranges `[begin, end)`. The caller must
+  // make sure that nothing else refers to the unloaded code.
+  virtual void EvictCode(
+      const std::function<bool(LiftedFunction *)> &is_live,
+      const std::function<bool(uintptr_t, uintptr_t)> &is_pinned) = 0;
+
+  // Unload the cold object files none of whose functions satisfy `is_live`,
+  // e.g. because their traces have all been replaced by warm code. This is
+  // done regardless of the budget, and with the same rules as `EvictCode`.
+  virtual void EvictColdCode(
+      const std::function<bool(LiftedFunction *)> &is_live,
+      const std::function<bool(uintptr_t, uintptr_t)> &is_pinned) = 0;
+
   // Called to run constructors in the runtime.
   virtual void RunConstructors(void) = 0;
 
   // Called just before the beginning of a run.
   virtual void SetUp(void) = 0;
 
-  // Called just after the end of a run.
-  virtual void TearDown(void) = 0;
+  // Called just after the end of a run. The loaded lifted code is saved into
+  // the code cache snapshot if `save_snapshot` is `true`. A snapshot is only
+  // usable by the program that saved it, because lifted code is linked
+  // against that program's symbols.
+  virtual void TearDown(bool save_snapshot) = 0;
 
  protected:
   CodeCache(void);
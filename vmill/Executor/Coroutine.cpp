@@ -18,6 +18,7 @@
 #include <glog/logging.h>
 
 #include <cfenv>
+#include <unordered_set>
 
 #include "vmill/Executor/Coroutine.h"
 #include "vmill/Runtime/Task.h"
@@ -41,6 +42,17 @@ extern void __vmill_yield_async(void *);
 
 }  // extern "C"
 
+namespace {
+
+// All coroutines that have been allocated and not yet freed.
+static std::unordered_set<Coroutine *> gCoroutines;
+
+// `__vmill_yield_async` and `__vmill_execute_async` keep the saved stack
+// pointer of a paused coroutine this many bytes below the end of its stack.
+static constexpr uintptr_t kSavedStackPointerOffset = 128;
+
+}  // namespace
+
 ZoneAllocator Coroutine::gAllocator(kAreaRW, kAreaCoroutineStacks);
 
 Coroutine::Coroutine(void)
@@ -51,6 +63,25 @@ Coroutine::Coroutine(void)
 
   // TODO(pag): Add redzone to the coroutine stack.
   stack_end = stack.base + FLAGS_coroutine_stack_size;
+  gCoroutines.insert(this);
+}
+
+Coroutine::~Coroutine(void) {
+  gCoroutines.erase(this);
+  gAllocator.Free(stack);
+}
+
+void Coroutine::ForEachPausedStack(
+    const std::function<void(const uint64_t *, const uint64_t *)> &cb) {
+  for (auto coro : gCoroutines) {
+    if (!coro->ExecutingNow()) {
+      continue;
+    }
+
+    const auto saved_sp_ptr = reinterpret_cast<const uint64_t * const *>(
+        coro->stack_end - kSavedStackPointerOffset);
+    cb(*saved_sp_ptr, reinterpret_cast<const uint64_t *>(saved_sp_ptr));
+  }
 }
 
 void Coroutine::Pause(Task *task) {
@@ -15,6 +15,7 @@
  */
 
 #include <cstdint>
+#include <functional>
 
 #ifndef VMILL_EXECUTOR_COROUTINE_H_
 #define VMILL_EXECUTOR_COROUTINE_H_
@@ -35,6 +36,7 @@ struct Task;
 class alignas(16) Coroutine {
  public:
   Coroutine(void);
+  ~Coroutine(void);
 
   void Pause(Task *task);
   void Resume(Task *task);
@@ -43,6 +45,13 @@ class alignas(16) Coroutine {
     return 0 < on_stack;
   }
 
+  // Invoke `cb(begin, end)` on the in-use portion of the stack of every
+  // coroutine that is paused partway through executing code. This must not
+  // be called from inside of a coroutine, as the running coroutine's stack
+  // can't be described.
+  static void ForEachPausedStack(
+      const std::function<void(const uint64_t *, const uint64_t *)> &cb);
+
  private:
   Coroutine(const Coroutine &) = delete;
   Coroutine(const Coroutine &&) = delete;
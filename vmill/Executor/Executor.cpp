@@ -17,13 +17,29 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cfenv>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <optional>
 #include <setjmp.h>
+#include <sstream>
+#include <string>
+#include <vector>
 
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
 
 #include "remill/Arch/Name.h"
+#include "remill/BC/Compat/Error.h"
 #include "remill/BC/Util.h"
 #include "remill/OS/FileSystem.h"
 #include "remill/OS/OS.h"
@@ -38,7 +54,9 @@
 #include "vmill/Executor/Executor.h"
 #include "vmill/Executor/Memory.h"
 #include "vmill/Program/AddressSpace.h"
+#include "vmill/Program/EntryPoints.h"
 #include "vmill/Util/Compiler.h"
+#include "vmill/Workspace/BitcodeArchive.h"
 #include "vmill/Workspace/Tool.h"
 #include "vmill/Workspace/Workspace.h"
 
@@ -46,10 +64,55 @@ DECLARE_uint64(num_io_threads);
 DECLARE_string(tool);
 DECLARE_string(os);
 DECLARE_string(arch);
+DECLARE_bool(version_code);
 
 DEFINE_uint64(num_lift_threads, 1,
               "Number of threads that can be used for lifting.");
 
+DEFINE_uint64(num_compile_threads, 1,
+              "Number of threads that can be used for compiling lifted code. "
+              "With more than one, each compiling thread uses its own LLVM "
+              "context.");
+
+DEFINE_uint64(max_queued_lifts, 64,
+              "Maximum number of batches of traces that can be waiting to be "
+              "lifted, or being lifted, at once.");
+
+DEFINE_uint64(max_queued_compiles, 4,
+              "Maximum number of lifted modules that can be waiting to be "
+              "compiled, or being compiled, at once. When this is reached, "
+              "the lifters wait for the compiler to catch up.");
+
+DEFINE_uint64(max_modules_per_object, 32,
+              "Maximum number of lifted modules that are linked together "
+              "and compiled into a single object file.");
+
+DEFINE_bool(tiered_lifting, true,
+            "Quickly lift and compile code that is needed right now without "
+            "optimizations, and then replace it with optimized code that is "
+            "lifted and compiled in the background. The unoptimized code of "
+            "only the trace being executed is compiled on the executing "
+            "thread, instead of waiting for its whole batch to be optimized, "
+            "and is unloaded once it has been replaced.");
+
+DEFINE_uint64(hot_trace_batch_size, 16,
+              "Maximum number of hot traces that are re-lifted together into "
+              "one aggressively optimized module.");
+
+DEFINE_uint64(max_decoded_traces, 64,
+              "Maximum number of traces that are decoded when execution "
+              "reaches code that hasn't been lifted. Traces beyond this are "
+              "decoded when they're first executed. Zero means no limit.");
+
+DEFINE_uint64(max_decoded_instructions, 4096,
+              "Maximum number of instructions that are decoded when "
+              "execution reaches code that hasn't been lifted. Zero means "
+              "no limit.");
+
+DEFINE_uint64(prelift_batch_size, 64,
+              "Number of traces that are lifted together into one module "
+              "when lifting code ahead of time.");
+
 namespace vmill {
 
 thread_local Executor *gExecutor = nullptr;
@@ -57,17 +120,69 @@ extern thread_local Task *gTask;
 
 namespace {
 
+// A lifter that is private to one thread. LLVM contexts can't be used by
+// more than one thread at a time, so each lifter gets its own context, and
+// its own copy of the architecture and semantics bitcode.
+struct ThreadLifter {
+  ThreadLifter(void)
+      : context(new llvm::LLVMContext),
+        arch(remill::Arch::Build(context.get(), remill::GetOSName(FLAGS_os),
+                                 remill::GetArchName(FLAGS_arch))),
+        lifter(arch.get(), context) {}
+
+  const std::shared_ptr<llvm::LLVMContext> context;
+  const remill::Arch::ArchPtr arch;
+  const Lifter lifter;
+};
+
 // Thread-specific lifters for supporting asynchronous lifting.
-static thread_local std::optional<Lifter> tLifter;
+static thread_local std::optional<ThreadLifter> tLifter;
 
 // Returns a thread-specific lifter object.
-static const Lifter &GetLifter(
-    const remill::Arch *arch,
-    const std::shared_ptr<llvm::LLVMContext> &context) {
+static const Lifter &GetLifter(void) {
   if (unlikely(!tLifter)) {
-    tLifter.emplace(arch, context);
+    tLifter.emplace();
+  }
+  return tLifter->lifter;
+}
+
+// Lift `traces` using the current thread's lifter, and serialize the lifted
+// module. The bitcode is empty if nothing was lifted.
+static LiftedBitcode LiftTracesToBitcode(const DecodedTraceList &traces,
+                                         CodeTier tier) {
+  LiftedBitcode lifted;
+  auto module = GetLifter().Lift(traces, tier);
+  if (module) {
+    lifted.module_name = module->getModuleIdentifier();
+    llvm::raw_string_ostream os(lifted.bitcode);
+    llvm::WriteBitcodeToFile(*module, os);
+    os.flush();
+  }
+  return lifted;
+}
+
+// Deserialize a lifted module into `context`.
+static std::unique_ptr<llvm::Module> LoadLiftedBitcode(
+    const LiftedBitcode &lifted, llvm::LLVMContext &context) {
+  if (lifted.bitcode.empty()) {
+    return nullptr;
+  }
+
+  auto buff = llvm::MemoryBuffer::getMemBuffer(
+      lifted.bitcode, lifted.module_name, false /* RequiresNullTerminator */);
+  auto maybe_module = llvm::parseBitcodeFile(buff->getMemBufferRef(), context);
+  CHECK(!remill::IsError(maybe_module))
+      << "Unable to parse lifted bitcode of module " << lifted.module_name
+      << ": " << remill::GetErrorString(maybe_module);
+
+  return std::move(remill::GetReference(maybe_module));
+}
+
+// Invoked by address spaces when their code is changed.
+static void UnlinkTracesOnCodeChange(void) {
+  if (gExecutor) {
+    gExecutor->UnlinkTraces();
   }
-  return *tLifter;
 }
 
 // Load the instrumentation tool that we'll be running.
@@ -86,9 +201,19 @@ Executor::Executor(void)
     : context(new llvm::LLVMContext),
       arch(remill::Arch::Build(context.get(), remill::GetOSName(FLAGS_os),
                                remill::GetArchName(FLAGS_arch))),
-      lifters(new ThreadPool(std::max<size_t>(1, FLAGS_num_lift_threads))),
+      lifters(new PipelineStage("lift", FLAGS_num_lift_threads,
+                                FLAGS_max_queued_lifts)),
+      compilers(new PipelineStage(
+          "compile", std::max<uint64_t>(1, FLAGS_num_compile_threads),
+          std::max(FLAGS_max_queued_compiles, FLAGS_num_compile_threads))),
       code_cache(CodeCache::Create(LoadTool(), context)),
-      index(IndexCache::Open(Workspace::IndexPath())),
+      index(IndexCache::Open(
+          Workspace::IndexPath(),
+          [this] (const LiveTraceId &, const TraceId &trace_id) {
+            return !code_cache->OwnsWorkspace() ||
+                   code_cache->IsCached(trace_id);
+          })),
+      bitcode_archive(BitcodeArchive::Open(Workspace::BitcodeArchivePath())),
       init_intrinsic(reinterpret_cast<decltype(init_intrinsic)>(
           code_cache->Lookup("__vmill_init"))),
       create_task_intrinsic(
@@ -101,6 +226,8 @@ Executor::Executor(void)
       error_intrinsic(reinterpret_cast<LiftedFunction *>(
           code_cache->Lookup("__remill_error"))) {
 
+  memset(dispatch_cache, 0, sizeof(dispatch_cache));
+
   CHECK(init_intrinsic != nullptr)
       << "Could not locate __vmill_init";
 
@@ -136,23 +263,19 @@ Executor::Executor(void)
       << std::hex << "__remill_error = "
       << reinterpret_cast<void *>(error_intrinsic) << std::dec;
 
-  // Load the code cache index from the disk.
-  for (const auto &entry : *index) {
-    const auto &trace_id = entry.trace_id;
-    const auto &live_id = entry.live_trace_id;
-    if (auto lifted_func = code_cache->Lookup(trace_id)) {
-      live_traces[live_id] = lifted_func;
-    }
-  }
-
   LOG(INFO)
-      << "Loaded " << live_traces.size() << " of " << index->NumEntries()
-      << " entries from the index cache.";
+      << "Opened index cache with " << index->Size() << " entries.";
 }
 
-void Executor::DecodeTracesFromTask(Task *task) {
-  const auto memory = task->memory;
-  const auto task_pc = task->pc;
+DecodedTraceList Executor::DecodeNewTracesFromTask(Task *task) {
+  DecodeBudget budget;
+  budget.max_num_traces = FLAGS_max_decoded_traces;
+  budget.max_num_instructions = FLAGS_max_decoded_instructions;
+  return DecodeNewTraces(task->memory, task->pc, budget);
+}
+
+DecodedTraceList Executor::DecodeNewTraces(AddressSpace *memory, PC task_pc,
+                                           const DecodeBudget &budget) {
   const auto task_pc_uint = static_cast<uint64_t>(task_pc);
 
   DLOG(INFO)
@@ -161,93 +284,348 @@ void Executor::DecodeTracesFromTask(Task *task) {
       << ")" << std::dec;
 
   auto seen_task_pc = false;
-  auto traces = DecodeTraces(arch.get(), *memory, task_pc);
-  auto trace_it = traces.begin();
-  while (trace_it != traces.end()) {
-    auto it = trace_it;
-    ++trace_it;
-
-    auto trace_id = it->id;
-    auto trace_pc = it->pc;
-    auto trace_code_version = it->code_version;
+  auto traces = DecodeTraces(arch.get(), *memory, task_pc, budget);
+
+  // Compact the new traces to the front of the list.
+  auto new_trace_it = traces.begin();
+  for (auto &trace : traces) {
+    auto trace_id = trace.id;
+    auto trace_pc = trace.pc;
+    auto trace_code_version = trace.code_version;
     seen_task_pc = seen_task_pc || trace_pc == task_pc;
 
     LiveTraceId live_id = {trace_pc, trace_code_version};
-    auto live_trace_it = live_traces.find(live_id);
-
     // Already lifted and in our live cache.
-    if (live_trace_it != live_traces.end()) {
-      traces.erase(it);
+    if (live_traces.Find(live_id)) {
       continue;
     }
 
     // Already lifted, but not in our live cache.
     auto lifted_func = code_cache->Lookup(trace_id);
     if (lifted_func) {
-      index->Append({trace_id, live_id});
-      live_traces[live_id] = lifted_func;
-
-      traces.erase(it);
+      if (trace.immutable_loads.empty()) {
+        index->Insert(live_id, trace_id);
+      }
+      AddLiveTrace(live_id, lifted_func);
       continue;
     }
+
+    num_decoded_traces++;
+    unexecuted_traces.insert(live_id);
+
+    if (&*new_trace_it != &trace) {
+      *new_trace_it = std::move(trace);
+    }
+    ++new_trace_it;
   }
 
+  traces.erase(new_trace_it, traces.end());
+
   LOG_IF(ERROR, !seen_task_pc)
       << "Decoded trace list does not include originally requested PC "
       << std::hex << task_pc_uint;
 
-  std::future<std::unique_ptr<llvm::Module>> future_module = lifters->Submit(
-      [this, &traces] (void) {
-        return GetLifter(arch.get(), context).Lift(traces);
-      });
+  return traces;
+}
+
+void Executor::DecodeTracesFromTask(Task *task) {
+  const auto task_pc = task->pc;
+
+  if (FLAGS_tiered_lifting) {
+    const LiveTraceId live_id = {
+        task_pc, task->memory->ComputeCodeVersion(task_pc)};
+
+    // The trace was already decoded, and is waiting for its optimized code.
+    auto pending_it = pending_traces.find(live_id);
+    if (pending_it != pending_traces.end()) {
+      LiftColdTrace(*(pending_it->second));
+      return;
+    }
+
+    auto traces = DecodeNewTracesFromTask(task);
+    for (const auto &trace : traces) {
+      if (trace.pc == task_pc) {
+        LiftColdTrace(trace);
+        break;
+      }
+    }
+
+    LiftTracesInBackground(std::move(traces), kCodeTierWarm);
+    return;
+  }
+
+  auto traces = DecodeNewTracesFromTask(task);
+  if (traces.empty()) {
+    return;
+  }
+
+  LiftTracesInBackground(std::move(traces), kCodeTierWarm);
+
+  // Other tasks can install, and so erase, this batch's `PendingLift` while
+  // this task is paused, so hold onto our own copy of its future.
+  const auto object = pending_lifts.back().object;
 
   auto coro = task->async_routine;
-  if (!coro || !coro->ExecutingNow() || gTask != task) {
-    future_module.wait();
-  } else {
+  if (coro && coro->ExecutingNow() && gTask == task) {
     coro->Pause(task);
-    auto done = false;
-    do {
-      switch (future_module.wait_for(std::chrono::milliseconds(5))) {
-        case std::future_status::deferred:
-          future_module.wait();
-          done = true;
-          break;
-        case std::future_status::ready:
-          done = true;
-          break;
-        case std::future_status::timeout:
-          coro->Pause(task);
-          break;
-      }
-    } while (!done);
+    while (std::future_status::timeout ==
+           object.wait_for(std::chrono::milliseconds(5))) {
+      coro->Pause(task);
+    }
+  } else {
+    object.wait();
+  }
+
+  // Only wait for this batch, and not for unrelated (e.g. hot) batches.
+  std::lock_guard<std::mutex> locker(compile_lock);
+  if (InstallFinishedLifts()) {
+    UnlinkTraces();
   }
+}
 
-  auto module = future_module.get();
+void Executor::LiftColdTrace(const DecodedTrace &trace) {
+  DecodedTraceList traces;
+  traces.push_back(trace);
+
+  const auto lifted = LiftTracesToBitcode(traces, kCodeTierCold);
+
+  std::lock_guard<std::mutex> locker(compile_lock);
+  auto module = LoadLiftedBitcode(lifted, *context);
   if (!module) {
     return;
   }
 
-  // Save a copy of the lifted module into the bitcode directory. This is so
-  // that other tools can benefit from existing lifted code, but apply their
-  // own instrumentation.
-  std::stringstream ss;
-  ss << Workspace::BitcodeDir() << remill::PathSeparator()
-     << remill::ModuleName(module);
+  code_cache->AddModuleToCache(module, kCodeTierCold);
+  code_cache->RunConstructors();
 
-  auto file_name = ss.str();
-  remill::StoreModuleToFile(module.get(), file_name);
+  if (auto lifted_func = code_cache->Lookup(trace.id)) {
+    const LiveTraceId live_id = {trace.pc, trace.code_version};
+    AddLiveTrace(live_id, lifted_func);
+    cold_live_ids.insert(live_id);
+  }
+}
 
-  code_cache->AddModuleToCache(module);
-  code_cache->RunConstructors();
+void Executor::LiftTracesInBackground(DecodedTraceList traces,
+                                      CodeTier tier) {
+  if (traces.empty()) {
+    return;
+  }
+
+  pending_lifts.emplace_back();
+  auto &pending = pending_lifts.back();
+  pending.traces = std::move(traces);
+  pending.tier = tier;
+
+  // Hot traces are already live, so there's no need to lift them into the
+  // cold tier while waiting.
+  if (kCodeTierHot != tier) {
+    for (const auto &trace : pending.traces) {
+      pending_traces[{trace.pc, trace.code_version}] = &trace;
+    }
+  }
+
+  auto object = std::make_shared<std::promise<CompiledObjectPtr>>();
+  pending.object = object->get_future().share();
+
+  // The lifting stage hands the lifted bitcode off to the compiling stage,
+  // and can then go on to lift the next batch while this one compiles.
+  // `pending` is not moved or destroyed until after its object file is
+  // ready, so the lifters can refer to its traces.
+  const auto pending_traces_list = &(pending.traces);
+  (void) lifters->Submit(
+      [this, pending_traces_list, tier, object] (void) {
+        QueuedBitcode queued = {
+            LiftTracesToBitcode(*pending_traces_list, tier), tier, object};
+        do {
+          std::lock_guard<std::mutex> locker(compile_queue_lock);
+          compile_queue.push_back(std::move(queued));
+        } while (false);
+
+        // The work item might find that its bitcode was already compiled
+        // as part of an earlier batch.
+        (void) compilers->Submit([this] (void) {
+          CompileQueuedBitcode();
+          return true;
+        });
+        return true;
+      });
+}
+
+void Executor::CompileQueuedBitcode(void) {
+  std::vector<QueuedBitcode> batch;
+  do {
+    std::lock_guard<std::mutex> locker(compile_queue_lock);
+    if (compile_queue.empty()) {
+      return;
+    }
+
+    const auto tier = compile_queue.front().tier;
+    auto queued_it = compile_queue.begin();
+    while (queued_it != compile_queue.end() &&
+           batch.size() < FLAGS_max_modules_per_object) {
+      if (queued_it->tier == tier) {
+        batch.push_back(std::move(*queued_it));
+        queued_it = compile_queue.erase(queued_it);
+      } else {
+        ++queued_it;
+      }
+    }
+  } while (false);
+
+  const auto tier = batch.front().tier;
+
+  // Hot code can always be re-derived from the warm bitcode.
+  if (kCodeTierHot != tier) {
+    for (const auto &queued : batch) {
+      if (!queued.lifted.bitcode.empty()) {
+        bitcode_archive->Add(queued.lifted.module_name, queued.lifted.bitcode);
+      }
+    }
+  }
+
+  // With several compiling threads, each one compiles in its own LLVM
+  // context, and only has to hold `compile_lock` to publish its object.
+  const auto use_thread_context = 1 < FLAGS_num_compile_threads;
+  std::unique_lock<std::mutex> locker(compile_lock, std::defer_lock);
+  if (!use_thread_context) {
+    locker.lock();
+  }
+
+  auto &module_context = use_thread_context ? code_cache->ThreadContext()
+                                            : *context;
+  auto object = std::make_shared<CompiledObject>();
+  do {
+    std::unique_ptr<llvm::Module> linked_module;
+    for (const auto &queued : batch) {
+      auto module = LoadLiftedBitcode(queued.lifted, module_context);
+      if (!module) {
+        continue;
+      }
 
-  // Add the now lifted traces into the live trace cache.
-  for (const auto &trace : traces) {
-    LiveTraceId live_id = {trace.pc, trace.code_version};
-    if (auto lifted_func = code_cache->Lookup(trace.id)) {
-      live_traces[live_id] = lifted_func;
+      if (!linked_module) {
+        linked_module = std::move(module);
+      } else {
+        CHECK(!llvm::Linker::linkModules(*linked_module, std::move(module)))
+            << "Unable to link lifted module " << queued.lifted.module_name
+            << " into " << remill::ModuleName(linked_module);
+      }
+    }
+
+    if (linked_module) {
+      object->path = code_cache->CompileModule(linked_module, tier);
     }
+  } while (false);
+
+  // Every pending lift of the batch becomes ready under `compile_lock`,
+  // which is also held while finished lifts are installed. That way, all
+  // of the lifts that share `object` are installed together.
+  if (!locker.owns_lock()) {
+    locker.lock();
+  }
+  for (auto &queued : batch) {
+    queued.object->set_value(object);
+  }
+}
+
+void Executor::AddHotTrace(Task *task, PC pc) {
+  const auto memory = task->memory;
+  const LiveTraceId live_id = {pc, memory->ComputeCodeVersion(pc)};
+  if (!hot_live_ids.insert(live_id).second) {
+    return;
   }
+
+  DLOG(INFO)
+      << "Trace at " << std::hex << static_cast<uint64_t>(pc) << std::dec
+      << " is hot";
+
+  hot_traces.push_back(DecodeTrace(arch.get(), *memory, pc));
+
+  // Batch up hot traces while the lifters are busy, so that traces that get
+  // hot together are optimized together.
+  if (pending_lifts.empty() ||
+      hot_traces.size() >= FLAGS_hot_trace_batch_size) {
+    LiftHotTraces();
+  }
+}
+
+void Executor::LiftHotTraces(void) {
+  DecodedTraceList traces;
+  traces.swap(hot_traces);
+  LiftTracesInBackground(std::move(traces), kCodeTierHot);
+}
+
+void Executor::InstallLiftedTraces(bool wait) {
+  std::unique_lock<std::mutex> locker(compile_lock, std::defer_lock);
+  if (wait) {
+    for (const auto &pending : pending_lifts) {
+      pending.object.wait();
+    }
+    locker.lock();
+
+  // Don't stall the executor if a lifter is compiling; the finished code
+  // will be picked up next time.
+  } else if (!locker.try_lock()) {
+    return;
+  }
+
+  // Chained call sites and inline caches might still point to colder code.
+  if (InstallFinishedLifts()) {
+    UnlinkTraces();
+  }
+  locker.unlock();
+
+  if (!wait && !hot_traces.empty() && pending_lifts.empty()) {
+    LiftHotTraces();
+  }
+}
+
+bool Executor::InstallFinishedLifts(void) {
+  auto installed = false;
+  auto pending_it = pending_lifts.begin();
+  while (pending_it != pending_lifts.end()) {
+    if (std::future_status::ready !=
+        pending_it->object.wait_for(std::chrono::seconds(0))) {
+      ++pending_it;
+      continue;
+    }
+
+    const auto object = pending_it->object.get();
+    if (!object->path.empty()) {
+      code_cache->LoadCompiledModule(object->path, pending_it->tier);
+      code_cache->RunConstructors();
+    }
+
+    // Several pending lifts can share one object file. Install all of them
+    // now, so that none of the object's traces are left out of
+    // `live_traces`, where eviction wouldn't see them.
+    for (auto same_it = pending_it; same_it != pending_lifts.end(); ) {
+      if (std::future_status::ready !=
+              same_it->object.wait_for(std::chrono::seconds(0)) ||
+          same_it->object.get() != object) {
+        ++same_it;
+        continue;
+      }
+
+      // Replace any colder versions of the traces.
+      for (const auto &trace : same_it->traces) {
+        LiveTraceId live_id = {trace.pc, trace.code_version};
+        pending_traces.erase(live_id);
+        if (auto lifted_func = code_cache->Lookup(trace.id)) {
+          AddLiveTrace(live_id, lifted_func);
+          if (trace.immutable_loads.empty()) {
+            index->Insert(live_id, trace.id);
+          }
+        }
+      }
+
+      if (same_it == pending_it) {
+        ++pending_it;
+      }
+      same_it = pending_lifts.erase(same_it);
+    }
+    installed = true;
+  }
+  return installed;
 }
 
 void Executor::SetUp(void) {
@@ -256,6 +634,7 @@ void Executor::SetUp(void) {
 
   gExecutor = this;
   code_cache->SetUp();
+  AddressSpace::SetCodeInvalidationCallback(UnlinkTracesOnCodeChange);
 
   LOG(INFO)
       << "Initializing the runtime.";
@@ -300,6 +679,60 @@ void Executor::Run(void) {
   TearDown();
 }
 
+void Executor::Prelift(const std::vector<PC> &extra_pcs) {
+  code_cache->SetUp();
+
+  std::unordered_set<AddressSpace *> seen_memories;
+  uint64_t num_traces = 0;
+  for (const auto &info : initial_tasks) {
+    const auto memory = info.memory.get();
+    if (!seen_memories.insert(memory).second) {
+      continue;
+    }
+
+    auto pcs = FindEntryPoints(*memory);
+    pcs.push_back(info.pc);
+    pcs.insert(pcs.end(), extra_pcs.begin(), extra_pcs.end());
+
+    for (auto pc : pcs) {
+      if (memory->IsMarkedTraceHead(pc) ||
+          !memory->CanExecute(static_cast<uint64_t>(pc))) {
+        continue;
+      }
+
+      // Split the traces into batches so that the lifters can work on them
+      // in parallel.
+      auto traces = DecodeNewTraces(memory, pc, DecodeBudget());
+      num_traces += traces.size();
+      const auto batch_size = std::max<uint64_t>(1, FLAGS_prelift_batch_size);
+      for (uint64_t i = 0; i < traces.size(); i += batch_size) {
+        const auto batch_begin = traces.begin() + static_cast<ptrdiff_t>(i);
+        const auto batch_end = traces.begin() + static_cast<ptrdiff_t>(
+            std::min<uint64_t>(i + batch_size, traces.size()));
+        DecodedTraceList batch;
+        batch.insert(batch.end(), std::make_move_iterator(batch_begin),
+                     std::make_move_iterator(batch_end));
+        LiftTracesInBackground(std::move(batch), kCodeTierWarm);
+        InstallLiftedTraces(false);
+      }
+    }
+  }
+
+  LOG(INFO)
+      << "Lifting " << num_traces << " traces ahead of time";
+
+  InstallLiftedTraces(true);
+  UnlinkTraces();
+  index->Sync();
+  bitcode_archive->Flush();
+  lifters->LogStats();
+  compilers->LogStats();
+
+  // Whatever program runs the code next can load the libraries, but not a
+  // snapshot saved by this program.
+  code_cache->TearDown(false);
+}
+
 void Executor::TearDown(void) {
   CHECK(gExecutor == this)
       << "Did you forgot to call `Executor::SetUp`?";
@@ -308,7 +741,20 @@ void Executor::TearDown(void) {
       << "Finalizing the runtime.";
   fini_intrinsic();
 
-  code_cache->TearDown();
+  AddressSpace::SetCodeInvalidationCallback(nullptr);
+
+  LOG(INFO)
+      << "Decoded " << num_decoded_traces << " new traces, of which "
+      << num_executed_traces << " were executed, and "
+      << unexecuted_traces.size() << " were never dispatched to";
+
+  InstallLiftedTraces(true);
+  UnlinkTraces();
+  index->Sync();
+  bitcode_archive->Flush();
+  lifters->LogStats();
+  compilers->LogStats();
+  code_cache->TearDown(true);
 
   gExecutor = nullptr;
 }
@@ -321,9 +767,31 @@ LiftedFunction *Executor::FindLiftedFunctionForTask(Task *task) {
   const auto code_version = memory->ComputeCodeVersion(task_pc);
   const LiveTraceId live_id = {task_pc, code_version};
 
-  auto live_id_it = live_traces.find(live_id);
-  if (likely(live_id_it != live_traces.end())) {
-    return live_id_it->second;
+  if (unlikely(!pending_lifts.empty())) {
+    InstallLiftedTraces(false);
+  }
+
+  auto &cached = dispatch_cache[task_pc_uint & kDispatchCacheMask];
+  if (likely(cached.live_id == live_id && cached.lifted_func)) {
+    return cached.lifted_func;
+  }
+
+  CountExecution(live_id);
+
+  if (auto lifted_func = live_traces.Find(live_id); likely(lifted_func)) {
+    cached.live_id = live_id;
+    cached.lifted_func = lifted_func;
+    return lifted_func;
+  }
+
+  // The trace was lifted by an earlier run.
+  if (TraceId trace_id; index->Find(live_id, &trace_id)) {
+    if (auto lifted_func = code_cache->Lookup(trace_id)) {
+      AddLiveTrace(live_id, lifted_func);
+      cached.live_id = live_id;
+      cached.lifted_func = lifted_func;
+      return lifted_func;
+    }
   }
 
   // We do a preliminary check here to make sure the code is executable.
@@ -337,9 +805,10 @@ LiftedFunction *Executor::FindLiftedFunctionForTask(Task *task) {
   }
 
   DecodeTracesFromTask(task);
+  CountExecution(live_id);
 
-  live_id_it = live_traces.find(live_id);
-  if (unlikely(live_id_it == live_traces.end())) {
+  auto lifted_func = live_traces.Find(live_id);
+  if (unlikely(!lifted_func)) {
     LOG(ERROR)
         << "Could not locate lifted function for " << std::hex
         << task_pc_uint << std::dec;
@@ -349,7 +818,171 @@ LiftedFunction *Executor::FindLiftedFunctionForTask(Task *task) {
     return error_intrinsic;
   }
 
-  return live_id_it->second;
+  return lifted_func;
+}
+
+void Executor::CountExecution(const LiveTraceId &live_id) {
+  if (unlikely(!unexecuted_traces.empty()) &&
+      unexecuted_traces.erase(live_id)) {
+    num_executed_traces++;
+  }
+}
+
+void Executor::AddLiveTrace(const LiveTraceId &live_id,
+                            LiftedFunction *lifted_func) {
+  live_traces.Insert(live_id, lifted_func);
+
+  // The cold code of this trace can be unloaded once nothing uses it.
+  if (unlikely(!cold_live_ids.empty()) && cold_live_ids.erase(live_id)) {
+    has_replaced_cold_code = true;
+  }
+
+  // Make sure that the dispatch cache doesn't keep a replaced trace alive.
+  const auto pc_uint = static_cast<uint64_t>(live_id.pc);
+  auto &cached = dispatch_cache[pc_uint & kDispatchCacheMask];
+  if (cached.live_id == live_id) {
+    cached.lifted_func = lifted_func;
+  }
+}
+
+void Executor::LinkTrace(Task *task, LiftedFunction **slot,
+                         LiftedFunction *lifted_func) {
+  if (unlikely(lifted_func == error_intrinsic ||
+               kTaskStatusError == task->status)) {
+    return;
+  }
+
+  PrepareToRun(task);
+  *slot = lifted_func;
+  linked_slots.push_back(slot);
+}
+
+void Executor::AddToInlineCache(Task *task, InlineCacheEntry *entries,
+                                LiftedFunction *lifted_func) {
+  const auto pc_uint = static_cast<uint64_t>(task->pc);
+  if (unlikely(lifted_func == error_intrinsic ||
+               kTaskStatusError == task->status ||
+               kInvalidInlineCachePC == pc_uint)) {
+    return;
+  }
+
+  PrepareToRun(task);
+  if (kInvalidInlineCachePC == entries[0].pc) {
+    filled_inline_caches.push_back(entries);
+  }
+
+  for (auto i = kNumInlineCacheEntries - 1U; i > 0; --i) {
+    entries[i] = entries[i - 1];
+  }
+  entries[0].pc = pc_uint;
+  entries[0].lifted_func = lifted_func;
+}
+
+void Executor::UnlinkTraces(void) {
+  for (auto slot : linked_slots) {
+    *slot = nullptr;
+  }
+  linked_slots.clear();
+
+  for (auto entries : filled_inline_caches) {
+    for (auto i = 0U; i < kNumInlineCacheEntries; ++i) {
+      entries[i].pc = kInvalidInlineCachePC;
+      entries[i].lifted_func = nullptr;
+    }
+  }
+  filled_inline_caches.clear();
+}
+
+void Executor::PrepareToRun(Task *task) {
+  if (unlikely(!pending_lifts.empty())) {
+    InstallLiftedTraces(false);
+  }
+
+  if (!FLAGS_version_code || task->memory == linked_memory) {
+    return;
+  }
+
+  // The same lifted trace can be live in several address spaces, but the
+  // targets of its calls might differ between them.
+  UnlinkTraces();
+  linked_memory = task->memory;
+}
+
+void Executor::MaybeEvictCode(void) {
+  const auto is_over_budget = code_cache->IsOverBudget();
+  if (likely(!is_over_budget && !has_replaced_cold_code)) {
+    return;
+  }
+  has_replaced_cold_code = false;
+
+  // Paused coroutines can be in the middle of lifted code, so anything that
+  // looks like a return address into lifted code pins the object containing
+  // it.
+  std::vector<uintptr_t> code_addrs;
+  Coroutine::ForEachPausedStack(
+      [&code_addrs, this] (const uint64_t *sp, const uint64_t *end) {
+        for (; sp < end; ++sp) {
+          if (code_cache->ContainsCode(static_cast<uintptr_t>(*sp))) {
+            code_addrs.push_back(static_cast<uintptr_t>(*sp));
+          }
+        }
+      });
+  std::sort(code_addrs.begin(), code_addrs.end());
+
+  std::unordered_set<LiftedFunction *> live_funcs;
+  live_traces.ForEach(
+      [&live_funcs] (const LiveTraceId &, LiftedFunction *lifted_func) {
+        live_funcs.insert(lifted_func);
+      });
+
+  // Chain slots and inline caches live inside of the data of lifted code,
+  // and can point into code that is about to be evicted.
+  UnlinkTraces();
+
+  auto is_live = [&live_funcs] (LiftedFunction *lifted_func) {
+    return live_funcs.count(lifted_func) != 0;
+  };
+
+  auto is_pinned = [&code_addrs] (uintptr_t begin, uintptr_t end) {
+    auto addr_it = std::lower_bound(
+        code_addrs.begin(), code_addrs.end(), begin);
+    return addr_it != code_addrs.end() && *addr_it < end;
+  };
+
+  if (is_over_budget) {
+    code_cache->EvictCode(is_live, is_pinned);
+  } else {
+    code_cache->EvictColdCode(is_live, is_pinned);
+  }
+
+  std::vector<LiveTraceId> evicted_ids;
+  live_traces.ForEach(
+      [&evicted_ids, this] (const LiveTraceId &live_id,
+                            LiftedFunction *lifted_func) {
+        if (!code_cache->IsLoaded(lifted_func)) {
+          evicted_ids.push_back(live_id);
+        }
+      });
+
+  // Evicted traces can get hot again once they're re-lifted. Their code is
+  // gone from the workspace too (unless another process owns it), so the
+  // index can't find it, and the decoder has to be willing to decode the
+  // traces again.
+  const auto owns_workspace = code_cache->OwnsWorkspace();
+  std::vector<PC> evicted_pcs;
+  evicted_pcs.reserve(evicted_ids.size());
+  for (const auto &live_id : evicted_ids) {
+    live_traces.Erase(live_id);
+    hot_live_ids.erase(live_id);
+    cold_live_ids.erase(live_id);
+    if (owns_workspace) {
+      index->Erase(live_id);
+    }
+    evicted_pcs.push_back(live_id.pc);
+  }
+  AddressSpace::UnmarkTraceHeads(evicted_pcs);
+
+  memset(dispatch_cache, 0, sizeof(dispatch_cache));
 }
 
 void Executor::AddInitialTask(const std::string &state_bytes, PC pc,
@@ -17,47 +17,62 @@
 #ifndef VMILL_EXECUTOR_EXECUTOR_H_
 #define VMILL_EXECUTOR_EXECUTOR_H_
 
+#include <deque>
+#include <future>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <remill/Arch/Arch.h>
 
+#include "vmill/Arch/Decoder.h"
 #include "vmill/BC/Trace.h"
 #include "vmill/Runtime/Task.h"
-#include "vmill/Util/FileBackedCache.h"
-
-#include "third_party/ThreadPool/ThreadPool.h"
+#include "vmill/Util/FileBackedHashMap.h"
+#include "vmill/Util/FlatMap.h"
+#include "vmill/Util/Pipeline.h"
 
 struct ArchState;
 struct Memory;
 
-class ThreadPool;
-
 namespace llvm {
 class LLVMContext;
 }  // namespace llvm
 namespace vmill {
 
 class AddressSpace;
+class BitcodeArchive;
 class CodeCache;
-class DecodedTraceList;
 class Lifter;
 
 // A compiled lifted trace.
 using LiftedFunction = Memory *(ArchState *, PC, Memory *);
 
+// An entry in the inline cache of a lifted indirect jump or call site. The
+// layout of this structure must match what the lifter emits.
+struct InlineCacheEntry {
+  uint64_t pc;
+  LiftedFunction *lifted_func;
+};
+
+// A lifted module, serialized as bitcode so that it can be moved out of the
+// LLVM context of the thread that lifted it.
+struct LiftedBitcode {
+  std::string module_name;
+  std::string bitcode;
+};
+
 struct InitialTaskInfo {
   std::string state;
   PC pc;
   std::shared_ptr<AddressSpace> memory;
 };
 
-struct CachedIndexEntry {
-  TraceId trace_id;
-  LiveTraceId live_trace_id;
-};
-
-using IndexCache = FileBackedCache<CachedIndexEntry>;
+// Persistent map of the traces that have been lifted for each live trace.
+using IndexCache = FileBackedHashMap<LiveTraceId, TraceId>;
 
 // Task executor. This manages things like the code cache, and can lift and
 // compile code on request.
@@ -67,11 +82,47 @@ class Executor {
 
   void Run(void);
 
+  // Decode all code reachable from the entry points of the initial tasks'
+  // address spaces, and from `extra_pcs`, and then lift, optimize, and
+  // compile it into the code cache without running anything. Future runs
+  // can then execute entirely out of the cache.
+  void Prelift(const std::vector<PC> &extra_pcs);
+
   void AddInitialTask(const std::string &state, PC pc,
                       std::shared_ptr<AddressSpace> memory);
 
   LiftedFunction *FindLiftedFunctionForTask(Task *task);
 
+  // Link the call site whose chain slot is `slot` to `lifted_func`, so that
+  // future executions of that call site bypass the dispatcher.
+  void LinkTrace(Task *task, LiftedFunction **slot,
+                 LiftedFunction *lifted_func);
+
+  // Add `lifted_func`, the trace for `task->pc`, into the inline cache
+  // `entries` of an indirect jump or call site. The new entry becomes the
+  // first one checked, and the least recently added one is evicted.
+  void AddToInlineCache(Task *task, InlineCacheEntry *entries,
+                        LiftedFunction *lifted_func);
+
+  // Unlink all chained call sites and empty all inline caches. The next
+  // execution of each call site will go back through the dispatcher.
+  void UnlinkTraces(void);
+
+  // Called by lifted code when the trace at `pc` in `task`'s address space
+  // becomes hot. Hot traces are batched up and re-lifted together into
+  // aggressively optimized code.
+  void AddHotTrace(Task *task, PC pc);
+
+  // Called just before `task` runs. Chained traces and inline caches are only
+  // valid for the address space that filled them when code versioning is
+  // enabled.
+  void PrepareToRun(Task *task);
+
+  // Called between task runs, when no lifted code is executing. If the code
+  // cache is over its budget, then this evicts code that isn't in use by any
+  // paused task. Otherwise, it only unloads cold code that has been replaced.
+  void MaybeEvictCode(void);
+
  private:
   void SetUp(void);
   void TearDown(void);
@@ -79,24 +130,162 @@ class Executor {
   __attribute__((noinline))
   void DecodeTracesFromTask(Task *task);
 
+  // Decode the traces reachable from `task->pc` that aren't already live.
+  DecodedTraceList DecodeNewTracesFromTask(Task *task);
+
+  // Decode the traces reachable from `pc` in `memory` that aren't already
+  // live, within `budget`.
+  DecodedTraceList DecodeNewTraces(AddressSpace *memory, PC pc,
+                                   const DecodeBudget &budget);
+
+  // Count `live_id` as executed if it was decoded, but never dispatched to.
+  void CountExecution(const LiveTraceId &live_id);
+
+  // Lift, compile, and load `trace` into the cold tier of the code cache.
+  void LiftColdTrace(const DecodedTrace &trace);
+
+  // Send `traces` down the lifting pipeline, to be compiled into the code
+  // tier `tier` of the code cache. The compiled code is loaded later, by
+  // `InstallLiftedTraces`.
+  void LiftTracesInBackground(DecodedTraceList traces, CodeTier tier);
+
+  // Parse, instrument, optimize, and compile a batch of queued lifted
+  // modules into one object file. This runs in the compiling stage of the
+  // lifting pipeline.
+  void CompileQueuedBitcode(void);
+
+  // Lift the batch of traces in `hot_traces` into hot code.
+  void LiftHotTraces(void);
+
+  // Load the code produced by finished background lifts, and make it live.
+  // If `wait` is true, then this waits for all pending lifts to finish.
+  void InstallLiftedTraces(bool wait);
+
+  // Load the code of every pending lift that has finished. `compile_lock`
+  // must be held.
+  bool InstallFinishedLifts(void);
+
+  // Add or replace the live trace for `live_id`.
+  void AddLiveTrace(const LiveTraceId &live_id, LiftedFunction *lifted_func);
+
  public:
   const std::shared_ptr<llvm::LLVMContext> context;
   const remill::Arch::ArchPtr arch;
 
  private:
-  const std::unique_ptr<ThreadPool> lifters;
+  // Stages of the lifting pipeline. Traces are decoded by the executor,
+  // lifted to bitcode by `lifters`, compiled to object files by `compilers`,
+  // and then loaded by the executor in `InstallLiftedTraces`. Unless there
+  // are several compiling threads (`--num_compile_threads`), all compiles
+  // share `context`.
+  const std::unique_ptr<PipelineStage> lifters;
+  const std::unique_ptr<PipelineStage> compilers;
   const std::unique_ptr<CodeCache> code_cache;
 
-  // File-backed index of all translations for all code versions.
+  // File-backed index of all translations for all code versions. Entries
+  // whose code is no longer cached are dropped when the index grows. Traces
+  // with folded loads aren't indexed, because a later run wouldn't know to
+  // mark the pages that they were folded from.
   const std::unique_ptr<IndexCache> index;
 
+  // Archive of all lifted bitcode, so that other tools can benefit from
+  // existing lifted code, but apply their own instrumentation. Modules are
+  // written to it in the background.
+  const std::unique_ptr<BitcodeArchive> bitcode_archive;
+
+  // Lifters each have their own LLVM context, but lifted modules are
+  // compiled in `context`, by the code cache's compilers and tool, unless
+  // there are several compiling threads. This serializes compiling in, and
+  // loading code from, `context` between the executor and the pipeline
+  // threads.
+  std::mutex compile_lock;
+
+  // An object file compiled from one or more lifted modules. `path` is
+  // empty if nothing was lifted.
+  struct CompiledObject {
+    std::string path;
+  };
+
+  using CompiledObjectPtr = std::shared_ptr<CompiledObject>;
+  using CompiledObjectFuture = std::shared_future<CompiledObjectPtr>;
+
+  // A batch of traces whose optimized code is being produced in the
+  // background. The object future is shared, so that a task can keep
+  // waiting on it after its `PendingLift` is installed by someone else.
+  struct PendingLift {
+    DecodedTraceList traces;
+    CodeTier tier;
+    CompiledObjectFuture object;
+  };
+
+  std::list<PendingLift> pending_lifts;
+
+  // Traces in `pending_lifts`, which can be lifted into the cold tier if
+  // they're needed before their optimized code is ready.
+  std::unordered_map<LiveTraceId, const DecodedTrace *> pending_traces;
+
+  // Live traces whose code is in the cold tier, and whether or not the cold
+  // code of any trace has since been replaced. Replaced cold code is unloaded
+  // by `MaybeEvictCode`.
+  std::unordered_set<LiveTraceId> cold_live_ids;
+  bool has_replaced_cold_code{false};
+
+  // Lifted modules waiting for the compiling stage. Modules of the same tier
+  // are linked together and compiled into a single object file, so that the
+  // costs of loading an object are paid once per batch.
+  struct QueuedBitcode {
+    LiftedBitcode lifted;
+    CodeTier tier;
+    std::shared_ptr<std::promise<CompiledObjectPtr>> object;
+  };
+
+  std::mutex compile_queue_lock;
+  std::deque<QueuedBitcode> compile_queue;
+
+  // Hot traces that are waiting to be re-lifted as a batch, and every trace
+  // that has ever been reported as hot.
+  DecodedTraceList hot_traces;
+  std::unordered_set<LiveTraceId> hot_live_ids;
+
+  // Traces that have been decoded and not found in the code cache, and the
+  // ones among them that have since been dispatched to. Traces that are only
+  // ever called directly by other traces in their module are never counted
+  // as executed.
+  uint64_t num_decoded_traces{0};
+  uint64_t num_executed_traces{0};
+  std::unordered_set<LiveTraceId> unexecuted_traces;
+
   // List of initial tasks.
   std::vector<InitialTaskInfo> initial_tasks;
 
   // Map of "live traces". Instead of mapping PCs to lifted function, we map
   // tuples of (PC, CodeVersion) to lifted functions. These code versions
   // permit multiple address spaces to be simultaneously live.
-  std::unordered_map<LiveTraceId, LiftedFunction *> live_traces;
+  FlatMap<LiveTraceId, LiftedFunction *> live_traces;
+
+  // Small direct-mapped cache in front of `live_traces`, indexed by the low
+  // bits of the PC.
+  enum : uint64_t {
+    kDispatchCacheSize = 4096,
+    kDispatchCacheMask = kDispatchCacheSize - 1
+  };
+
+  struct DispatchCacheEntry {
+    LiveTraceId live_id;
+    LiftedFunction *lifted_func;
+  };
+
+  DispatchCacheEntry dispatch_cache[kDispatchCacheSize];
+
+  // Chain slots of call sites that have been linked to their target traces.
+  std::vector<LiftedFunction **> linked_slots;
+
+  // Inline caches of indirect jump and call sites that have entries.
+  std::vector<InlineCacheEntry *> filled_inline_caches;
+
+  // Address space whose tasks linked the slots in `linked_slots`, and filled
+  // the caches in `filled_inline_caches`.
+  AddressSpace *linked_memory{nullptr};
 
   // Pointer to the compiled `__vmill_init` function. This initializes
   // the OS that is emulated by the runtime.
@@ -37,6 +37,8 @@ DEFINE_string(strace_output_file, "/dev/stderr",
               "then should be print out a trace of all the "
               "system calls?");
 
+DECLARE_uint64(preempt_budget);
+
 namespace vmill {
 
 extern thread_local Executor *gExecutor;
@@ -372,6 +374,43 @@ void __vmill_yield(Task *task) {
   DCHECK(gTask == task);
 }
 
+// Called at indirect control-flow transfers. Yielding here gives other tasks
+// a chance to run, unless lifted code preempts tasks when they exhaust their
+// budgets instead.
+static void YieldOnBranch(Task *task) {
+  if (!FLAGS_preempt_budget) {
+    __vmill_yield(task);
+  }
+}
+
+// Called by lifted code when the running task's preemption budget runs out,
+// just before it goes to `pc`. The task's PC is synced first, as other tasks
+// and the runtime can inspect it while this task is paused.
+void __vmill_preempt(uint64_t pc) {
+  gTask->pc = static_cast<PC>(pc);
+  gTask->preempt_budget = static_cast<int64_t>(FLAGS_preempt_budget);
+  __vmill_yield(gTask);
+}
+
+// Lifted trace entries and loop back-edges are marked with calls to this
+// function, and then rewritten to inline the budget check.
+void __vmill_check_budget(uint64_t pc) {
+  if (--gTask->preempt_budget <= 0) {
+    __vmill_preempt(pc);
+  }
+}
+
+// Called by lifted code when the trace starting at `pc` has executed
+// `--hot_trace_threshold` times.
+void __vmill_hot_trace(uint64_t pc) {
+  gExecutor->AddHotTrace(gTask, static_cast<PC>(pc));
+}
+
+// Lifted trace entries are marked with calls to this function, and then
+// rewritten to count down a private per-trace counter. There is no such
+// counter here, so a trace that isn't rewritten is never considered hot.
+void __vmill_count_execution(uint64_t) {}
+
 Memory *__remill_error(ArchState *, PC pc, Memory *memory) {
   gTask->pc = pc;
   gTask->location = kTaskStoppedAtError;
@@ -383,7 +422,7 @@ Memory *__remill_error(ArchState *, PC pc, Memory *memory) {
 Memory *__remill_jump(ArchState *state, PC pc, Memory *memory) {
   gTask->pc = pc;
   gTask->location = kTaskStoppedAtJumpTarget;
-  __vmill_yield(gTask);
+  YieldOnBranch(gTask);
   const auto lifted_func = gExecutor->FindLiftedFunctionForTask(gTask);
   return lifted_func(state, pc, memory);
 }
@@ -395,11 +434,66 @@ Memory *__remill_missing_block(ArchState *state, PC pc, Memory *memory) {
 Memory *__remill_function_call(ArchState *state, PC pc, Memory *memory) {
   gTask->pc = pc;
   gTask->location = kTaskStoppedAtCallTarget;
-  __vmill_yield(gTask);
+  YieldOnBranch(gTask);
   const auto lifted_func = gExecutor->FindLiftedFunctionForTask(gTask);
   return lifted_func(state, pc, memory);
 }
 
+// Direct function calls to traces in other modules are marked by the lifter
+// with calls to this function, and are then rewritten to go through chain
+// slots. Any calls that escaped that rewriting act like normal calls.
+Memory *__vmill_chain_call(ArchState *state, PC pc, Memory *memory) {
+  return __remill_function_call(state, pc, memory);
+}
+
+// Called when a call site's chain `slot` is empty. This dispatches to the
+// target trace, and links the call site to that trace so that next time the
+// call will go directly to the target.
+Memory *__vmill_chain_miss(ArchState *state, PC pc, Memory *memory,
+                           LiftedFunction **slot) {
+  gTask->pc = pc;
+  gTask->location = kTaskStoppedAtCallTarget;
+  YieldOnBranch(gTask);
+  const auto lifted_func = gExecutor->FindLiftedFunctionForTask(gTask);
+  gExecutor->LinkTrace(gTask, slot, lifted_func);
+  return lifted_func(state, pc, memory);
+}
+
+// Indirect jumps and calls are marked by the lifter with calls to these
+// functions, and are then rewritten to check an inline cache of targets.
+Memory *__vmill_cached_jump(ArchState *state, PC pc, Memory *memory) {
+  return __remill_jump(state, pc, memory);
+}
+
+Memory *__vmill_cached_call(ArchState *state, PC pc, Memory *memory) {
+  return __remill_function_call(state, pc, memory);
+}
+
+// Called when the target of an indirect jump is not in the jump's inline
+// cache `entries`. This dispatches like `__remill_jump`, then adds the
+// target trace into the inline cache.
+Memory *__vmill_jump_miss(ArchState *state, PC pc, Memory *memory,
+                          InlineCacheEntry *entries) {
+  gTask->pc = pc;
+  gTask->location = kTaskStoppedAtJumpTarget;
+  YieldOnBranch(gTask);
+  const auto lifted_func = gExecutor->FindLiftedFunctionForTask(gTask);
+  gExecutor->AddToInlineCache(gTask, entries, lifted_func);
+  return lifted_func(state, pc, memory);
+}
+
+// Called when the target of an indirect call is not in the call's inline
+// cache `entries`.
+Memory *__vmill_call_miss(ArchState *state, PC pc, Memory *memory,
+                          InlineCacheEntry *entries) {
+  gTask->pc = pc;
+  gTask->location = kTaskStoppedAtCallTarget;
+  YieldOnBranch(gTask);
+  const auto lifted_func = gExecutor->FindLiftedFunctionForTask(gTask);
+  gExecutor->AddToInlineCache(gTask, entries, lifted_func);
+  return lifted_func(state, pc, memory);
+}
+
 Memory *__remill_function_return(ArchState *, PC pc, Memory *memory) {
   gTask->pc = pc;
   gTask->location = kTaskStoppedAtReturnTarget;
@@ -533,7 +627,11 @@ void __vmill_run(Task *task) {
   DCHECK(gExecutor != nullptr);
   DCHECK(gTask == nullptr);
 
+  gExecutor->MaybeEvictCode();
+
   gTask = task;
+  gExecutor->PrepareToRun(task);
+  task->preempt_budget = static_cast<int64_t>(FLAGS_preempt_budget);
 
   // The task is waiting for an asynchronous operation to complete.
   const auto coro = task->async_routine;
@@ -18,6 +18,7 @@
 #include <glog/logging.h>
 
 #include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <limits>
 #include <new>
@@ -25,6 +26,7 @@
 #include "remill/Arch/Arch.h"
 #include "remill/OS/OS.h"
 
+#include "vmill/BC/Trace.h"
 #include "vmill/Program/AddressSpace.h"
 #include "vmill/Program/Snapshot.h"
 
@@ -69,6 +71,13 @@ static uint64_t GetAddressMask(const remill::Arch *arch) {
   }
 }
 
+// Called when code versioning is enabled and executable memory changes.
+static AddressSpace::CodeInvalidationCallback gCodeInvalidationCallback =
+    nullptr;
+
+// All address spaces that currently exist.
+static std::unordered_set<AddressSpace *> gAddressSpaces;
+
 }  // namespace
 
 AddressSpace::AddressSpace(const remill::Arch *arch_)
@@ -81,6 +90,7 @@ AddressSpace::AddressSpace(const remill::Arch *arch_)
       is_dead(false) {
   maps.push_back(invalid);
   CreatePageToRangeMap();
+  gAddressSpaces.insert(this);
 }
 
 AddressSpace::AddressSpace(const AddressSpace &parent)
@@ -95,6 +105,9 @@ AddressSpace::AddressSpace(const AddressSpace &parent)
       page_is_writable(parent.page_is_writable),
       page_is_executable(parent.page_is_executable),
       trace_heads(parent.trace_heads),
+      page_to_folds(parent.page_to_folds),
+      folded_ranges(parent.folded_ranges),
+      folded_data_versions(parent.folded_data_versions),
       is_dead(parent.is_dead) {
 
   unsigned i = 0;
@@ -107,6 +120,23 @@ AddressSpace::AddressSpace(const AddressSpace &parent)
   }
 
   CreatePageToRangeMap();
+  gAddressSpaces.insert(this);
+}
+
+AddressSpace::~AddressSpace(void) {
+  gAddressSpaces.erase(this);
+}
+
+void AddressSpace::SetCodeInvalidationCallback(
+    CodeInvalidationCallback callback) {
+  gCodeInvalidationCallback = callback;
+}
+
+void AddressSpace::InvalidateCode(void) {
+  trace_heads.clear();
+  if (gCodeInvalidationCallback) {
+    gCodeInvalidationCallback();
+  }
 }
 
 void AddressSpace::MarkAsTraceHead(PC pc) {
@@ -117,6 +147,62 @@ bool AddressSpace::IsMarkedTraceHead(PC pc) const {
   return 0 != trace_heads.count(static_cast<uint64_t>(pc));
 }
 
+void AddressSpace::UnmarkTraceHeads(const std::vector<PC> &pcs) {
+  for (auto memory : gAddressSpaces) {
+    for (auto pc : pcs) {
+      memory->trace_heads.erase(static_cast<uint64_t>(pc));
+    }
+  }
+}
+
+void AddressSpace::MarkAsFolded(PC trace_pc_, uint64_t addr_, size_t size) {
+  for (auto memory : gAddressSpaces) {
+    const auto trace_pc = static_cast<uint64_t>(trace_pc_) & memory->addr_mask;
+    const auto addr = addr_ & memory->addr_mask;
+    for (auto page_addr = AlignDownToPage(addr); page_addr < addr + size;
+         page_addr += kPageSize) {
+      memory->page_to_folds[page_addr].insert(trace_pc);
+    }
+
+    auto &ranges = memory->folded_ranges[trace_pc];
+    const std::pair<uint64_t, uint64_t> range = {addr, size};
+    if (std::find(ranges.begin(), ranges.end(), range) == ranges.end()) {
+      ranges.push_back(range);
+      memory->folded_data_versions.erase(trace_pc);
+    }
+  }
+}
+
+uint64_t AddressSpace::ComputeFoldedDataVersion(
+    uint64_t trace_pc,
+    const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  if (auto it = folded_data_versions.find(trace_pc);
+      it != folded_data_versions.end()) {
+    return it->second;
+  }
+
+  // Bytes that aren't read-only anymore hash the same as each other, but
+  // differently from any value that could have been folded.
+  Hasher<uint64_t> hasher;
+  for (const auto &range : ranges) {
+    const auto last_addr = range.first + range.second - 1;
+    uint8_t is_immutable = CanRead(range.first) && !CanWrite(range.first) &&
+                           CanRead(last_addr) && !CanWrite(last_addr);
+    uint64_t value = 0;
+    if (is_immutable && !TryRead(range.first, &value, range.second)) {
+      is_immutable = false;
+      value = 0;
+    }
+    hasher.Update(&(range.first), sizeof(range.first));
+    hasher.Update(&is_immutable, sizeof(is_immutable));
+    hasher.Update(&value, sizeof(value));
+  }
+
+  const auto version = hasher.Digest();
+  folded_data_versions[trace_pc] = version;
+  return version;
+}
+
 // Clear out the contents of this address space.
 void AddressSpace::Kill(void) {
   maps.clear();
@@ -194,7 +280,7 @@ bool AddressSpace::TryWrite(uint64_t addr_, const void *val, size_t size) {
       // TODO(pag): Split the range?
 
       range.InvalidateCodeVersion();
-      trace_heads.clear();
+      InvalidateCode();
     }
 
     auto page_end_addr = page_addr + kPageSize;
@@ -303,6 +389,34 @@ bool AddressSpace::TryReadExecutable(PC pc, uint8_t *val) {
   return range.Read(addr, val) && CanExecuteAligned(page_addr);
 }
 
+// Read a run of executable bytes. This is used for instruction decoding.
+size_t AddressSpace::ReadExecutableBytes(PC pc, uint8_t *bytes, size_t size) {
+  size_t num_read = 0;
+  while (num_read < size) {
+    const auto addr = (static_cast<uint64_t>(pc) + num_read) & addr_mask;
+    const auto page_addr = AlignDownToPage(addr);
+    if (!CanExecuteAligned(page_addr)) {
+      break;
+    }
+
+    auto &range = FindRangeAligned(page_addr);
+    if (!range.IsValid()) {
+      break;
+    }
+
+    auto ptr = range.ToReadOnlyVirtualAddress(addr);
+    if (!ptr) {
+      break;
+    }
+
+    const auto limit = std::min(page_addr + kPageSize, range.LimitAddress());
+    const auto chunk_size = std::min<uint64_t>(size - num_read, limit - addr);
+    memcpy(&(bytes[num_read]), ptr, chunk_size);
+    num_read += chunk_size;
+  }
+  return num_read;
+}
+
 namespace {
 
 // Return a vector of memory maps, where none of the maps overlap with the
@@ -378,7 +492,15 @@ void AddressSpace::SetPermissions(uint64_t base_, size_t size, bool can_read,
   const auto base = AlignDownToPage(base_);
   const auto limit = base + RoundUpToPage(size);
 
+  auto changes_code = can_exec;
+  std::unordered_set<uint64_t> changed_folds;
   for (auto addr = base; addr < limit; addr += kPageSize) {
+    changes_code = changes_code || CanExecuteAligned(addr);
+    if (auto folds_it = page_to_folds.find(addr);
+        folds_it != page_to_folds.end()) {
+      changed_folds.insert(folds_it->second.begin(), folds_it->second.end());
+    }
+
     if (can_read) {
       page_is_readable.insert(addr);
     } else {
@@ -398,6 +520,25 @@ void AddressSpace::SetPermissions(uint64_t base_, size_t size, bool can_read,
     }
   }
   CreatePageToRangeMap();
+
+  // The lifted code of some traces might have constants that came from these
+  // pages, even when code versioning is disabled. Only those traces get new
+  // code versions, which are computed from the new contents of the pages.
+  for (auto trace_pc : changed_folds) {
+    folded_data_versions.erase(trace_pc);
+  }
+
+  if (FLAGS_version_code && changes_code) {
+    InvalidateCode();
+
+  } else if (!changed_folds.empty()) {
+    for (auto trace_pc : changed_folds) {
+      trace_heads.erase(trace_pc);
+    }
+    if (gCodeInvalidationCallback) {
+      gCodeInvalidationCallback();
+    }
+  }
 }
 
 void AddressSpace::AddMap(const snapshot::PageRange &page, uint64_t orig_addr_space) {
@@ -649,12 +790,19 @@ void AddressSpace::CreatePageToRangeMap(void) {
 
 // Get the code version associated with some program counter.
 CodeVersion AddressSpace::ComputeCodeVersion(PC pc) {
+  uint64_t version = 0;
+  const auto masked_pc = static_cast<uint64_t>(pc) & addr_mask;
   if (FLAGS_version_code) {
-    auto masked_pc = static_cast<uint64_t>(pc) & addr_mask;
-    return FindRange(masked_pc).ComputeCodeVersion();
-  } else {
-    return static_cast<CodeVersion>(0);
+    version = static_cast<uint64_t>(FindRange(masked_pc).ComputeCodeVersion());
+  }
+  if (unlikely(!folded_ranges.empty())) {
+    const auto folded_it = folded_ranges.find(masked_pc);
+    if (folded_it != folded_ranges.end()) {
+      version ^= MixHashBits(
+          ComputeFoldedDataVersion(masked_pc, folded_it->second));
+    }
   }
+  return static_cast<CodeVersion>(version);
 }
 
 MappedRange &AddressSpace::FindRange(uint64_t addr) {
@@ -22,6 +22,7 @@
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "vmill/Program/MappedRange.h"
@@ -49,6 +50,8 @@ class AddressSpace : public Memory {
   // Creates a copy/clone of another address space.
   explicit AddressSpace(const AddressSpace &);
 
+  ~AddressSpace(void);
+
   // Kill this address space. This prevents future allocations, and removes
   // all existing ranges.
   void Kill(void);
@@ -106,6 +109,12 @@ class AddressSpace : public Memory {
   // of a page, and may result in broad-reaching cache invalidations.
   __attribute__((hot)) bool TryReadExecutable(PC addr, uint8_t *val);
 
+  // Read up to `size` executable bytes starting at `addr` into `bytes`,
+  // stopping early at the first byte that can't be read or executed. Memory
+  // is copied a page at a time, so this only looks up the range and checks
+  // the permissions of each page once. Returns the number of bytes read.
+  size_t ReadExecutableBytes(PC addr, uint8_t *bytes, size_t size);
+
   // Change the permissions of some range of memory. This can split memory
   // maps.
   void SetPermissions(uint64_t base, size_t size, bool can_read,
@@ -125,6 +134,16 @@ class AddressSpace : public Memory {
   // Returns `true` if `find` is a mapped address (with any permission).
   bool IsMapped(uint64_t find) const;
 
+  // Invokes `cb(base, limit)` on every mapped range, in order of address.
+  template <typename F>
+  void ForEachRange(F cb) const {
+    for (const auto &range : maps) {
+      if (range->IsValid()) {
+        cb(range->BaseAddress(), range->LimitAddress());
+      }
+    }
+  }
+
   // Find a hole big enough to hold `size` bytes in the address space,
   // such that the hole falls within the bounds `[min, max)`.
   bool FindHole(uint64_t min, uint64_t max, uint64_t size,
@@ -137,8 +156,29 @@ class AddressSpace : public Memory {
   // Check to see if a given program counter is a trace head.
   bool IsMarkedTraceHead(PC pc) const;
 
+  // Forget that the PCs in `pcs` are trace heads, in every address space.
+  // This is used when the lifted code of those traces is evicted, so that
+  // the decoder will decode them again the next time that they're needed.
+  static void UnmarkTraceHeads(const std::vector<PC> &pcs);
+
+  // Mark the read-only bytes `[addr, addr + size)` as having been folded into
+  // the lifted code of the trace at `trace_pc` as constants. This is done in
+  // every address space, as any of them can end up running that code. From
+  // then on, the code version of `trace_pc` in each address space covers the
+  // values of these bytes in that address space, and whether or not they are
+  // still read-only.
+  static void MarkAsFolded(PC trace_pc, uint64_t addr, size_t size);
+
   // Usefull for brk syscall, for more details see its implementation in `Runtime`.
   uint64_t InitialProgramBreak() const;
+
+  // Function that is invoked when code versioning is enabled, and the code in
+  // some address space has been modified, mapped, unmapped, or had its
+  // permissions changed. This lets the executor discard anything that it has
+  // derived from the old code, e.g. chained traces.
+  using CodeInvalidationCallback = void (*)(void);
+  static void SetCodeInvalidationCallback(CodeInvalidationCallback callback);
+
  private:
   AddressSpace(AddressSpace &&) = delete;
   AddressSpace &operator=(const AddressSpace &) = delete;
@@ -147,6 +187,16 @@ class AddressSpace : public Memory {
   // Recreate the `range_base_to_index` and `range_limit_to_index` indices.
   void CreatePageToRangeMap(void);
 
+  // Discard the trace heads of this address space, and tell the executor
+  // that the code that it has lifted might now be stale.
+  void InvalidateCode(void);
+
+  // Hash the current contents of `ranges`, the bytes folded into the trace
+  // at `trace_pc`.
+  uint64_t ComputeFoldedDataVersion(
+      uint64_t trace_pc,
+      const std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+
   // We do not want to expose the internal `MemoryMapPtr`.
   MemoryMapPtr CreateMap(uint64_t base, size_t size,
                          const char *name, uint64_t offset);
@@ -201,6 +251,17 @@ class AddressSpace : public Memory {
   // Set of lifted trace heads observed for this code version.
   std::unordered_set<uint64_t> trace_heads;
 
+  // Trace heads whose lifted code has constants folded in from each page,
+  // and the ranges of bytes folded into each trace head.
+  std::unordered_map<uint64_t, std::unordered_set<uint64_t>> page_to_folds;
+  std::unordered_map<uint64_t, std::vector<std::pair<uint64_t, uint64_t>>>
+      folded_ranges;
+
+  // Hashes of the current contents of the folded ranges of each trace head,
+  // which are mixed into the code versions of those trace heads. These are
+  // recomputed when any of their pages change.
+  std::unordered_map<uint64_t, uint64_t> folded_data_versions;
+
   // Is the address space dead? This means that all operations on it
   // will be muted.
   bool is_dead;
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "vmill/Program/AddressSpace.h"
+#include "vmill/Program/EntryPoints.h"
+
+namespace vmill {
+namespace {
+
+enum : uint8_t {
+  kElfClass32 = 1,
+  kElfClass64 = 2,
+  kElfDataLittleEndian = 1,
+
+  // `DW_EH_PE_datarel | DW_EH_PE_sdata4`, which is what linkers use for the
+  // binary search table of `.eh_frame_hdr`.
+  kEhFrameTableEncoding = 0x3b,
+  kEhFrameCountEncoding = 0x03  // `DW_EH_PE_udata4`.
+};
+
+enum : uint32_t {
+  kElfTypeDynamic = 3,
+  kSegmentLoad = 1,
+  kSegmentDynamic = 2,
+  kSegmentGnuEhFrame = 0x6474e550,
+  kSymbolTypeFunction = 2,
+
+  // Upper bounds on table sizes, in case the image is corrupted.
+  kMaxNumProgramHeaders = 256,
+  kMaxNumTableEntries = 1U << 22
+};
+
+enum : int64_t {
+  kDynamicNull = 0,
+  kDynamicHash = 4,
+  kDynamicSymbolTable = 6,
+  kDynamicInit = 12,
+  kDynamicFini = 13,
+  kDynamicInitArray = 25,
+  kDynamicFiniArray = 26,
+  kDynamicInitArraySize = 27,
+  kDynamicFiniArraySize = 28,
+  kDynamicGnuHash = 0x6ffffef5
+};
+
+template <typename Addr>
+struct ElfHeader {
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  Addr entry;
+  Addr program_header_offset;
+  Addr section_header_offset;
+  uint32_t flags;
+  uint16_t header_size;
+  uint16_t program_header_size;
+  uint16_t num_program_headers;
+  uint16_t section_header_size;
+  uint16_t num_section_headers;
+  uint16_t section_name_index;
+};
+
+// Layouts of the ELF structures that differ between 32- and 64-bit images.
+struct Elf32 {
+  using Addr = uint32_t;
+
+  struct ProgramHeader {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t file_size;
+    uint32_t mem_size;
+    uint32_t flags;
+    uint32_t align;
+  };
+
+  struct Symbol {
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t info;
+    uint8_t other;
+    uint16_t section_index;
+  };
+
+  struct Dynamic {
+    int32_t tag;
+    uint32_t value;
+  };
+};
+
+struct Elf64 {
+  using Addr = uint64_t;
+
+  struct ProgramHeader {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t file_size;
+    uint64_t mem_size;
+    uint64_t align;
+  };
+
+  struct Symbol {
+    uint32_t name;
+    uint8_t info;
+    uint8_t other;
+    uint16_t section_index;
+    uint64_t value;
+    uint64_t size;
+  };
+
+  struct Dynamic {
+    int64_t tag;
+    uint64_t value;
+  };
+};
+
+// Finds the code entry points of one ELF image, whose header is mapped at
+// `base`.
+template <typename T>
+class ElfScanner {
+ public:
+  using Addr = typename T::Addr;
+  using ProgramHeader = typename T::ProgramHeader;
+  using Symbol = typename T::Symbol;
+  using Dynamic = typename T::Dynamic;
+
+  ElfScanner(AddressSpace &memory_, uint64_t base_, std::vector<PC> &pcs_)
+      : memory(memory_),
+        base(base_),
+        pcs(pcs_) {}
+
+  void Scan(void) {
+    ElfHeader<Addr> header = {};
+    if (!Read(base, &header) ||
+        kElfDataLittleEndian != header.ident[5] ||
+        sizeof(ProgramHeader) != header.program_header_size ||
+        header.num_program_headers > kMaxNumProgramHeaders) {
+      return;
+    }
+
+    std::vector<ProgramHeader> segments(header.num_program_headers);
+    if (!memory.TryRead(base + header.program_header_offset, segments.data(),
+                        segments.size() * sizeof(ProgramHeader))) {
+      return;
+    }
+
+    // Position-independent images are loaded somewhere other than where
+    // they were linked.
+    if (kElfTypeDynamic == header.type) {
+      for (const auto &segment : segments) {
+        if (kSegmentLoad == segment.type && !segment.offset &&
+            segment.vaddr <= base) {
+          bias = base - segment.vaddr;
+          break;
+        }
+      }
+    }
+
+    if (header.entry) {
+      Add(bias + header.entry);
+    }
+
+    for (const auto &segment : segments) {
+      if (kSegmentGnuEhFrame == segment.type) {
+        ScanEhFrameHeader(bias + segment.vaddr);
+      } else if (kSegmentDynamic == segment.type) {
+        ScanDynamic(bias + segment.vaddr, segment.mem_size);
+      }
+    }
+  }
+
+ private:
+  template <typename V>
+  bool Read(uint64_t addr, V *val) {
+    return memory.TryRead(addr, val, sizeof(V));
+  }
+
+  void Add(uint64_t pc) {
+    if (pc) {
+      pcs.push_back(static_cast<PC>(pc));
+    }
+  }
+
+  // Pointers in the dynamic section are relocated by some loaders and not by
+  // others.
+  uint64_t Relocate(uint64_t addr) const {
+    return (bias && addr < bias) ? addr + bias : addr;
+  }
+
+  // Returns the size of a value in `.eh_frame_hdr` with the encoding
+  // `encoding`, or zero if it's unsupported.
+  static unsigned EncodedSize(uint8_t encoding) {
+    switch (encoding & 0x0F) {
+      case 0x00: return sizeof(Addr);
+      case 0x02: case 0x0A: return 2;
+      case 0x03: case 0x0B: return 4;
+      case 0x04: case 0x0C: return 8;
+      default: return 0;
+    }
+  }
+
+  // The binary search table in `.eh_frame_hdr` holds the address of every
+  // function that has unwind information.
+  void ScanEhFrameHeader(uint64_t addr) {
+    uint8_t encodings[4] = {};
+    if (!memory.TryRead(addr, encodings, sizeof(encodings)) ||
+        1 != encodings[0] ||
+        kEhFrameCountEncoding != encodings[2] ||
+        kEhFrameTableEncoding != encodings[3]) {
+      return;
+    }
+
+    const auto eh_frame_ptr_size = EncodedSize(encodings[1]);
+    if (!eh_frame_ptr_size) {
+      return;
+    }
+
+    const auto count_addr = addr + sizeof(encodings) + eh_frame_ptr_size;
+    uint32_t num_entries = 0;
+    if (!Read(count_addr, &num_entries)) {
+      return;
+    }
+
+    const auto table_addr = count_addr + sizeof(num_entries);
+    num_entries = std::min<uint32_t>(num_entries, kMaxNumTableEntries);
+    for (uint32_t i = 0; i < num_entries; ++i) {
+      int32_t entry[2] = {};  // Function address, FDE address.
+      if (!Read(table_addr + i * sizeof(entry), &entry)) {
+        break;
+      }
+      Add(addr + static_cast<uint64_t>(static_cast<int64_t>(entry[0])));
+    }
+  }
+
+  void ScanDynamic(uint64_t addr, uint64_t size) {
+    uint64_t symbol_table = 0;
+    uint64_t hash = 0;
+    uint64_t gnu_hash = 0;
+    uint64_t init_array = 0;
+    uint64_t init_array_size = 0;
+    uint64_t fini_array = 0;
+    uint64_t fini_array_size = 0;
+
+    const auto num_entries = std::min<uint64_t>(size / sizeof(Dynamic),
+                                                kMaxNumTableEntries);
+    for (uint64_t i = 0; i < num_entries; ++i) {
+      Dynamic entry = {};
+      if (!Read(addr + i * sizeof(Dynamic), &entry) ||
+          kDynamicNull == entry.tag) {
+        break;
+      }
+
+      const uint64_t value = entry.value;
+      switch (entry.tag) {
+        case kDynamicInit:
+        case kDynamicFini:
+          Add(Relocate(value));
+          break;
+        case kDynamicSymbolTable: symbol_table = Relocate(value); break;
+        case kDynamicHash: hash = Relocate(value); break;
+        case kDynamicGnuHash: gnu_hash = Relocate(value); break;
+        case kDynamicInitArray: init_array = Relocate(value); break;
+        case kDynamicInitArraySize: init_array_size = value; break;
+        case kDynamicFiniArray: fini_array = Relocate(value); break;
+        case kDynamicFiniArraySize: fini_array_size = value; break;
+        default: break;
+      }
+    }
+
+    ScanFunctionPointers(init_array, init_array_size);
+    ScanFunctionPointers(fini_array, fini_array_size);
+
+    if (symbol_table) {
+      uint32_t num_symbols = 0;
+      if (hash) {
+        Read(hash + sizeof(uint32_t), &num_symbols);  // `nchain`.
+      } else if (gnu_hash) {
+        num_symbols = CountGnuHashSymbols(gnu_hash);
+      }
+      ScanSymbols(symbol_table,
+                  std::min<uint32_t>(num_symbols, kMaxNumTableEntries));
+    }
+  }
+
+  void ScanFunctionPointers(uint64_t addr, uint64_t size) {
+    for (uint64_t i = 0; addr && i < size / sizeof(Addr); ++i) {
+      Addr func = 0;
+      if (!Read(addr + i * sizeof(Addr), &func)) {
+        break;
+      }
+      if (static_cast<Addr>(-1) != func) {
+        Add(Relocate(func));
+      }
+    }
+  }
+
+  // Only the GNU hash table knows how many symbols there are, by way of
+  // the longest hash chain of the highest bucket.
+  uint32_t CountGnuHashSymbols(uint64_t addr) {
+    uint32_t header[4] = {};  // Buckets, symbol offset, bloom size, shift.
+    if (!Read(addr, &header) || header[0] > kMaxNumTableEntries) {
+      return 0;
+    }
+
+    const auto buckets = addr + sizeof(header) + header[2] * sizeof(Addr);
+    uint32_t max_index = 0;
+    for (uint32_t i = 0; i < header[0]; ++i) {
+      uint32_t index = 0;
+      if (Read(buckets + i * sizeof(uint32_t), &index)) {
+        max_index = std::max(max_index, index);
+      }
+    }
+
+    if (max_index < header[1]) {
+      return header[1];
+    }
+
+    const auto chains = buckets + header[0] * sizeof(uint32_t);
+    for (auto i = max_index; i < kMaxNumTableEntries; ++i) {
+      uint32_t chain_hash = 0;
+      if (!Read(chains + (i - header[1]) * sizeof(uint32_t), &chain_hash) ||
+          (chain_hash & 1)) {
+        return i + 1;
+      }
+    }
+    return kMaxNumTableEntries;
+  }
+
+  void ScanSymbols(uint64_t addr, uint32_t num_symbols) {
+    for (uint32_t i = 0; i < num_symbols; ++i) {
+      Symbol symbol = {};
+      if (!Read(addr + i * sizeof(Symbol), &symbol)) {
+        break;
+      }
+      if (kSymbolTypeFunction == (symbol.info & 0x0F) &&
+          symbol.section_index && symbol.value) {
+        Add(bias + symbol.value);
+      }
+    }
+  }
+
+  AddressSpace &memory;
+  const uint64_t base;
+  std::vector<PC> &pcs;
+  uint64_t bias{0};
+};
+
+}  // namespace
+
+std::vector<PC> FindEntryPoints(AddressSpace &memory) {
+  std::vector<uint64_t> bases;
+  memory.ForEachRange([&bases] (uint64_t base, uint64_t) {
+    bases.push_back(base);
+  });
+
+  std::vector<PC> pcs;
+  for (auto base : bases) {
+    uint8_t ident[5] = {};
+    if (!memory.TryRead(base, ident, sizeof(ident)) ||
+        memcmp(ident, "\x7f" "ELF", 4)) {
+      continue;
+    }
+
+    if (kElfClass64 == ident[4]) {
+      ElfScanner<Elf64>(memory, base, pcs).Scan();
+    } else if (kElfClass32 == ident[4]) {
+      ElfScanner<Elf32>(memory, base, pcs).Scan();
+    }
+  }
+
+  std::sort(pcs.begin(), pcs.end());
+  pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+  pcs.erase(std::remove_if(pcs.begin(), pcs.end(), [&memory] (PC pc) {
+              return !memory.CanExecute(static_cast<uint64_t>(pc));
+            }),
+            pcs.end());
+
+  LOG(INFO)
+      << "Found " << pcs.size() << " code entry points in "
+      << bases.size() << " mapped ranges";
+
+  return pcs;
+}
+
+}  // namespace vmill
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_PROGRAM_ENTRYPOINTS_H_
+#define VMILL_PROGRAM_ENTRYPOINTS_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace vmill {
+
+class AddressSpace;
+enum class PC : uint64_t;
+
+// Returns the executable program counters of the entry point, initializers
+// and finalizers, exported functions, and functions with unwind information
+// of every ELF image mapped into `memory`. These are the places where the
+// decoder can start looking for code ahead of time.
+std::vector<PC> FindEntryPoints(AddressSpace &memory);
+
+}  // namespace vmill
+
+#endif  // VMILL_PROGRAM_ENTRYPOINTS_H_
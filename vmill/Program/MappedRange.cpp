@@ -317,7 +317,8 @@ void *EmptyMemoryMap::ToReadWriteVirtualAddress(uint64_t addr) {
   return self->ToReadWriteVirtualAddress(addr);
 }
 
-static const uint8_t kZeroes[512 / 8] = {};
+// Big enough that reads of up to a whole page can be served out of it.
+static const uint8_t kZeroes[kPageSize] = {};
 
 const void *EmptyMemoryMap::ToReadOnlyVirtualAddress(uint64_t addr) {
   return &(kZeroes[0]);
@@ -48,12 +48,33 @@
 
 extern "C" uint64_t __vmill_initial_heap_end(const void *, vmill::PC, vmill::AddressSpace *);
 
+namespace {
+
+// The register state of a task, along with the header that lifted code uses
+// to find the task from a pointer to its state.
+struct TaskState {
+  uint8_t reserved[vmill::kStateHeaderSize - vmill::kStateTaskPointerOffset];
+  vmill::Task *task;
+  State state;
+};
+
+static_assert(__builtin_offsetof(TaskState, state) == vmill::kStateHeaderSize,
+              "Invalid packing of `TaskState::state`.");
+
+static_assert(__builtin_offsetof(TaskState, task) ==
+                  vmill::kStateHeaderSize - vmill::kStateTaskPointerOffset,
+              "Invalid packing of `TaskState::task`.");
+
+}  // namespace
+
 // Initialize a task.
 static void __vmill_init_task(
     vmill::Task *task, const void *state, vmill::PC pc,
     vmill::AddressSpace *memory) {
 
-  task->state = new State;
+  auto task_state = new TaskState;
+  task_state->task = task;
+  task->state = &(task_state->state);
   task->pc = pc;
   task->status = vmill::kTaskStatusRunnable;
   task->status_on_resume = vmill::kTaskStatusRunnable;
@@ -69,6 +90,7 @@ static void __vmill_init_task(
 static void __vmill_fini_task(vmill::Task *task) {
   __vmill_free_coroutine(task->async_routine);
   task->async_routine = nullptr;
-  delete task->state;
+  delete reinterpret_cast<TaskState *>(
+      reinterpret_cast<uint8_t *>(task->state) - vmill::kStateHeaderSize);
   task->state = nullptr;
 }
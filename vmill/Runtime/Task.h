@@ -71,6 +71,15 @@ enum MemoryValueType : uint16_t {
   kMemoryValueTypeInstruction
 };
 
+enum : uint64_t {
+  // The runtime allocates the register state of each task at this many bytes
+  // into a block of memory. The bytes before the state are reserved for the
+  // runtime, and lifted code expects to find a pointer to the state's task at
+  // `kStateTaskPointerOffset` bytes before the state.
+  kStateHeaderSize = 64,
+  kStateTaskPointerOffset = 8
+};
+
 // A task is like a thread, but really, it's the runtime that gives a bit more
 // meaning to threads. The runtime has `resume`, `pause`, `stop`, and `schedule`
 // intrinsics. When
@@ -114,6 +123,10 @@ struct Task {
   // of a process not a thread.
   // We need this to implement brk system call. For more info see its implementation.
   uint64_t program_break = 0;
+
+  // Remaining number of trace entries and loop back-edges that this task can
+  // execute before lifted code preempts it. Only used with `--preempt_budget`.
+  int64_t preempt_budget;
 };
 
 }  // namespace vmill
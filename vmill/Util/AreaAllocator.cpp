@@ -17,6 +17,8 @@
 #include <glog/logging.h>
 
 #include <cerrno>
+#include <cstring>
+#include <iterator>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -57,19 +59,39 @@ const uint8_t kBreakPointBytes[] = {
 static void FillWithBreakPoints(uint8_t *base, uint8_t *limit) {
   while (base < limit) {
     for (auto b : kBreakPointBytes) {
+      if (base >= limit) {
+        return;
+      }
       *base++ = b;
     }
   }
 }
 
+// Give the physical pages wholly contained in `[base, limit)` back to the OS.
+// They read back as zeroes if they are touched again.
+static void ReleasePages(uint8_t *base, uint8_t *limit, uintptr_t page_size) {
+  const auto base_uint = reinterpret_cast<uintptr_t>(base);
+  const auto limit_uint = reinterpret_cast<uintptr_t>(limit);
+  const auto first_page = (base_uint + page_size - 1) & ~(page_size - 1);
+  const auto last_page = limit_uint & ~(page_size - 1);
+  if (first_page < last_page) {
+    madvise(reinterpret_cast<void *>(first_page), last_page - first_page,
+            MADV_DONTNEED);
+  }
+}
+
 }  // namespace
 
 AreaAllocator::AreaAllocator(AreaAllocationPerms perms,
                              uintptr_t preferred_base_,
-                             size_t page_size_)
+                             size_t page_size_,
+                             size_t max_size_,
+                             bool use_huge_pages_)
     : page_size(page_size_),
+      max_size(max_size_),
       preferred_base(reinterpret_cast<void *>(preferred_base_)),
       is_executable(kAreaRWX == perms),
+      use_huge_pages(use_huge_pages_ && MAP_HUGETLB && k2MiB == page_size_),
       base(nullptr),
       limit(nullptr),
       bump(nullptr),
@@ -83,8 +105,6 @@ AreaAllocator::AreaAllocator(AreaAllocationPerms perms,
       flags |= MAP_32BIT;
     }
   }
-
-  // TODO(pag): Try to support `MAP_HUGETLB | MAP_HUGE_2MB`.
 }
 
 AreaAllocator::~AreaAllocator(void) {
@@ -95,6 +115,136 @@ AreaAllocator::~AreaAllocator(void) {
 
 void AreaAllocator::FreeAll(void) {
   bump = base;
+  free_ranges.clear();
+}
+
+void AreaAllocator::Free(uint8_t *addr, size_t size) {
+  if (!size) {
+    return;
+  }
+
+  CHECK(base <= addr && (addr + size) <= bump)
+      << "Cannot free range [" << reinterpret_cast<void *>(addr) << ", "
+      << reinterpret_cast<void *>(addr + size)
+      << ") that was not allocated by this allocator";
+
+  if (is_executable) {
+    FillWithBreakPoints(addr, addr + size);
+  }
+
+  // Huge pages can only be given back whole.
+  static const auto small_page_size = static_cast<uintptr_t>(
+      sysconf(_SC_PAGESIZE));
+  ReleasePages(addr, addr + size,
+               use_huge_pages ? static_cast<uintptr_t>(k2MiB) : small_page_size);
+
+  auto next_it = free_ranges.lower_bound(addr);
+  if (next_it != free_ranges.end() && next_it->first == (addr + size)) {
+    size += next_it->second;
+    next_it = free_ranges.erase(next_it);
+  }
+
+  if (next_it != free_ranges.begin()) {
+    auto prev_it = std::prev(next_it);
+    if ((prev_it->first + prev_it->second) == addr) {
+      addr = prev_it->first;
+      size += prev_it->second;
+      free_ranges.erase(prev_it);
+    }
+  }
+
+  free_ranges[addr] = size;
+}
+
+// First-fit allocation out of the free list.
+uint8_t *AreaAllocator::AllocateFromFreeList(size_t size, size_t align) {
+  for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+    const auto range_begin = it->first;
+    const auto range_end = range_begin + it->second;
+
+    auto addr = range_begin;
+    auto addr_uint = reinterpret_cast<uintptr_t>(addr);
+    auto align_missing = align ? addr_uint % align : 0;
+    if (align_missing) {
+      addr += align - align_missing;
+    }
+
+    if ((addr + size) > range_end) {
+      continue;
+    }
+
+    free_ranges.erase(it);
+    if (range_begin < addr) {
+      free_ranges[range_begin] = static_cast<size_t>(addr - range_begin);
+    }
+    if ((addr + size) < range_end) {
+      free_ranges[addr + size] = static_cast<size_t>(range_end - addr - size);
+    }
+    return addr;
+  }
+  return nullptr;
+}
+
+void *AreaAllocator::Map(void *addr, size_t size, int extra_flags) {
+  if (use_huge_pages) {
+    auto ret = mmap(addr, size, prot,
+                    flags | extra_flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (MAP_FAILED != ret) {
+      return ret;
+    }
+
+    // There are no more reserved huge pages (see `/proc/sys/vm/nr_hugepages`),
+    // so fall back to asking for transparent huge pages.
+    LOG(WARNING)
+        << "Cannot map " << size << " bytes of explicit huge pages at "
+        << addr << ": " << strerror(errno);
+    use_huge_pages = false;
+  }
+
+  auto ret = mmap(addr, size, prot, flags | extra_flags, -1, 0);
+  auto err = errno;
+  LOG_IF(FATAL, MAP_FAILED == ret)
+      << "Cannot map memory for allocator: " << strerror(err);
+
+#ifdef MADV_HUGEPAGE
+  madvise(ret, size, MADV_HUGEPAGE);
+#endif
+
+  return ret;
+}
+
+bool AreaAllocator::MapFile(uint8_t *addr, size_t size, int fd,
+                            uint64_t offset) {
+  CHECK(base <= addr && (addr + size) <= bump)
+      << "Cannot map file over range [" << reinterpret_cast<void *>(addr)
+      << ", " << reinterpret_cast<void *>(addr + size)
+      << ") that was not allocated by this allocator";
+
+  // Part of a huge page can't be replaced.
+  static const auto small_page_size = static_cast<uintptr_t>(
+      sysconf(_SC_PAGESIZE));
+  const auto addr_uint = reinterpret_cast<uintptr_t>(addr);
+  if (use_huge_pages || (addr_uint % small_page_size) ||
+      (size % small_page_size) || (offset % small_page_size)) {
+    return false;
+  }
+
+  auto ret = mmap(addr, size, prot, MAP_PRIVATE | MAP_FIXED, fd,
+                  static_cast<off_t>(offset));
+  if (MAP_FAILED != ret) {
+    return true;
+  }
+
+  LOG(ERROR)
+      << "Cannot map file into allocator at " << reinterpret_cast<void *>(addr)
+      << ": " << strerror(errno);
+
+  // A failed fixed mapping might have unmapped what was already there.
+  Map(addr, size, MAP_FIXED);
+  if (is_executable) {
+    FillWithBreakPoints(addr, addr + size);
+  }
+  return false;
 }
 
 uint8_t *AreaAllocator::Allocate(size_t size, size_t align) {
@@ -106,19 +256,15 @@ uint8_t *AreaAllocator::Allocate(size_t size, size_t align) {
       alloc_size = (size + (page_size - 1UL)) & ~(page_size - 1UL);
     }
 
-    auto ret = mmap(preferred_base, alloc_size, prot, flags, -1, 0);
-    auto err = errno;
-    LOG_IF(FATAL, MAP_FAILED == ret)
-        << "Cannot map memory for allocator: " << strerror(err);
+    LOG_IF(FATAL, max_size && alloc_size > max_size)
+        << "Cannot allocate " << size << " bytes from an area of at most "
+        << max_size << " bytes";
 
+    auto ret = Map(preferred_base, alloc_size, 0);
     LOG_IF(ERROR, preferred_base && ret != preferred_base)
         << "Cannot map memory at preferred base of " << preferred_base
         << "; got " << ret << " instead";
 
-#ifdef MADV_HUGEPAGE
-    madvise(ret, alloc_size, MADV_HUGEPAGE);
-#endif
-
     base = reinterpret_cast<uint8_t *>(ret);
     bump = base;
     limit = base + alloc_size;
@@ -128,6 +274,12 @@ uint8_t *AreaAllocator::Allocate(size_t size, size_t align) {
     }
   }
 
+  if (size && !free_ranges.empty()) {
+    if (auto addr = AllocateFromFreeList(size, align)) {
+      return addr;
+    }
+  }
+
   // Align the bump pointer for our allocation.
   auto bump_uint = reinterpret_cast<uintptr_t>(bump);
   auto align_missing = align ? bump_uint % align : 0;
@@ -141,15 +293,14 @@ uint8_t *AreaAllocator::Allocate(size_t size, size_t align) {
     if (!alloc_size) {
       alloc_size = page_size;
     }
-    auto ret = mmap(limit, alloc_size, prot, flags | MAP_FIXED, -1, 0);
-    auto err = errno;
-    LOG_IF(FATAL, MAP_FAILED == ret)
-        << "Cannot map memory for allocator: " << strerror(err);
 
-#ifdef MADV_HUGEPAGE
-    madvise(ret, alloc_size, MADV_HUGEPAGE);
-#endif
+    // Growing any further would map over whatever comes after this area.
+    LOG_IF(FATAL, max_size &&
+                  static_cast<size_t>(limit - base) + alloc_size > max_size)
+        << "Allocator area at " << reinterpret_cast<void *>(base)
+        << " is full; it can be at most " << max_size << " bytes";
 
+    auto ret = Map(limit, alloc_size, MAP_FIXED);
     auto ret_bytes = reinterpret_cast<uint8_t *>(ret);
     LOG_IF(FATAL, ret_bytes != limit)
         << "Cannot allocate contiguous memory for allocator.";
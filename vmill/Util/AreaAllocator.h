@@ -18,6 +18,7 @@
 #define VMILL_UTIL_AREAALLOCATOR_H_
 
 #include <cstdint>
+#include <map>
 #include <new>
 
 namespace vmill {
@@ -34,7 +35,8 @@ enum AreaPreferences : uint64_t {
   kAreaBase = 0ULL,
 #endif
   kAreaCodeCacheCode    = 0x80000000ULL + kAreaBase,  // 2 GiB.
-  kAreaCodeCacheData    = 0xC0000000ULL + kAreaBase,  // 3 GiB.
+  kAreaCodeCacheHotCode = 0xC0000000ULL + kAreaBase,  // 3 GiB.
+  kAreaCodeCacheData    = 0xE0000000ULL + kAreaBase,  // 3.5 GiB.
   kAreaCodeCacheIndex   = 0x10000000000ULL + kAreaBase,
   kAreaAddressSpace     = 0x20000000000ULL + kAreaBase,
   kAreaCoroutineStacks  = 0x30000000000ULL + kAreaBase,
@@ -42,14 +44,23 @@ enum AreaPreferences : uint64_t {
 };
 
 enum : size_t {
-  k2MiB = 2097152ULL
+  k2MiB = 2097152ULL,
+  k512MiB = 536870912ULL,
+  k1GiB = 1073741824ULL
 };
 
-// Bump-pointer allocator for a contiguous region of memory.
+// Bump-pointer allocator for a contiguous region of memory. Freed ranges are
+// kept on a free list, and are reused by later allocations that fit.
+//
+// If `max_size_` is non-zero, then the region will never grow past that many
+// bytes, so that it can't run into whatever is mapped after it. If
+// `use_huge_pages_` is `true`, then the region is backed by explicit huge
+// pages when the OS has any to spare.
 class AreaAllocator {
  public:
   AreaAllocator(AreaAllocationPerms perms, uintptr_t preferred_base_=0,
-                size_t page_size_=k2MiB);
+                size_t page_size_=k2MiB, size_t max_size_=0,
+                bool use_huge_pages_=false);
   ~AreaAllocator(void);
 
   template <typename T, typename... Args>
@@ -59,6 +70,10 @@ class AreaAllocator {
 
   uint8_t *Allocate(size_t size, size_t align=0);
 
+  // Return the `size` bytes at `addr` to the allocator. The physical pages
+  // wholly inside of the freed range are given back to the OS.
+  void Free(uint8_t *addr, size_t size);
+
   template <typename T>
   inline bool Contains(T *addr_) const {
     auto addr = reinterpret_cast<uint8_t *>(addr_);
@@ -67,18 +82,50 @@ class AreaAllocator {
 
   void FreeAll(void);
 
+  // Returns the address at which the next bump allocation would begin,
+  // ignoring alignment and the free list.
+  inline uint8_t *End(void) const {
+    return base ? bump : reinterpret_cast<uint8_t *>(preferred_base);
+  }
+
+  // Replace the already allocated memory `[addr, addr + size)` with a private
+  // mapping of the `size` bytes at `offset` in the file `fd`. The pages are
+  // shared with every other process that maps the same file until they are
+  // written to. Returns `false`, leaving the memory as if it had just been
+  // allocated, if the file can't be mapped there.
+  bool MapFile(uint8_t *addr, size_t size, int fd, uint64_t offset);
+
+  // Invokes `cb(addr, size)` on every free range.
+  template <typename F>
+  void ForEachFreeRange(F cb) const {
+    for (const auto &range : free_ranges) {
+      cb(range.first, range.second);
+    }
+  }
+
  private:
   AreaAllocator(void) = delete;
   AreaAllocator(const AreaAllocator &) = delete;
 
+  uint8_t *AllocateFromFreeList(size_t size, size_t align);
+
+  // Map `size` bytes of memory at `addr`.
+  void *Map(void *addr, size_t size, int extra_flags);
+
   size_t page_size;
+  size_t max_size;
   void *preferred_base;
   bool is_executable;
+  bool use_huge_pages;
   uint8_t *base;
   uint8_t *limit;
   uint8_t *bump;
   int prot;
   int flags;
+
+  // Maps the beginning of each free range to its size. Adjacent free ranges
+  // are always coalesced.
+  std::map<uint8_t *, size_t> free_ranges;
 };
 
 }  // namespace vmill
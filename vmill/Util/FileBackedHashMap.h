@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_UTIL_FILEBACKEDHASHMAP_H_
+#define VMILL_UTIL_FILEBACKEDHASHMAP_H_
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "vmill/Util/Hash.h"
+
+namespace vmill {
+
+// A persistent hash map, stored in a memory-mapped file as an open-addressing
+// table with linear probing. Lookups read the mapped file directly, so opening
+// a map costs the same no matter how big it is.
+//
+// Inserts are batched in memory and written out by `Sync`. Each slot in the
+// file holds a checksum of its contents, so a slot torn by a crash reads as
+// garbage to be skipped rather than as a wrong entry. Erased slots are left
+// as such garbage until the next rebuild. When the table gets too full, it is
+// rebuilt into a new, bigger file, which then atomically replaces the old
+// one. Entries that `keep` rejects are dropped by rebuilds. Where a slot lives
+// depends on the hash function `H`, so a table written with a different hash
+// function (or slot format) is rebuilt when it's opened.
+//
+// Several processes can share one map. Every change to the file is made while
+// holding an exclusive `flock` on `<path>.lock`, after first re-mapping the
+// file if another process has rebuilt it in the meantime.
+template <typename K, typename V, typename H=std::hash<K>>
+class FileBackedHashMap {
+ public:
+  using KeepFunc = std::function<bool(const K &, const V &)>;
+
+  enum : uint64_t {
+    kMagic = 0x50414d4853414856ULL,  // `VHASHMAP`.
+
+    // Bump this when the slot format, or how slots are placed, changes.
+    kFormatVersion = 1,
+
+    kMinCapacity = 4096,
+    kMaxPendingInserts = 256,
+
+    // Checksum of an erased slot. Real checksums are always odd.
+    kErasedChecksum = 2
+  };
+
+  ~FileBackedHashMap(void);
+
+  static std::unique_ptr<FileBackedHashMap<K, V, H>>
+  Open(const std::string &path, KeepFunc keep=nullptr);
+
+  // Returns `true` and fills in `value` if `key` is in the map.
+  bool Find(const K &key, V *value) const;
+
+  // Associate `value` with `key`. This is written to the file by the next
+  // `Sync`.
+  void Insert(const K &key, const V &value);
+
+  // Remove `key` from the map. Unlike inserts, this is applied to the file
+  // right away.
+  void Erase(const K &key);
+
+  // Write all pending inserts into the file, and flush it to disk.
+  void Sync(void);
+
+  // Invokes `cb(key, value)` on every entry in the map, in no particular
+  // order.
+  template <typename F>
+  void ForEach(F cb) const {
+    for (const auto &entry : pending) {
+      cb(entry.first, entry.second);
+    }
+    for (uint64_t i = 0; i <= mask; ++i) {
+      const auto &slot = slots[i];
+      if (slot.checksum && slot.checksum == Checksum(slot) &&
+          !pending.count(slot.key)) {
+        cb(slot.key, slot.value);
+      }
+    }
+  }
+
+  // Number of entries in the map. This can over-count entries that are
+  // overwritten by pending inserts.
+  inline size_t Size(void) const {
+    return static_cast<size_t>(header->size) + pending.size();
+  }
+
+ private:
+  struct Header {
+    uint64_t magic;
+    uint64_t slot_size;
+    uint64_t capacity;
+    uint64_t size;
+
+    // Identifies the format of the table, and the hash function that placed
+    // its slots.
+    uint64_t hash_version;
+  };
+
+  struct Slot {
+    K key;
+    V value;
+    uint64_t checksum;
+  };
+
+  FileBackedHashMap(const std::string &path_, KeepFunc keep_);
+
+  // Returns the checksum of `slot`. A zero checksum marks an empty slot.
+  static uint64_t Checksum(const Slot &slot);
+
+  // Returns a fingerprint of `kFormatVersion` and of `H`. This changes if the
+  // hash function changes, even if nobody remembers to bump the version.
+  static uint64_t HashVersion(void);
+
+  // Map a table with `capacity` slots into a new file at `file_path`.
+  bool Create(const std::string &file_path, uint64_t capacity);
+
+  // Map the existing table in the file at `path`. Returns `false` if the
+  // file doesn't hold a valid table.
+  bool Map(void);
+
+  void Unmap(void);
+
+  // Lock the map against changes by other processes, and map the latest
+  // version of its file, creating or rehashing it as needed.
+  void Lock(void);
+  void Unlock(void);
+
+  // Write `key` and `value` into the table. Returns `false` if the table
+  // has no room.
+  bool Store(const K &key, const V &value);
+
+  // Rebuild the table with room for at least `min_size` entries, dropping
+  // any entries that `keep` rejects.
+  void Rebuild(uint64_t min_size);
+
+  const std::string path;
+  const KeepFunc keep;
+  int lock_fd{-1};
+  int fd{-1};
+  size_t mapped_size{0};
+  Header *header{nullptr};
+  Slot *slots{nullptr};
+  uint64_t mask{0};
+  std::unordered_map<K, V, H> pending;
+};
+
+template <typename K, typename V, typename H>
+FileBackedHashMap<K, V, H>::FileBackedHashMap(const std::string &path_,
+                                              KeepFunc keep_)
+    : path(path_),
+      keep(std::move(keep_)) {
+  const auto lock_path = path + ".lock";
+  lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  CHECK(-1 != lock_fd)
+      << "Unable to open lock file " << lock_path << ": " << strerror(errno);
+}
+
+template <typename K, typename V, typename H>
+FileBackedHashMap<K, V, H>::~FileBackedHashMap(void) {
+  Sync();
+  Unmap();
+  close(lock_fd);
+}
+
+template <typename K, typename V, typename H>
+std::unique_ptr<FileBackedHashMap<K, V, H>>
+FileBackedHashMap<K, V, H>::Open(const std::string &path, KeepFunc keep) {
+  std::unique_ptr<FileBackedHashMap<K, V, H>> map(
+      new FileBackedHashMap<K, V, H>(path, std::move(keep)));
+
+  map->Lock();
+  map->Unlock();
+
+  DLOG(INFO)
+      << "Opened file-backed hash map " << path << " with "
+      << map->header->size << " entries";
+  return map;
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Lock(void) {
+  CHECK(!flock(lock_fd, LOCK_EX))
+      << "Unable to lock file-backed hash map " << path << ": "
+      << strerror(errno);
+
+  // Another process might have rebuilt the table into a new file.
+  struct stat path_info = {};
+  struct stat fd_info = {};
+  if (header && (stat(path.c_str(), &path_info) || fstat(fd, &fd_info) ||
+                 path_info.st_dev != fd_info.st_dev ||
+                 path_info.st_ino != fd_info.st_ino)) {
+    Unmap();
+  }
+
+  if (header) {
+    return;
+
+  } else if (!Map()) {
+    LOG(INFO)
+        << "Creating new file-backed hash map " << path;
+    CHECK(Create(path, kMinCapacity))
+        << "Unable to create file-backed hash map " << path << ": "
+        << strerror(errno);
+
+  // The checksums of slots don't depend on `H`, so the entries can still be
+  // recovered and placed where the current hash function expects them.
+  } else if (HashVersion() != header->hash_version) {
+    LOG(INFO)
+        << "Rehashing file-backed hash map " << path;
+    Rebuild(header->size);
+  }
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Unlock(void) {
+  flock(lock_fd, LOCK_UN);
+}
+
+template <typename K, typename V, typename H>
+uint64_t FileBackedHashMap<K, V, H>::Checksum(const Slot &slot) {
+  return Hash(&slot, offsetof(Slot, checksum)) | 1ULL;
+}
+
+template <typename K, typename V, typename H>
+uint64_t FileBackedHashMap<K, V, H>::HashVersion(void) {
+  Hasher<uint64_t> hasher(kFormatVersion);
+  for (unsigned i = 1; i <= 4; ++i) {
+
+    // Every byte of a probe differs, so that hash functions that only
+    // reorder the bytes of keys are told apart.
+    K probe;
+    auto probe_bytes = reinterpret_cast<uint8_t *>(&probe);
+    for (size_t j = 0; j < sizeof(probe); ++j) {
+      probe_bytes[j] = static_cast<uint8_t>(i * 0x5b + j * 0x3d);
+    }
+    const auto probe_hash = static_cast<uint64_t>(H()(probe));
+    hasher.Update(&probe_hash, sizeof(probe_hash));
+  }
+  return hasher.Digest();
+}
+
+template <typename K, typename V, typename H>
+bool FileBackedHashMap<K, V, H>::Create(const std::string &file_path,
+                                        uint64_t capacity) {
+  const auto size = sizeof(Header) + capacity * sizeof(Slot);
+  auto new_fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0666);
+  if (-1 == new_fd) {
+    return false;
+  }
+
+  if (ftruncate(new_fd, static_cast<off_t>(size))) {
+    close(new_fd);
+    return false;
+  }
+
+  auto addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FILE, new_fd, 0);
+  if (MAP_FAILED == addr) {
+    close(new_fd);
+    return false;
+  }
+
+  Unmap();
+  fd = new_fd;
+  mapped_size = size;
+  header = reinterpret_cast<Header *>(addr);
+  slots = reinterpret_cast<Slot *>(&(header[1]));
+  mask = capacity - 1;
+
+  header->slot_size = sizeof(Slot);
+  header->capacity = capacity;
+  header->size = 0;
+  header->hash_version = HashVersion();
+  header->magic = kMagic;
+  return true;
+}
+
+template <typename K, typename V, typename H>
+bool FileBackedHashMap<K, V, H>::Map(void) {
+  auto new_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (-1 == new_fd) {
+    return false;
+  }
+
+  struct stat info = {};
+  Header file_header = {};
+  if (fstat(new_fd, &info) ||
+      static_cast<size_t>(info.st_size) < sizeof(Header) ||
+      static_cast<ssize_t>(sizeof(Header)) !=
+          pread(new_fd, &file_header, sizeof(Header), 0) ||
+      kMagic != file_header.magic ||
+      sizeof(Slot) != file_header.slot_size ||
+      !file_header.capacity ||
+      (file_header.capacity & (file_header.capacity - 1)) ||
+      static_cast<uint64_t>(info.st_size) !=
+          sizeof(Header) + file_header.capacity * sizeof(Slot)) {
+    LOG_IF(WARNING, info.st_size)
+        << "Ignoring invalid file-backed hash map " << path;
+    close(new_fd);
+    return false;
+  }
+
+  const auto size = static_cast<size_t>(info.st_size);
+  auto addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FILE, new_fd, 0);
+  if (MAP_FAILED == addr) {
+    LOG(ERROR)
+        << "Unable to map file-backed hash map " << path << ": "
+        << strerror(errno);
+    close(new_fd);
+    return false;
+  }
+
+  fd = new_fd;
+  mapped_size = size;
+  header = reinterpret_cast<Header *>(addr);
+  slots = reinterpret_cast<Slot *>(&(header[1]));
+  mask = header->capacity - 1;
+  return true;
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Unmap(void) {
+  if (header) {
+    munmap(header, mapped_size);
+    header = nullptr;
+    slots = nullptr;
+  }
+  if (-1 != fd) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+template <typename K, typename V, typename H>
+bool FileBackedHashMap<K, V, H>::Find(const K &key, V *value) const {
+  auto pending_it = pending.find(key);
+  if (pending_it != pending.end()) {
+    *value = pending_it->second;
+    return true;
+  }
+
+  auto i = static_cast<uint64_t>(H()(key));
+  for (auto probes = 0ULL; probes <= mask; ++probes, ++i) {
+    const auto &slot = slots[i & mask];
+    if (!slot.checksum) {
+      return false;
+    } else if (slot.key == key && slot.checksum == Checksum(slot)) {
+      *value = slot.value;
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Insert(const K &key, const V &value) {
+  V old_value;
+  if (Find(key, &old_value) && old_value == value) {
+    return;
+  }
+
+  pending[key] = value;
+  if (pending.size() >= kMaxPendingInserts) {
+    Sync();
+  }
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Erase(const K &key) {
+  pending.erase(key);
+
+  // The slot stays occupied, so that probing for the keys after it still
+  // works, but its checksum no longer matches.
+  Lock();
+  auto i = static_cast<uint64_t>(H()(key));
+  for (auto probes = 0ULL; probes <= mask; ++probes, ++i) {
+    auto &slot = slots[i & mask];
+    if (!slot.checksum) {
+      break;
+    } else if (slot.key == key && slot.checksum == Checksum(slot)) {
+      slot.checksum = kErasedChecksum;
+      break;
+    }
+  }
+  Unlock();
+}
+
+template <typename K, typename V, typename H>
+bool FileBackedHashMap<K, V, H>::Store(const K &key, const V &value) {
+  Slot new_slot;
+  memset(&new_slot, 0, sizeof(new_slot));
+  new_slot.key = key;
+  new_slot.value = value;
+  new_slot.checksum = Checksum(new_slot);
+
+  auto i = static_cast<uint64_t>(H()(key));
+  for (auto probes = 0ULL; probes <= mask; ++probes, ++i) {
+    auto &slot = slots[i & mask];
+    if (!slot.checksum) {
+      header->size += 1;
+    } else if (!(slot.key == key && slot.checksum == Checksum(slot))) {
+      continue;
+    }
+    memcpy(&slot, &new_slot, sizeof(new_slot));
+    return true;
+  }
+  return false;
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Sync(void) {
+  if (!pending.empty()) {
+    Lock();
+    if ((header->size + pending.size()) * 2 > header->capacity) {
+      Rebuild(header->size + pending.size());
+    }
+
+    for (const auto &entry : pending) {
+      if (!Store(entry.first, entry.second)) {
+        Rebuild(header->size + pending.size());
+        CHECK(Store(entry.first, entry.second))
+            << "Unable to insert into file-backed hash map " << path;
+      }
+    }
+    pending.clear();
+    Unlock();
+  }
+  msync(header, mapped_size, MS_SYNC);
+}
+
+template <typename K, typename V, typename H>
+void FileBackedHashMap<K, V, H>::Rebuild(uint64_t min_size) {
+  const auto old_header = header;
+  const auto old_slots = slots;
+  const auto old_capacity = mask + 1;
+  const auto old_fd = fd;
+  const auto old_mapped_size = mapped_size;
+
+  // Only count the entries that will survive, so that compacting can also
+  // shrink the table.
+  uint64_t num_kept = 0;
+  for (uint64_t i = 0; i < old_capacity; ++i) {
+    const auto &slot = old_slots[i];
+    if (slot.checksum && slot.checksum == Checksum(slot) &&
+        (!keep || keep(slot.key, slot.value))) {
+      ++num_kept;
+    }
+  }
+
+  uint64_t capacity = kMinCapacity;
+  while (capacity < (std::max(num_kept, min_size) * 2)) {
+    capacity *= 2;
+  }
+
+  // Detach the old mapping, so that `Create` doesn't unmap it.
+  header = nullptr;
+  slots = nullptr;
+  fd = -1;
+
+  // Every process gets its own temporary file, even though rebuilds only
+  // happen while the map is locked.
+  const auto temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+  if (!Create(temp_path, capacity)) {
+    LOG(FATAL)
+        << "Unable to rebuild file-backed hash map " << path << ": "
+        << strerror(errno);
+  }
+
+  for (uint64_t i = 0; i < old_capacity; ++i) {
+    const auto &slot = old_slots[i];
+    if (slot.checksum && slot.checksum == Checksum(slot) &&
+        (!keep || keep(slot.key, slot.value))) {
+      CHECK(Store(slot.key, slot.value));
+    }
+  }
+
+  // The old table stays valid on disk until the new one is complete.
+  msync(header, mapped_size, MS_SYNC);
+  CHECK(!rename(temp_path.c_str(), path.c_str()))
+      << "Unable to replace file-backed hash map " << path << ": "
+      << strerror(errno);
+
+  munmap(old_header, old_mapped_size);
+  close(old_fd);
+
+  DLOG(INFO)
+      << "Rebuilt file-backed hash map " << path << " with " << num_kept
+      << " entries and " << capacity << " slots";
+}
+
+}  // namespace vmill
+
+#endif  // VMILL_UTIL_FILEBACKEDHASHMAP_H_
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_UTIL_FLATMAP_H_
+#define VMILL_UTIL_FLATMAP_H_
+
+#include <glog/logging.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "vmill/Util/Compiler.h"
+
+namespace vmill {
+
+// An open-addressing hash table with a power-of-two number of slots and
+// linear probing. Keys and values live inline in one flat array, so a lookup
+// usually touches a single cache line. Slots whose value is `V()` (e.g.
+// `nullptr`) are empty, and so `V()` cannot itself be stored in the map.
+template <typename K, typename V, typename H=std::hash<K>>
+class FlatMap {
+ public:
+  struct Entry {
+    K key;
+    V value;
+  };
+
+  explicit FlatMap(size_t min_capacity=64)
+      : mask(0),
+        size(0) {
+    size_t capacity = 16;
+    while (capacity < min_capacity) {
+      capacity *= 2;
+    }
+    entries.resize(capacity);
+    mask = capacity - 1;
+  }
+
+  // Returns the value associated with `key`, or `V()` if there is none.
+  ALWAYS_INLINE V Find(const K &key) const {
+    for (auto i = Hash(key); ; ++i) {
+      const auto &entry = entries[i & mask];
+      if (entry.value == V()) {
+        return V();
+      } else if (entry.key == key) {
+        return entry.value;
+      }
+    }
+  }
+
+  // Associates `value` with `key`, replacing any existing value.
+  void Insert(const K &key, V value) {
+    CHECK(value != V())
+        << "Cannot insert an empty value into a flat map.";
+
+    if (unlikely((size + 1) * 2 > entries.size())) {
+      Grow();
+    }
+
+    for (auto i = Hash(key); ; ++i) {
+      auto &entry = entries[i & mask];
+      if (entry.value == V()) {
+        entry.key = key;
+        entry.value = value;
+        ++size;
+        return;
+      } else if (entry.key == key) {
+        entry.value = value;
+        return;
+      }
+    }
+  }
+
+  // Removes `key` from the map. Returns `true` if it was present. Instead of
+  // leaving a tombstone, later entries in the same probe sequence are shifted
+  // back into the hole, so lookups never have to skip over deleted slots.
+  bool Erase(const K &key) {
+    auto i = Hash(key) & mask;
+    for (; ; i = (i + 1) & mask) {
+      const auto &entry = entries[i];
+      if (entry.value == V()) {
+        return false;
+      } else if (entry.key == key) {
+        break;
+      }
+    }
+
+    for (auto j = (i + 1) & mask; ; j = (j + 1) & mask) {
+      auto &entry = entries[j];
+      if (entry.value == V()) {
+        break;
+      }
+
+      // Only move `entry` into the hole at `i` if its home slot is not in
+      // the (cyclic) range `(i, j]`.
+      const auto home = Hash(entry.key) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        entries[i] = entry;
+        i = j;
+      }
+    }
+
+    entries[i].key = K();
+    entries[i].value = V();
+    --size;
+    return true;
+  }
+
+  // Removes all entries, but keeps the current capacity.
+  void Clear(void) {
+    for (auto &entry : entries) {
+      entry.key = K();
+      entry.value = V();
+    }
+    size = 0;
+  }
+
+  // Invokes `cb(key, value)` on every entry in the map.
+  template <typename F>
+  void ForEach(F cb) const {
+    for (const auto &entry : entries) {
+      if (entry.value != V()) {
+        cb(entry.key, entry.value);
+      }
+    }
+  }
+
+  inline size_t Size(void) const {
+    return size;
+  }
+
+ private:
+  ALWAYS_INLINE size_t Hash(const K &key) const {
+    return static_cast<size_t>(H()(key));
+  }
+
+  void Grow(void) {
+    std::vector<Entry> old_entries(entries.size() * 2);
+    old_entries.swap(entries);
+    mask = entries.size() - 1;
+    size = 0;
+    for (const auto &entry : old_entries) {
+      if (entry.value != V()) {
+        Insert(entry.key, entry.value);
+      }
+    }
+  }
+
+  std::vector<Entry> entries;
+  size_t mask;
+  size_t size;
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_UTIL_FLATMAP_H_
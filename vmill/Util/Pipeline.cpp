@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include "vmill/Util/Pipeline.h"
+
+namespace vmill {
+namespace {
+
+static double ToMilliseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+}  // namespace
+
+PipelineStage::PipelineStage(const char *name_, size_t num_threads,
+                             size_t max_queued_)
+    : name(name_),
+      max_queued(std::max<size_t>(1, max_queued_)),
+      pool(std::max<size_t>(1, num_threads)) {}
+
+void PipelineStage::Finished(Clock::time_point enqueue_time,
+                             Clock::time_point start_time) {
+  const auto end_time = Clock::now();
+  do {
+    std::lock_guard<std::mutex> locker(lock);
+    --num_queued;
+    ++num_finished;
+    total_wait_time += start_time - enqueue_time;
+    total_run_time += end_time - start_time;
+    max_latency = std::max(max_latency, end_time - enqueue_time);
+  } while (false);
+  not_full.notify_one();
+}
+
+void PipelineStage::LogStats(void) {
+  std::lock_guard<std::mutex> locker(lock);
+  if (!num_finished) {
+    return;
+  }
+
+  LOG(INFO)
+      << "Pipeline stage " << name << " finished " << num_finished
+      << " work items; max queue depth " << max_num_queued
+      << ", average wait " << (ToMilliseconds(total_wait_time) / num_finished)
+      << "ms, average run " << (ToMilliseconds(total_run_time) / num_finished)
+      << "ms, max latency " << ToMilliseconds(max_latency) << "ms";
+}
+
+}  // namespace vmill
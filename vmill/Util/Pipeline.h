@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_UTIL_PIPELINE_H_
+#define VMILL_UTIL_PIPELINE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "third_party/ThreadPool/ThreadPool.h"
+
+namespace vmill {
+
+// One stage of a pipeline, backed by its own pool of worker threads. At most
+// `max_queued` work items can be waiting on or running in the stage at once,
+// and `Submit` blocks until there is room. This applies back-pressure to the
+// previous stage, so that a fast stage can't run arbitrarily far ahead of a
+// slow one.
+class PipelineStage {
+ public:
+  PipelineStage(const char *name_, size_t num_threads, size_t max_queued_);
+
+  // Enqueue `func` to run on this stage's workers, and return a future of
+  // its (non-`void`) result.
+  template <typename F>
+  auto Submit(F func) -> std::future<decltype(func())> {
+    const auto enqueue_time = Clock::now();
+    do {
+      std::unique_lock<std::mutex> locker(lock);
+      not_full.wait(locker, [this] (void) {
+        return num_queued < max_queued;
+      });
+      ++num_queued;
+      if (num_queued > max_num_queued) {
+        max_num_queued = num_queued;
+      }
+    } while (false);
+
+    return pool.Submit([this, enqueue_time, func] (void) mutable {
+      const FinishedGuard guard(this, enqueue_time);
+      return func();
+    });
+  }
+
+  // Log the queue depth and latency counters of this stage.
+  void LogStats(void);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  PipelineStage(void) = delete;
+
+  // Record that a work item enqueued at `enqueue_time`, which began running
+  // at `start_time`, has finished.
+  void Finished(Clock::time_point enqueue_time, Clock::time_point start_time);
+
+  // Calls `Finished` when a work item is done running, even if it throws,
+  // so that the item's slot in the queue is always given back.
+  class FinishedGuard {
+   public:
+    FinishedGuard(PipelineStage *stage_, Clock::time_point enqueue_time_)
+        : stage(stage_),
+          enqueue_time(enqueue_time_),
+          start_time(Clock::now()) {}
+
+    ~FinishedGuard(void) {
+      stage->Finished(enqueue_time, start_time);
+    }
+
+   private:
+    FinishedGuard(const FinishedGuard &) = delete;
+    FinishedGuard &operator=(const FinishedGuard &) = delete;
+
+    PipelineStage * const stage;
+    const Clock::time_point enqueue_time;
+    const Clock::time_point start_time;
+  };
+
+  const std::string name;
+  const size_t max_queued;
+
+  ThreadPool pool;
+
+  std::mutex lock;
+  std::condition_variable not_full;
+
+  // Number of work items that are waiting or running right now.
+  size_t num_queued{0};
+
+  // Statistics.
+  size_t max_num_queued{0};
+  uint64_t num_finished{0};
+  Clock::duration total_wait_time{0};
+  Clock::duration total_run_time{0};
+  Clock::duration max_latency{0};
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_UTIL_PIPELINE_H_
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vmill/Util/Hash.h"
+#include "vmill/Workspace/BitcodeArchive.h"
+
+namespace vmill {
+namespace {
+
+static uint64_t ChecksumModule(const char *name, size_t name_size,
+                               const char *bitcode, size_t bitcode_size) {
+  Hasher<uint64_t> hasher;
+  hasher.Update(name, name_size);
+  hasher.Update(bitcode, bitcode_size);
+  return hasher.Digest();
+}
+
+// Write all of `data` into `fd` at `offset`.
+static bool WriteAllAt(int fd, const void *data, size_t size, uint64_t offset) {
+  auto bytes = reinterpret_cast<const uint8_t *>(data);
+  while (size) {
+    auto ret = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+    if (-1 == ret) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return false;
+    }
+    bytes += ret;
+    size -= static_cast<size_t>(ret);
+    offset += static_cast<uint64_t>(ret);
+  }
+  return true;
+}
+
+// Returns `true` if the module indexed by `entry` fits within the first
+// `size` bytes of the archive.
+static bool IsInArchive(const BitcodeArchiveEntry &entry, uint64_t size) {
+  return entry.offset <= size &&
+         entry.name_size <= (size - entry.offset) &&
+         entry.bitcode_size <= (size - entry.offset - entry.name_size);
+}
+
+// Returns the size of the file open as `fd`.
+static uint64_t FileSize(int fd, const std::string &path) {
+  struct stat info = {};
+  CHECK(!fstat(fd, &info))
+      << "Unable to stat " << path << ": " << strerror(errno);
+  return static_cast<uint64_t>(info.st_size);
+}
+
+}  // namespace
+
+BitcodeArchive::BitcodeArchive(
+    const std::string &path_, int fd_, int index_fd_,
+    std::vector<BitcodeArchiveEntry> entries_, uint64_t size_)
+    : path(path_),
+      fd(fd_),
+      index_fd(index_fd_),
+      entries(std::move(entries_)) {
+  if (size_) {
+    auto addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_FILE, fd, 0);
+    if (MAP_FAILED != addr) {
+      mapped_base = addr;
+      mapped_size = size_;
+    } else {
+      LOG(ERROR)
+          << "Unable to map bitcode archive " << path << ": "
+          << strerror(errno);
+    }
+  }
+}
+
+BitcodeArchive::~BitcodeArchive(void) {
+  do {
+    std::lock_guard<std::mutex> locker(lock);
+    stop = true;
+  } while (false);
+  added.notify_one();
+
+  if (writer.joinable()) {
+    writer.join();
+  }
+
+  if (mapped_base) {
+    munmap(mapped_base, mapped_size);
+  }
+  close(index_fd);
+  close(fd);
+}
+
+std::unique_ptr<BitcodeArchive> BitcodeArchive::Open(const std::string &path) {
+  auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  CHECK(-1 != fd)
+      << "Cannot open bitcode archive " << path << ": " << strerror(errno);
+
+  const auto index_path = path + ".index";
+  auto index_fd = open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  CHECK(-1 != index_fd)
+      << "Cannot open bitcode archive index " << index_path << ": "
+      << strerror(errno);
+
+  // Don't read the index while another process is in the middle of
+  // appending to it. The lock is exclusive, as a damaged index is truncated.
+  CHECK(!flock(fd, LOCK_EX))
+      << "Unable to lock bitcode archive " << path << ": " << strerror(errno);
+
+  // A partial entry at the end of the index was left by a crashed writer,
+  // and is overwritten by the next batch.
+  std::vector<BitcodeArchiveEntry> entries(
+      FileSize(index_fd, index_path) / sizeof(BitcodeArchiveEntry));
+  const auto index_size = entries.size() * sizeof(BitcodeArchiveEntry);
+  CHECK(static_cast<ssize_t>(index_size) ==
+            pread(index_fd, entries.data(), index_size, 0))
+      << "Unable to read bitcode archive index " << index_path << ": "
+      << strerror(errno);
+
+  // Anything written after the last indexed module, e.g. by a crashed run,
+  // is never indexed and so is ignored. Conversely, the index can refer to
+  // modules that never made it to disk, e.g. if the system crashed. Those
+  // entries, and everything indexed after them, are dropped.
+  const auto size = FileSize(fd, path);
+  const auto bad_entry_it = std::find_if(
+      entries.begin(), entries.end(),
+      [size] (const BitcodeArchiveEntry &entry) {
+        return !IsInArchive(entry, size);
+      });
+
+  if (bad_entry_it != entries.end()) {
+    const auto num_good_entries = static_cast<size_t>(
+        bad_entry_it - entries.begin());
+    LOG(WARNING)
+        << "Truncating bitcode archive index " << index_path << " from "
+        << entries.size() << " to " << num_good_entries << " entries, as "
+        << "bitcode archive " << path << " is smaller than it says";
+    entries.erase(bad_entry_it, entries.end());
+    const auto good_index_size = num_good_entries *
+                                 sizeof(BitcodeArchiveEntry);
+    if (ftruncate(index_fd, static_cast<off_t>(good_index_size))) {
+      LOG(ERROR)
+          << "Unable to truncate bitcode archive index " << index_path << ": "
+          << strerror(errno);
+    }
+  }
+  flock(fd, LOCK_UN);
+
+  return std::unique_ptr<BitcodeArchive>(
+      new BitcodeArchive(path, fd, index_fd, std::move(entries), size));
+}
+
+void BitcodeArchive::Add(std::string name, std::string bitcode) {
+  do {
+    std::lock_guard<std::mutex> locker(lock);
+    queue.emplace_back(std::move(name), std::move(bitcode));
+    num_added++;
+    if (!writer.joinable()) {
+      writer = std::thread([this] (void) { WriteBatches(); });
+    }
+  } while (false);
+  added.notify_one();
+}
+
+void BitcodeArchive::Flush(void) {
+  std::unique_lock<std::mutex> locker(lock);
+  written.wait(locker, [this] (void) {
+    return num_written == num_added;
+  });
+}
+
+void BitcodeArchive::WriteBatches(void) {
+  std::vector<std::pair<std::string, std::string>> batch;
+  std::vector<BitcodeArchiveEntry> new_entries;
+  std::string data;
+
+  while (true) {
+    do {
+      std::unique_lock<std::mutex> locker(lock);
+      added.wait(locker, [this] (void) {
+        return stop || !queue.empty();
+      });
+      if (queue.empty()) {
+        return;
+      }
+      batch.swap(queue);
+    } while (false);
+
+    // Other processes append to the same archive, so the batch goes at the
+    // end of the archive as it is once we hold the lock.
+    CHECK(!flock(fd, LOCK_EX))
+        << "Unable to lock bitcode archive " << path << ": "
+        << strerror(errno);
+
+    const auto size = FileSize(fd, path);
+    data.clear();
+    new_entries.clear();
+    for (const auto &module : batch) {
+      const auto &name = module.first;
+      const auto &bitcode = module.second;
+      BitcodeArchiveEntry entry = {
+          size + data.size(), name.size(), bitcode.size(),
+          ChecksumModule(name.data(), name.size(),
+                         bitcode.data(), bitcode.size())};
+      new_entries.push_back(entry);
+      data.append(name);
+      data.append(bitcode);
+    }
+
+    // Write the modules, and make sure that they're on disk, before
+    // indexing them, so that the index never refers to missing data.
+    CHECK(WriteAllAt(fd, data.data(), data.size(), size))
+        << "Unable to write to bitcode archive " << path << ": "
+        << strerror(errno);
+    fdatasync(fd);
+
+    const auto index_size = FileSize(index_fd, path + ".index");
+    const auto index_end = index_size - (index_size %
+                                         sizeof(BitcodeArchiveEntry));
+    CHECK(WriteAllAt(index_fd, new_entries.data(),
+                     new_entries.size() * sizeof(BitcodeArchiveEntry),
+                     index_end))
+        << "Unable to write to bitcode archive index " << path << ".index: "
+        << strerror(errno);
+    fdatasync(index_fd);
+
+    flock(fd, LOCK_UN);
+
+    do {
+      std::lock_guard<std::mutex> locker(lock);
+      num_written += batch.size();
+    } while (false);
+    written.notify_all();
+
+    DLOG(INFO)
+        << "Wrote " << batch.size() << " modules to bitcode archive " << path;
+    batch.clear();
+  }
+}
+
+void BitcodeArchive::ForEachModule(
+    const std::function<void(const std::string &, const char *, size_t)> &cb) {
+  if (!mapped_base) {
+    return;
+  }
+
+  const auto base = reinterpret_cast<const char *>(mapped_base);
+  std::string name;
+  for (const auto &entry : entries) {
+    if ((entry.offset + entry.name_size + entry.bitcode_size) > mapped_size) {
+      continue;
+    }
+
+    const auto name_data = &(base[entry.offset]);
+    const auto bitcode = &(name_data[entry.name_size]);
+    if (entry.checksum != ChecksumModule(name_data, entry.name_size,
+                                         bitcode, entry.bitcode_size)) {
+      LOG(ERROR)
+          << "Skipping corrupted module at offset " << entry.offset
+          << " of bitcode archive " << path;
+      continue;
+    }
+
+    name.assign(name_data, entry.name_size);
+    cb(name, bitcode, entry.bitcode_size);
+  }
+}
+
+}  // namespace vmill
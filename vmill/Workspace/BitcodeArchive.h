@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_WORKSPACE_BITCODEARCHIVE_H_
+#define VMILL_WORKSPACE_BITCODEARCHIVE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace vmill {
+
+// Location of one module in a bitcode archive.
+struct BitcodeArchiveEntry {
+  uint64_t offset;
+  uint64_t name_size;
+  uint64_t bitcode_size;
+  uint64_t checksum;
+};
+
+// A single append-only file of lifted bitcode modules, plus an index of where
+// each module is in the file. Modules are added asynchronously; a background
+// thread writes out everything that has been added since its last write as
+// one batch. Several processes can share one archive. Each batch is appended
+// and indexed while holding an exclusive `flock` on the archive.
+class BitcodeArchive {
+ public:
+  ~BitcodeArchive(void);
+
+  static std::unique_ptr<BitcodeArchive> Open(const std::string &path);
+
+  // Queue the module `name` with the bitcode `bitcode` to be written into
+  // the archive.
+  void Add(std::string name, std::string bitcode);
+
+  // Wait until all added modules have been written into the archive.
+  void Flush(void);
+
+  // Invoke `cb(name, data, size)` on every module that was in the archive
+  // when it was opened. The bitcode `data` remains valid for the lifetime of
+  // the archive.
+  void ForEachModule(
+      const std::function<void(const std::string &, const char *, size_t)> &cb);
+
+ private:
+  BitcodeArchive(const std::string &path_, int fd_, int index_fd_,
+                 std::vector<BitcodeArchiveEntry> entries_, uint64_t size_);
+
+  BitcodeArchive(void) = delete;
+
+  // Main loop of the background writer thread.
+  void WriteBatches(void);
+
+  const std::string path;
+  const int fd;
+  const int index_fd;
+
+  // Index entries of the modules that were in the archive when it was
+  // opened.
+  const std::vector<BitcodeArchiveEntry> entries;
+
+  // Read-only mapping of the archive, as it was when it was opened.
+  void *mapped_base{nullptr};
+  size_t mapped_size{0};
+
+  std::mutex lock;
+  std::condition_variable added;
+  std::condition_variable written;
+  std::vector<std::pair<std::string, std::string>> queue;
+  size_t num_added{0};
+  size_t num_written{0};
+  bool stop{false};
+  std::thread writer;
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_WORKSPACE_BITCODEARCHIVE_H_
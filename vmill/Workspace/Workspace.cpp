@@ -118,6 +118,17 @@ const std::string &Workspace::BitcodeDir(void) {
   return path;
 }
 
+const std::string &Workspace::BitcodeArchivePath(void) {
+  static std::string path;
+  if (path.empty()) {
+    std::stringstream ss;
+    ss << Dir() << remill::PathSeparator() << "bitcode.archive";
+    path = ss.str();
+    path = remill::CanonicalPath(path);
+  }
+  return path;
+}
+
 const std::string &Workspace::ToolDir(void) {
   static std::string path;
   if (path.empty()) {
@@ -147,6 +158,17 @@ const std::string &Workspace::LibraryDir(void) {
   return path;
 }
 
+const std::string &Workspace::LibraryIndexPath(void) {
+  static std::string path;
+  if (path.empty()) {
+    std::stringstream ss;
+    ss << ToolDir() << remill::PathSeparator() << "lib.index";
+    path = ss.str();
+    path = remill::CanonicalPath(path);
+  }
+  return path;
+}
+
 static std::string gBuildRuntimDir = VMILL_BUILD_RUNTIME_DIR;
 static std::string gInstallRuntimeDir = VMILL_INSTALL_RUNTIME_DIR;
 
@@ -202,6 +224,17 @@ const std::string &Workspace::RuntimeLibraryPath(void) {
   return path;
 }
 
+const std::string &Workspace::CodeCachePath(void) {
+  static std::string path;
+  if (path.empty()) {
+    std::stringstream ss;
+    ss << ToolDir() << remill::PathSeparator() << "code.cache";
+    path = ss.str();
+    path = remill::CanonicalPath(path);
+  }
+  return path;
+}
+
 namespace {
 
 using AddressSpaceIdToMemoryMap = \
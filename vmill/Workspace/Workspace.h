@@ -29,10 +29,13 @@ class Workspace {
   static const std::string &IndexPath(void);
   static const std::string &MemoryDir(void);
   static const std::string &BitcodeDir(void);
+  static const std::string &BitcodeArchivePath(void);
   static const std::string &ToolDir(void);
   static const std::string &LibraryDir(void);
+  static const std::string &LibraryIndexPath(void);
   static const std::string &RuntimeBitcodePath(void);
   static const std::string &RuntimeLibraryPath(void);
+  static const std::string &CodeCachePath(void);
 
   static void LoadSnapshotIntoExecutor(
       const ProgramSnapshotPtr &snapshot, Executor &executor);